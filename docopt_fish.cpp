@@ -3,12 +3,22 @@
 #include "docopt_fish_grammar.h"
 #include <assert.h>
 #include <string.h>
+#include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <math.h>
+#include <time.h>
 #include <iostream>
 #include <numeric>
 #include <algorithm>
 #include <set>
+#include <list>
+#include <deque>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #if defined(_LIBCPP_VERSION) || __cplusplus > 199711L
 // C++11 or libc++ (which is a C++11-only library, but the memory header works OK in C++03)
@@ -33,6 +43,108 @@ typedef std::vector<size_t> index_list_t;
 /* Class representing a map from variable names to commands */
 typedef std::map<rstring_t, rstring_t> variable_command_map_t;
 
+/* A hash table from names to values, for lookups by name that neither allocate nor compare against every name. Entries are kept in the order they were inserted. Names are compared by their characters, so a narrow name finds a wide one. */
+template<typename value_t>
+class name_index_t {
+    public:
+    typedef std::pair<rstring_t, value_t> entry_t;
+    
+    private:
+    std::vector<entry_t> entries_;
+    
+    /* Open addressing with linear probing. Each slot holds an index into entries_ plus one, or 0 if empty. The size is a power of two, and at most half the slots are used. */
+    std::vector<size_t> slots_;
+    
+    /* Returns the slot for name: either the one holding it, or the empty one where it would go */
+    size_t slot_for(const rstring_t &name) const {
+        const size_t mask = this->slots_.size() - 1;
+        size_t slot = name.hash() & mask;
+        while (this->slots_[slot] != 0 && this->entries_[this->slots_[slot] - 1].first != name) {
+            slot = (slot + 1) & mask;
+        }
+        return slot;
+    }
+    
+    void rehash(size_t slot_count) {
+        this->slots_.assign(slot_count, 0);
+        for (size_t i=0; i < this->entries_.size(); i++) {
+            this->slots_[this->slot_for(this->entries_[i].first)] = i + 1;
+        }
+    }
+    
+    public:
+    /* Adds name with value. Returns false, changing nothing, if name is already present. */
+    bool insert(const rstring_t &name, const value_t &value) {
+        if (2 * (this->entries_.size() + 1) > this->slots_.size()) {
+            this->rehash(std::max(this->slots_.size() * 2, (size_t)16));
+        }
+        size_t slot = this->slot_for(name);
+        if (this->slots_[slot] != 0) {
+            return false;
+        }
+        this->entries_.push_back(entry_t(name, value));
+        this->slots_[slot] = this->entries_.size();
+        return true;
+    }
+    
+    /* Returns the value for name, or NULL if it is not present */
+    const value_t *find(const rstring_t &name) const {
+        if (this->entries_.empty()) {
+            return NULL;
+        }
+        size_t idx = this->slots_[this->slot_for(name)];
+        return idx ? &this->entries_[idx - 1].second : NULL;
+    }
+    
+    const std::vector<entry_t> &entries() const {
+        return this->entries_;
+    }
+    
+    const std::vector<size_t> &slots() const {
+        return this->slots_;
+    }
+    
+    /* Takes over entries and slots, as returned by entries() and slots() of an index, so that the index need not be built again. Returns false, leaving the index empty, if the slots are not a table of the entries: a power of two of them, at most half used, each entry in exactly one. */
+    bool assign(std::vector<entry_t> *entries, std::vector<size_t> *slots) {
+        this->clear();
+        const size_t slot_count = slots->size();
+        if (entries->empty() ? slot_count != 0 : (slot_count & (slot_count - 1)) != 0 || 2 * entries->size() > slot_count) {
+            return false;
+        }
+        std::vector<bool> seen(entries->size(), false);
+        size_t used = 0;
+        for (size_t i=0; i < slot_count; i++) {
+            const size_t idx = slots->at(i);
+            if (idx > entries->size() || (idx != 0 && seen.at(idx - 1))) {
+                return false;
+            }
+            if (idx != 0) {
+                seen.at(idx - 1) = true;
+                used++;
+            }
+        }
+        if (used != entries->size()) {
+            return false;
+        }
+        this->entries_.swap(*entries);
+        this->slots_.swap(*slots);
+        return true;
+    }
+    
+    size_t size() const {
+        return this->entries_.size();
+    }
+    
+    void clear() {
+        this->entries_.clear();
+        this->slots_.clear();
+    }
+    
+    size_t memory_estimate() const {
+        return this->entries_.capacity() * sizeof(entry_t) + this->slots_.capacity() * sizeof(size_t);
+    }
+};
+
 // This represents an error in argv, i.e. the docopt description was OK but a parameter contained an error
 static void append_argv_error(error_list_t *errors, size_t arg_idx, int code, const char *txt, size_t pos_in_arg = 0) {
     append_error(errors, pos_in_arg, code, txt, arg_idx);
@@ -272,30 +384,19 @@ struct clause_collector_t : public node_visitor_t<clause_collector_t> {
     void accept(const IGNORED_TYPE& t UNUSED) {}
 };
 
-/* Helper to efficiently iterate over lines of a string 'base'. inout_line should be initially empty. On return, it will contain the line, with its end pointing just after the trailing newline, or possibly at the end. Returns true if a line was returned, false if we reached the end. */
-static bool get_next_line(const rstring_t &base, rstring_t *inout_line) {
-    assert(inout_line != NULL);
-    if (inout_line->end() == base.end()) {
-        // Line exhausted
-        return false;
-    }
+/* Helper class for estimating the memory used by a tree */
+struct node_size_counter_t : public node_visitor_t<node_size_counter_t> {
+    size_t total;
+    node_size_counter_t() : total(0) {}
     
-    // Start at the end of the last line, or zero if this is the first call
-    // Subtract off base.start() to make the line_start relative to base
-    size_t line_start = (inout_line->empty() ? 0 : inout_line->end() - base.start());
-    rstring_t remainder = base.substr_from(line_start);
-    size_t newline = remainder.find("\n");
-    if (newline == rstring_t::npos) {
-        // Take everything
-        *inout_line = remainder;
-    } else {
-        // Take through the newline
-        *inout_line = remainder.substr(0, newline+1);
+    // Tokens are stored inline in their nodes
+    void accept(const rstring_t &t UNUSED) {}
+    
+    template<typename NODE_TYPE>
+    void accept(const NODE_TYPE& node UNUSED) {
+        total += sizeof(NODE_TYPE);
     }
-    // Empty lines are impossible
-    assert(! inout_line->empty());
-    return true;
-}
+};
 
 /* A resolved option references an option in argv */
 struct resolved_option_t {
@@ -456,44 +557,112 @@ static size_t compute_indent(const rstring_t &src, const rstring_t &trimmed_src)
     return result;
 }
 
-/* Given a list of options, verify that any duplicate options are in agreement, and remove all but one. TODO: Can we make this not N^2 without heap allocation? */
+/* A line of a source, as returned by get_next_line */
+struct source_line_t {
+    // The line, with its end pointing just after the trailing newline, or possibly at the end of the source
+    rstring_t line;
+    
+    // The line with leading and trailing whitespace trimmed
+    rstring_t trimmed;
+    
+    // The indent of trimmed within line, per compute_indent
+    size_t indent;
+    
+    source_line_t() : indent(0) {}
+};
+
+/* Helper to efficiently iterate over lines of a string 'base'. inout_line should be initially empty. On return, it will contain the line, trimmed and with its indent computed, so that callers that look at a line more than once do not measure it again. Returns true if a line was returned, false if we reached the end. */
+static bool get_next_line(const rstring_t &base, source_line_t *inout_line) {
+    assert(inout_line != NULL);
+    rstring_t *line = &inout_line->line;
+    if (line->end() == base.end()) {
+        // Line exhausted
+        return false;
+    }
+    
+    // Start at the end of the last line, or zero if this is the first call
+    // Subtract off base.start() to make the line_start relative to base
+    size_t line_start = (line->empty() ? 0 : line->end() - base.start());
+    size_t newline = base.find_newline(line_start);
+    // Take through the newline, or everything if there is none
+    size_t line_end = (newline == rstring_t::npos ? base.length() : newline + 1);
+    *line = base.substr(line_start, line_end - line_start);
+    // Empty lines are impossible
+    assert(! line->empty());
+    inout_line->trimmed = line->trim_whitespace();
+    inout_line->indent = compute_indent(*line, inout_line->trimmed);
+    return true;
+}
+
+/* Given a list of options, verify that any duplicate options are in agreement, and remove all but one. The first option with a name represents all of the later options that share a name with it, and gets the longest of their descriptions. Representatives keep their order. */
 static void uniqueize_options(option_list_t *options, bool error_on_duplicates, error_list_t *errors) {
-    // Maintain an outer cursor. For each option, loop over the remainder, deleting those that share a name
-    // Grab the best description as we go
-    // We "delete" from the middle of the vector by moving the last element into the slot, and then decrementing the length
-    size_t options_count = options->size(); // note this changes as we go
-    for (size_t outer = 0; outer < options_count; outer++) {
-        option_t *representative = &options->at(outer);
-
-        // Find all options that share a name with this representative
-        // Determine which one is best
-        // Overwrite them with an empty option, so we skip them next
-        for (size_t match_cursor = outer + 1; match_cursor < options_count; match_cursor++) {
-            option_t *candidate = &options->at(match_cursor);
-            if (! representative->has_same_name(*candidate)) {
-                continue;
+    // Map each name of each representative to its index in unique_options. Names are only equal if they are of the same type.
+    option_list_t unique_options;
+    unique_options.reserve(options->size());
+    name_index_t<size_t> representatives[option_t::NAME_TYPE_COUNT];
+    for (size_t i=0; i < options->size(); i++) {
+        const option_t &candidate = options->at(i);
+        
+        // If this shares names with several representatives, the earliest one gets it
+        size_t rep_idx = npos;
+        for (size_t type_idx=0; type_idx < option_t::NAME_TYPE_COUNT; type_idx++) {
+            const size_t *where = candidate.names[type_idx].empty() ? NULL : representatives[type_idx].find(candidate.names[type_idx]);
+            if (where != NULL && *where < rep_idx) {
+                rep_idx = *where;
             }
-            
-            // Ok, we know that candidate has the same name as the best match
-            // Generate an error if we're supposed to
-            // TODO: verify agreement in the parameters, etc.
-            // Then we copy the description over if it's better, then "erase" the candidate
-            // That will cause us to skip over it later
-            if (error_on_duplicates) {
-                // Generate an error, and then continue on
-                append_docopt_error(errors, candidate->best_name(), error_option_duplicated_in_options_section, "Option specified more than once");
-            }
-            if (candidate->description.length() > representative->description.length()) {
-                representative->description = candidate->description;
+        }
+        
+        if (rep_idx == npos) {
+            // A new representative
+            for (size_t type_idx=0; type_idx < option_t::NAME_TYPE_COUNT; type_idx++) {
+                if (! candidate.names[type_idx].empty()) {
+                    representatives[type_idx].insert(candidate.names[type_idx], unique_options.size());
+                }
             }
-            
-            // "Delete" candidate by overwriting it with the last value, and decrementing the count
-            *candidate = options->back();
-            options->pop_back();
-            options_count -= 1;
-            match_cursor -= 1; // have to re-evaluate this value
+            unique_options.push_back(candidate);
+            continue;
+        }
+        
+        // The candidate is a duplicate. Generate an error if we're supposed to, and take its description if it's better.
+        // TODO: verify agreement in the parameters, etc.
+        option_t *representative = &unique_options.at(rep_idx);
+        if (error_on_duplicates) {
+            append_docopt_error(errors, candidate.best_name(), error_option_duplicated_in_options_section, "Option specified more than once");
+        }
+        if (candidate.description.length() > representative->description.length()) {
+            representative->description = candidate.description;
+        }
+    }
+    options->swap(unique_options);
+}
+
+/* Removes from options every option that shares a name with one in others */
+static void remove_options_named_in(option_list_t *options, const option_list_t &others) {
+    name_index_t<bool> other_names[option_t::NAME_TYPE_COUNT];
+    for (size_t i=0; i < others.size(); i++) {
+        for (size_t type_idx=0; type_idx < option_t::NAME_TYPE_COUNT; type_idx++) {
+            if (! others.at(i).names[type_idx].empty()) {
+                other_names[type_idx].insert(others.at(i).names[type_idx], true);
+            }
+        }
+    }
+    
+    // Compact the options we keep towards the front, preserving their order
+    size_t kept = 0;
+    for (size_t i=0; i < options->size(); i++) {
+        const option_t &opt = options->at(i);
+        bool named_in_others = false;
+        for (size_t type_idx=0; type_idx < option_t::NAME_TYPE_COUNT && ! named_in_others; type_idx++) {
+            named_in_others = ! opt.names[type_idx].empty() && other_names[type_idx].find(opt.names[type_idx]) != NULL;
+        }
+        if (! named_in_others) {
+            if (kept != i) {
+                options->at(kept) = opt;
+            }
+            kept++;
         }
     }
+    options->resize(kept);
 }
 
 /* Transient stack-allocated data associated with separating argv */
@@ -787,60 +956,65 @@ static bool parse_short(argv_separation_state_t *st, resolved_option_list_t *out
 }
 
 
+/* Separates the argument at st->idx, which may also consume the arguments after it (like the value of an option). This looks at no more than two arguments past st->idx. */
+static void separate_one_argument(argv_separation_state_t *st, positional_argument_list_t *out_positionals, resolved_option_list_t *out_resolved_options, error_list_t *out_errors, rstring_t *out_suggestion) {
+    if (st->saw_double_dash) {
+        // double-dash means everything remaining is positional
+        out_positionals->push_back(positional_argument_t(st->idx));
+        st->idx += 1;
+    } else if (st->has_double_dash_at(st->idx)) {
+        // Literal --. The remaining arguments are positional.
+        st->saw_double_dash = true;
+        st->idx += 1;
+    } else if (st->arg().has_prefix("--")) {
+        // Leading long option
+        if (parse_long(st, option_t::double_long, out_resolved_options, out_errors, out_suggestion)) {
+            // parse_long will have updated st->idx and out_resolved_options
+        } else {
+            // This argument is unused
+            // We have to update idx
+            st->idx += 1;
+        }
+    } else if (st->arg().has_prefix("-") && st->arg().length() > 1) {
+        /* An option with a leading dash, like -foo
+         This can be a lot of different things:
+         1. A combined short option: tar -cf ...
+         2. A long option with a single dash: -std=c++
+         3. A short option with a value: -DNDEBUG
+         Try to parse it as a long option; if that fails try to parse it as a short option.
+         We cache the errors locally so that failing to parse it as a long option doesn't report an error if it parses successfully as a short option. This may result in duplicate error messages.
+         */
+        error_list_t local_long_errors, local_short_errors;
+        if (parse_long(st, option_t::single_long, out_resolved_options, &local_long_errors, out_suggestion)) {
+            // parse_long succeeded
+        } else if (parse_unseparated_short(st, out_resolved_options, &local_short_errors, out_suggestion)) {
+            // parse_unseparated_short will have updated idx and out_resolved_options
+        } else if (parse_short(st, out_resolved_options, &local_short_errors, out_suggestion)) {
+            // parse_short succeeded.
+        } else {
+            /* Unparseable argument.
+             Say the user enters -Dfoo. This may be an unknown long option, or a short option with a value. If there is a short option -D, then it is more likely that the error from the short option parsing is what we want. So ensure the short erorrs appear at the front of the list. */
+            if (out_errors) {
+                out_errors->insert(out_errors->begin(), local_long_errors.begin(), local_long_errors.end());
+                out_errors->insert(out_errors->begin(), local_short_errors.begin(), local_short_errors.end());
+            }
+            st->idx += 1;
+        }
+    } else {
+        // Positional argument
+        // Note this includes just single-dash arguments, which are often a stand-in for stdin
+        out_positionals->push_back(positional_argument_t(st->idx));
+        st->idx += 1;
+    }
+}
+
 /* The Python implementation calls this "parse_argv" */
 static void separate_argv_into_options_and_positionals(const rstring_list_t &argv, const option_list_t &options, parse_flags_t flags, positional_argument_list_t *out_positionals, resolved_option_list_t *out_resolved_options, error_list_t *out_errors, rstring_t *out_suggestion = NULL) {
     
     // double_dash means that all remaining values are arguments
     argv_separation_state_t st(argv, options, flags);
     while (st.idx < argv.size()) {
-        if (st.saw_double_dash) {
-            // double-dash means everything remaining is positional
-            out_positionals->push_back(positional_argument_t(st.idx));
-            st.idx += 1;
-        } else if (st.has_double_dash_at(st.idx)) {
-            // Literal --. The remaining arguments are positional.
-            st.saw_double_dash = true;
-            st.idx += 1;
-        } else if (st.arg().has_prefix("--")) {
-            // Leading long option
-            if (parse_long(&st, option_t::double_long, out_resolved_options, out_errors, out_suggestion)) {
-                // parse_long will have updated st.idx and out_resolved_options
-            } else {
-                // This argument is unused
-                // We have to update idx
-                st.idx += 1;
-            }
-        } else if (st.arg().has_prefix("-") && st.arg().length() > 1) {
-            /* An option with a leading dash, like -foo
-             This can be a lot of different things:
-             1. A combined short option: tar -cf ...
-             2. A long option with a single dash: -std=c++
-             3. A short option with a value: -DNDEBUG
-             Try to parse it as a long option; if that fails try to parse it as a short option.
-             We cache the errors locally so that failing to parse it as a long option doesn't report an error if it parses successfully as a short option. This may result in duplicate error messages.
-             */
-            error_list_t local_long_errors, local_short_errors;
-            if (parse_long(&st, option_t::single_long, out_resolved_options, &local_long_errors, out_suggestion)) {
-                // parse_long succeeded
-            } else if (parse_unseparated_short(&st, out_resolved_options, &local_short_errors, out_suggestion)) {
-                // parse_unseparated_short will have updated idx and out_resolved_options
-            } else if (parse_short(&st, out_resolved_options, &local_short_errors, out_suggestion)) {
-                // parse_short succeeded.
-            } else {
-                /* Unparseable argument.
-                 Say the user enters -Dfoo. This may be an unknown long option, or a short option with a value. If there is a short option -D, then it is more likely that the error from the short option parsing is what we want. So ensure the short erorrs appear at the front of the list. */
-                if (out_errors) {
-                    out_errors->insert(out_errors->begin(), local_long_errors.begin(), local_long_errors.end());
-                    out_errors->insert(out_errors->begin(), local_short_errors.begin(), local_short_errors.end());
-                }
-                st.idx += 1;
-            }
-        } else {
-            // Positional argument
-            // Note this includes just single-dash arguments, which are often a stand-in for stdin
-            out_positionals->push_back(positional_argument_t(st.idx));
-            st.idx += 1;
-        }
+        separate_one_argument(&st, out_positionals, out_resolved_options, out_errors, out_suggestion);
     }
 }
 
@@ -849,12 +1023,58 @@ static void separate_argv_into_options_and_positionals(const rstring_list_t &arg
 #pragma mark -
 
 
-/* The result of parsing argv */
-typedef std::map<rstring_t, base_argument_t<rstring_t> > option_rmap_t;
+/* An argument in the result of matching. This is like base_argument_t, but also remembers where in argv the argument was first matched, so that results can be reported in argv order. */
+struct rargument_t {
+    // Nearly every argument has zero or one values; store up to two without allocating, since states (and so their arguments) are copied freely during matching
+    inline_list_t<rstring_t, 2> values;
+    unsigned int count;
+    
+    // Index in argv of the first argument matching this one. npos if none, e.g. for default values.
+    size_t first_argv_idx;
+    
+    void note_argv_idx(size_t idx) {
+        this->first_argv_idx = std::min(this->first_argv_idx, idx);
+    }
+    
+    rargument_t() : count(0), first_argv_idx(npos) {}
+};
+
+/* A matched argument, along with the index of its name in the impl's result_keys */
+struct keyed_rargument_t {
+    size_t key_idx;
+    rargument_t arg;
+};
+
+/* The result of parsing argv: the matched arguments, sorted by key_idx (and so by name). States are copied freely during matching, and a flat list copies with one allocation. */
+typedef std::vector<keyed_rargument_t> rargument_list_t;
+
+static bool key_idx_less_than(const keyed_rargument_t &lhs, size_t key_idx) {
+    return lhs.key_idx < key_idx;
+}
+
+/* Returns the argument for a key in a result, adding it if necessary. The pointer is invalidated by the next addition. */
+static rargument_t *argument_for_key(rargument_list_t *args, size_t key_idx) {
+    rargument_list_t::iterator where = std::lower_bound(args->begin(), args->end(), key_idx, key_idx_less_than);
+    if (where == args->end() || where->key_idx != key_idx) {
+        keyed_rargument_t added;
+        added.key_idx = key_idx;
+        where = args->insert(where, added);
+    }
+    return &where->arg;
+}
+
+/* Returns the index of a name in a sorted list of keys, or npos if it is not there */
+static size_t index_of_key(const rstring_list_t &keys, const rstring_t &name) {
+    rstring_list_t::const_iterator where = std::lower_bound(keys.begin(), keys.end(), name);
+    if (where == keys.end() || *where != name) {
+        return npos;
+    }
+    return where - keys.begin();
+}
 
 struct match_state_t {
-    // Map from option names to arguments
-    option_rmap_t argument_values;
+    // The arguments matched so far
+    rargument_list_t argument_values;
     
     // Next positional to dequeue
     size_t next_positional_index;
@@ -867,7 +1087,10 @@ struct match_state_t {
     // Whether this match has fully consumed all positionals and options
     bool fully_consumed;
     
-    match_state_t() : next_positional_index(0), fully_consumed(false) {}
+    // Whether the budget ran out while matching this state, so that it was finished without branching (see finish_without_branching). Such a state is an incomplete match.
+    bool truncated;
+    
+    match_state_t() : next_positional_index(0), fully_consumed(false), truncated(false) {}
     
     void swap(match_state_t &rhs) {
         this->argument_values.swap(rhs.argument_values);
@@ -875,6 +1098,7 @@ struct match_state_t {
         this->suggested_next_arguments.swap(rhs.suggested_next_arguments);
         std::swap(this->next_positional_index, rhs.next_positional_index);
         std::swap(this->fully_consumed, rhs.fully_consumed);
+        std::swap(this->truncated, rhs.truncated);
     }
     
     
@@ -895,6 +1119,35 @@ struct match_state_t {
 
 typedef std::vector<match_state_t> match_state_list_t;
 
+/* What matching one usage produced. A usage's match depends only on the resolved options and on its first positionals_examined positionals, so an argv session keeps these and reuses each while those are unchanged. */
+struct usage_match_t {
+    match_state_list_t states;
+    size_t positionals_examined;
+    bool valid;
+    
+    usage_match_t() : positionals_examined(0), valid(false) {}
+};
+typedef std::vector<usage_match_t> usage_match_list_t;
+
+/* Returns the time on the monotonic clock, in seconds */
+static double monotonic_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1.0e9;
+}
+
+void match_budget_t::set_timeout(double seconds) {
+    this->deadline = monotonic_seconds() + seconds;
+}
+
+void match_budget_t::cancel() {
+    __atomic_store_n(&this->cancelled, 1, __ATOMIC_RELAXED);
+}
+
+bool match_budget_t::is_cancelled() const {
+    return __atomic_load_n(&this->cancelled, __ATOMIC_RELAXED) != 0;
+}
+
 struct match_context_t {
 private:
     /** Returns true if the state has consumed all positionals and options */
@@ -921,8 +1174,22 @@ public:
     const resolved_option_list_t &resolved_options;
     const rstring_list_t &argv;
     
+    /* The impl's result_keys, which every name we match is among */
+    const rstring_list_t &result_keys;
+    
+    /* If not empty, only names with this prefix are suggested (see suggest) */
+    rstring_t suggestion_prefix;
+    
+    /* Adds name to the state's suggested next arguments, unless it cannot complete suggestion_prefix. Any text may be the value of a variable, so variables are always suggested. */
+    void suggest(match_state_t *state, const rstring_t &name) const {
+        if (this->suggestion_prefix.empty() || name.has_prefix(this->suggestion_prefix) || name.has_prefix("<")) {
+            state->suggested_next_arguments.insert(name);
+        }
+    }
+    
     bool has_more_positionals(const match_state_t *state) const {
         assert(state->next_positional_index <= this->positionals.size());
+        this->note_positional_examined(state->next_positional_index);
         return state->next_positional_index < this->positionals.size();
     }
     
@@ -982,34 +1249,101 @@ public:
         return unused_argv_idxs;
     }
     
+    /* Returns the argument for a matched name in the state, adding it if necessary */
+    rargument_t *argument_named(match_state_t *state, const rstring_t &name) const {
+        size_t key_idx = index_of_key(this->result_keys, name);
+        assert(key_idx != npos && "Matched a name that is not a result key");
+        return argument_for_key(&state->argument_values, key_idx);
+    }
+    
     const positional_argument_t &next_positional(match_state_t *state) const {
         assert(state->next_positional_index < positionals.size());
+        this->note_positional_examined(state->next_positional_index);
         return positionals.at(state->next_positional_index);
     }
     
     const positional_argument_t &acquire_next_positional(match_state_t *state) const {
         assert(state->next_positional_index < positionals.size());
+        this->note_positional_examined(state->next_positional_index);
         return positionals.at(state->next_positional_index++);
     }
     
-    match_context_t(parse_flags_t f, const option_list_t &shortcut_opts, const positional_argument_list_t &p, const resolved_option_list_t &r, const rstring_list_t &av) : flags(f), shortcut_options(shortcut_opts), positionals(p), resolved_options(r), argv(av)
-    {}
+    /* The caller's budget, or NULL if unlimited */
+    match_budget_t * const budget;
+    
+    /* How many times out_of_budget has been called, so that the clock is only read periodically */
+    size_t budget_checks;
+    
+    /* If not NULL, one per usage. Usages with a valid match here are not matched again, and what the others match is stored for next time. */
+    usage_match_list_t * const usage_matches;
+    
+    /* One more than the index of the last positional looked at (even to find that there is none) since this was last reset */
+    mutable size_t positionals_examined;
+    
+    void note_positional_examined(size_t idx) const {
+        this->positionals_examined = std::max(this->positionals_examined, idx + 1);
+    }
+    
+    match_context_t(parse_flags_t f, const option_list_t &shortcut_opts, const positional_argument_list_t &p, const resolved_option_list_t &r, const rstring_list_t &av, const rstring_list_t &keys, match_budget_t *b = NULL, usage_match_list_t *um = NULL) : flags(f), shortcut_options(shortcut_opts), positionals(p), resolved_options(r), argv(av), result_keys(keys), budget(b), budget_checks(0), usage_matches(um), positionals_examined(0)
+    {
+        if (this->budget != NULL) {
+            this->budget->states_created = 0;
+            this->budget->truncated = false;
+            this->budget->timed_out = false;
+        }
+    }
+    
+    void note_state_created() {
+        if (this->budget != NULL) {
+            this->budget->states_created++;
+        }
+    }
+    
+    /* Returns true if the budget is used up, the deadline has passed, or the query was cancelled. Once any happens, nodes stop matching and pass their states through unchanged, so that the states already on their way still finish, and the best of them is the result. */
+    bool out_of_budget() {
+        match_budget_t *b = this->budget;
+        if (b == NULL) {
+            return false;
+        } else if (b->truncated) {
+            return true;
+        }
+        
+        if (b->max_states > 0 && b->states_created >= b->max_states) {
+            b->truncated = true;
+        } else if (b->is_cancelled()) {
+            b->truncated = true;
+        } else if (b->deadline > 0 && this->budget_checks++ % 64 == 0 && monotonic_seconds() >= b->deadline) {
+            b->truncated = true;
+            b->timed_out = true;
+        }
+        return b->truncated;
+    }
+    
+    /* Whether a clause with nothing left to match may let a state through. Once the budget runs out this is always allowed, so that a state cut short is finished as an incomplete match. */
+    bool allows_incomplete() const {
+        return (this->flags & flag_match_allow_incomplete) || (this->budget != NULL && this->budget->truncated);
+    }
     
-    /* If we want to stop a search and this state has consumed everything, stop the search */
+    /* If we want to stop a search and this state has consumed everything, stop the search. A truncated state is incomplete, so it never stops the search. */
     void try_mark_fully_consumed(match_state_t *state) {
-        if ((this->flags & flag_stop_after_consuming_everything) && this->has_consumed_everything(state)) {
+        if ((this->flags & flag_stop_after_consuming_everything) && ! state->truncated && this->has_consumed_everything(state)) {
             state->fully_consumed = true;
         }
     }
 };
 
 // TODO: yuck
-static void state_destructive_append_to(match_state_t *state, match_state_list_t *dest) {
+// ctx may be NULL, for states that are passed through rather than created
+static void state_destructive_append_to(match_state_t *state, match_state_list_t *dest, match_context_t *ctx) {
+    if (ctx != NULL) {
+        ctx->note_state_created();
+    }
     dest->resize(dest->size() + 1);
     dest->back().swap(*state);
 }
 
-static void state_append_to(const match_state_t *state, match_state_list_t *dest) {
+static void state_append_to(const match_state_t *state, match_state_list_t *dest, match_context_t *ctx) {
+    ctx->note_state_created();
     dest->resize(dest->size() + 1);
     dest->back() = *state;
 }
@@ -1023,11 +1357,57 @@ static void match(const simple_clause_t &node, match_state_t *state, match_conte
 static void match(const option_clause_t &node, match_state_t *state, match_context_t *ctx, match_state_list_t *resulting_states);
 static void match(const fixed_clause_t &node, match_state_t *state, match_context_t *ctx, match_state_list_t *resulting_states);
 static void match(const variable_clause_t &node, match_state_t *state, match_context_t *ctx, match_state_list_t *resulting_states);
+static void match_node(const alternation_list_t &node, match_state_t *state, match_context_t *ctx, match_state_list_t *resulting_states);
+static void match_node(const expression_t &node, match_state_t *state, match_context_t *ctx, match_state_list_t *resulting_states);
+
+
+/* Returns true if some state was matched without being cut short by the budget */
+static bool has_untruncated_state(const match_state_list_t &states) {
+    for (size_t i=0; i < states.size(); i++) {
+        if (! states.at(i).truncated) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Keeps only the state at or after first that has made the most progress, or the earliest of those that tie */
+static void keep_most_progress(match_state_list_t *states, size_t first) {
+    if (states->size() <= first + 1) {
+        return;
+    }
+    size_t best = first;
+    size_t best_progress = states->at(first).progress();
+    for (size_t i=first + 1; i < states->size(); i++) {
+        size_t progress = states->at(i).progress();
+        if (progress > best_progress) {
+            best = i;
+            best_progress = progress;
+        }
+    }
+    if (best != first) {
+        states->at(first).swap(states->at(best));
+    }
+    states->resize(first + 1);
+}
 
+/* Once the budget runs out, a node stops branching, but still lets each state finish: of what the node matches, only the state that made the most progress is kept, and clauses with nothing left to match let it through (see match_context_t::allows_incomplete). The state is marked truncated, since a full match might have found something better. */
+template<typename T>
+static void finish_without_branching(const T &node, match_state_t *state, match_context_t *ctx, match_state_list_t *resulting_states) {
+    state->truncated = true;
+    state->fully_consumed = false;
+    size_t first_result = resulting_states->size();
+    match_node(node, state, ctx, resulting_states);
+    keep_most_progress(resulting_states, first_result);
+}
 
 // TODO: comment me
 template<typename T>
 static void match_list(const T& node, match_state_list_t *incoming_state_list, match_context_t *ctx, match_state_list_t *resulting_states, bool require_progress = false) {
+    if (ctx->out_of_budget()) {
+        // Only the furthest along of the states will be finished
+        keep_most_progress(incoming_state_list, 0);
+    }
     if (! incoming_state_list->empty()) {
         for (size_t i=0; i < incoming_state_list->size(); i++) {
             match_state_t *state = &incoming_state_list->at(i);
@@ -1059,6 +1439,28 @@ static void match_list(const T& node, match_state_list_t *incoming_state_list, m
 }
 
 
+/* Matches the usage at idx, or reuses what it matched before if the context has usage matches */
+static void match_usage_at(const vector<usage_t> &usages, size_t idx, match_state_t *state, match_context_t *ctx, match_state_list_t *resulting_states) {
+    if (ctx->usage_matches == NULL) {
+        match(usages.at(idx), state, ctx, resulting_states);
+        return;
+    }
+    
+    usage_match_t *usage_match = &ctx->usage_matches->at(idx);
+    if (usage_match->valid) {
+        resulting_states->insert(resulting_states->end(), usage_match->states.begin(), usage_match->states.end());
+        return;
+    }
+    
+    size_t first_result = resulting_states->size();
+    ctx->positionals_examined = 0;
+    match(usages.at(idx), state, ctx, resulting_states);
+    usage_match->states.assign(resulting_states->begin() + first_result, resulting_states->end());
+    usage_match->positionals_examined = ctx->positionals_examined;
+    // A usage cut short by the budget may not have matched everything it could
+    usage_match->valid = (ctx->budget == NULL || ! ctx->budget->truncated);
+}
+
 /* Match overrides */
 static void match(const vector<usage_t> &usages, match_state_t *state, match_context_t *ctx, match_state_list_t *resulting_states) {
     // Elide the copy in the last one
@@ -1068,9 +1470,9 @@ static void match(const vector<usage_t> &usages, match_state_t *state, match_con
     }
     
     bool fully_consumed = false;
-    for (size_t i=0; i + 1 < count && ! fully_consumed; i++) {
+    for (size_t i=0; i + 1 < count && ! fully_consumed && ! ctx->out_of_budget(); i++) {
         match_state_t copied_state = *state;
-        match(usages.at(i), &copied_state, ctx, resulting_states);
+        match_usage_at(usages, i, &copied_state, ctx, resulting_states);
         
         if (ctx->flags & flag_stop_after_consuming_everything) {
             size_t idx = resulting_states->size();
@@ -1082,8 +1484,8 @@ static void match(const vector<usage_t> &usages, match_state_t *state, match_con
             }
         }
     }
-    if (! fully_consumed) {
-        match(usages.at(count-1), state, ctx, resulting_states);
+    if (! fully_consumed && ! ctx->out_of_budget()) {
+        match_usage_at(usages, count-1, state, ctx, resulting_states);
     }
 }
 
@@ -1109,7 +1511,7 @@ static void match(const expression_list_t &node, match_state_t *state, match_con
     size_t count = node.expressions.size();
     if (count == 0) {
         // Merely append this state
-        state_destructive_append_to(state, resulting_states);
+        state_destructive_append_to(state, resulting_states, ctx);
     } else if (count == 1) {
         // Just one expression, trivial
         match(node.expressions.at(0), state, ctx, resulting_states);
@@ -1129,6 +1531,14 @@ static void match(const expression_list_t &node, match_state_t *state, match_con
 }
 
 static void match(const alternation_list_t &node, match_state_t *state, match_context_t *ctx, match_state_list_t *resulting_states) {
+    if (ctx->out_of_budget()) {
+        finish_without_branching(node, state, ctx, resulting_states);
+    } else {
+        match_node(node, state, ctx, resulting_states);
+    }
+}
+
+static void match_node(const alternation_list_t &node, match_state_t *state, match_context_t *ctx, match_state_list_t *resulting_states) {
     size_t count = node.alternations.size();
     if (count == 0) {
         return;
@@ -1142,6 +1552,14 @@ static void match(const alternation_list_t &node, match_state_t *state, match_co
 
 static bool match_options(const option_list_t &options_in_doc, match_state_t *state, match_context_t *ctx, match_state_list_t *resulting_states);
 static void match(const expression_t &node, match_state_t *state, match_context_t *ctx, match_state_list_t *resulting_states) {
+    if (ctx->out_of_budget()) {
+        finish_without_branching(node, state, ctx, resulting_states);
+    } else {
+        match_node(node, state, ctx, resulting_states);
+    }
+}
+
+static void match_node(const expression_t &node, match_state_t *state, match_context_t *ctx, match_state_list_t *resulting_states) {
     // Check to see if we have ellipsis. If so, we keep going as long as we can.
     bool has_ellipsis = node.opt_ellipsis.present;
     
@@ -1194,7 +1612,7 @@ static void match(const expression_t &node, match_state_t *state, match_context_
              Same algorithm as the simple clause above, except that we also append the initial state as a not-taken branch.
              */
             assert(node.alternation_list.get() != NULL);
-            state_append_to(state, resulting_states);  // append the not-taken-branch
+            state_append_to(state, resulting_states, ctx);  // append the not-taken-branch
             size_t prior_state_count = resulting_states->size();
             match(*node.alternation_list, state, ctx, resulting_states);
             if (has_ellipsis) {
@@ -1216,10 +1634,10 @@ static void match(const expression_t &node, match_state_t *state, match_context_
                 if (ctx->flags & flag_generate_suggestions) {
                     for (size_t i=0; i < ctx->shortcut_options.size(); i++) {
                         const option_t &opt = ctx->shortcut_options.at(i);
-                        state->suggested_next_arguments.insert(opt.best_name());
+                        ctx->suggest(state, opt.best_name());
                     }
                 }
-                state_destructive_append_to(state, resulting_states);
+                state_destructive_append_to(state, resulting_states, ctx);
             }
             break;
         }
@@ -1263,14 +1681,18 @@ static bool match_options(const option_list_t &options_in_doc, match_state_t *st
             const rstring_t &name = opt_in_doc.best_name();
             
             // Update the option value, creating it if necessary
-            state->argument_values[name].count += 1;
+            rargument_t *name_arg = ctx->argument_named(state, name);
+            name_arg->count += 1;
+            name_arg->note_argv_idx(resolved_opt.name_idx_in_argv);
             
             // Update the option argument vlaue
             if (opt_in_doc.has_value() && resolved_opt.value_idx_in_argv != npos) {
                 const rstring_t &variable_name = opt_in_doc.value;
                 
                 const rstring_t &value = resolved_opt.value_in_arg;
-                state->argument_values[variable_name].values.push_back(value);
+                rargument_t *value_arg = ctx->argument_named(state, variable_name);
+                value_arg->values.push_back(value);
+                value_arg->note_argv_idx(resolved_opt.value_idx_in_argv);
             }
             
             successful_match = true;
@@ -1292,7 +1714,7 @@ static bool match_options(const option_list_t &options_in_doc, match_state_t *st
             while (type_idx--) {
                 option_t::name_type_t type = static_cast<option_t::name_type_t>(type_idx);
                 if (suggestion.has_type(type)) {
-                    state->suggested_next_arguments.insert(suggestion.names[type]);
+                    ctx->suggest(state, suggestion.names[type]);
                 }
             }
             made_suggestion = true;
@@ -1302,7 +1724,7 @@ static bool match_options(const option_list_t &options_in_doc, match_state_t *st
     bool matched_something = successful_match || made_suggestion;
     if (matched_something) {
         ctx->try_mark_fully_consumed(state);
-        state_destructive_append_to(state, resulting_states);
+        state_destructive_append_to(state, resulting_states, ctx);
     }
     return matched_something;
 }
@@ -1324,8 +1746,8 @@ static void match(const option_clause_t &node, match_state_t *state, match_conte
     const option_list_t options_in_doc(1, node.option);
     bool matched = match_options(options_in_doc, state, ctx, resulting_states);
     if (! matched) {
-        if (ctx->flags & flag_match_allow_incomplete) {
-            state_destructive_append_to(state, resulting_states);
+        if (ctx->allows_incomplete()) {
+            state_destructive_append_to(state, resulting_states, ctx);
         }
     }
 }
@@ -1338,19 +1760,21 @@ static void match(const fixed_clause_t &node, match_state_t *state, match_contex
         const rstring_t &name = ctx->argv.at(positional.idx_in_argv);
         if (node.word == rstring_t(name)) {
             // The static argument matches
-            state->argument_values[name].count += 1;
+            rargument_t *arg = ctx->argument_named(state, name);
+            arg->count += 1;
+            arg->note_argv_idx(positional.idx_in_argv);
             ctx->acquire_next_positional(state);
             ctx->try_mark_fully_consumed(state);
-            state_destructive_append_to(state, resulting_states);
+            state_destructive_append_to(state, resulting_states, ctx);
         }
     } else {
         // No more positionals. Maybe suggest one.
         if (ctx->flags & flag_generate_suggestions) {
-            state->suggested_next_arguments.insert(node.word);
+            ctx->suggest(state, node.word);
         }
         // Append the state if we are allowing incomplete
-        if (ctx->flags & flag_match_allow_incomplete) {
-            state_destructive_append_to(state, resulting_states);
+        if (ctx->allows_incomplete()) {
+            state_destructive_append_to(state, resulting_states, ctx);
         }
     }
 }
@@ -1360,35 +1784,182 @@ static void match(const variable_clause_t &node, match_state_t *state, match_con
     const rstring_t &name = node.word;
     if (ctx->has_more_positionals(state)) {
         // Note we retain the brackets <> in the variable name
-        base_argument_t<rstring_t> *arg = &state->argument_values[name];
+        rargument_t *arg = ctx->argument_named(state, name);
         const positional_argument_t &positional = ctx->acquire_next_positional(state);
         const rstring_t &positional_value = ctx->argv.at(positional.idx_in_argv);
         arg->values.push_back(positional_value);
+        arg->note_argv_idx(positional.idx_in_argv);
         ctx->try_mark_fully_consumed(state);
-        state_destructive_append_to(state, resulting_states);
+        state_destructive_append_to(state, resulting_states, ctx);
     } else {
         // No more positionals. Suggest one.
         if (ctx->flags & flag_generate_suggestions) {
-            state->suggested_next_arguments.insert(name);
+            ctx->suggest(state, name);
         }
-        if (ctx->flags & flag_match_allow_incomplete) {
-            state_destructive_append_to(state, resulting_states);
+        if (ctx->allows_incomplete()) {
+            state_destructive_append_to(state, resulting_states, ctx);
         }
     }
 }
 
 
-template<typename stdstring_t>
-base_argument_t<stdstring_t> finalize_argument(const base_argument_t<rstring_t> &arg) {
-    base_argument_t<stdstring_t> result;
-    result.count = arg.count;
-    result.values.resize(arg.values.size());
-    for (size_t i=0; i < arg.values.size(); i++) {
-        arg.values[i].copy_to(&result.values[i]);
+#pragma mark -
+#pragma mark Complexity Analysis
+#pragma mark -
+
+/* A bound on the number of states that matching a node produces from one incoming state, for an argv of some length, and how that bound grows with the length */
+struct state_bound_t {
+    double states;
+    size_t degree;
+    bool exponential;
+    
+    explicit state_bound_t(double s) : states(s), degree(0), exponential(false) {}
+    
+    bool is_constant() const {
+        return this->degree == 0 && ! this->exponential;
     }
-    return result;
+    
+    /* The bound for matching this node, and then another from each of the resulting states */
+    state_bound_t then(const state_bound_t &rhs) const {
+        state_bound_t result(this->states * rhs.states);
+        result.degree = this->degree + rhs.degree;
+        result.exponential = this->exponential || rhs.exponential;
+        return result;
+    }
+    
+    /* The bound for matching this node and another from the same state, keeping the states from both */
+    state_bound_t plus(const state_bound_t &rhs) const {
+        state_bound_t result(this->states + rhs.states);
+        result.degree = std::max(this->degree, rhs.degree);
+        result.exponential = this->exponential || rhs.exponential;
+        return result;
+    }
+};
+
+/* Computes a complexity_report_t by walking usages. This mirrors match(): sequences multiply the states, alternations and optional clauses add to them, and an ellipsis keeps the states of every number of repetitions. */
+class complexity_analyzer_t {
+    const size_t argv_length;
+    size_t optional_depth;
+    size_t ellipsis_depth;
+    
+    /* The bound for matching a node one or more times. Each repetition must consume an argument, so there are at most argv_length of them. */
+    state_bound_t repeated(const state_bound_t &once) const {
+        const double n = this->argv_length;
+        if (once.is_constant() && once.states <= 1) {
+            state_bound_t result(once.states * n);
+            result.degree = 1;
+            return result;
+        }
+        // The sum of once^k for k from 1 to n
+        state_bound_t result(once.states <= 1 ? once.states * n : once.states * (pow(once.states, n) - 1) / (once.states - 1));
+        result.degree = once.degree;
+        result.exponential = true;
+        return result;
+    }
+    
+    /* Records a hotspot for the given range if its bound is too large, unless one was recorded within it, since then that one is more precise */
+    void note_bound(const state_bound_t &bound, const rstring_t &range, size_t prior_hotspot_count) {
+        if (bound.states > complexity_report_t::explosion_threshold && this->report.hotspots.size() == prior_hotspot_count) {
+            complexity_report_t::hotspot_t hotspot;
+            hotspot.location = range.start();
+            hotspot.length = range.length();
+            hotspot.max_live_states = bound.states;
+            this->report.hotspots.push_back(hotspot);
+        }
+    }
+    
+    state_bound_t bound(const alternation_list_t &node) {
+        state_bound_t result(0);
+        for (size_t i=0; i < node.alternations.size(); i++) {
+            result = result.plus(this->bound(node.alternations.at(i)));
+        }
+        return result;
+    }
+    
+    state_bound_t bound(const expression_list_t &node) {
+        state_bound_t result(1);
+        for (size_t i=0; i < node.expressions.size(); i++) {
+            result = result.then(this->bound(node.expressions.at(i)));
+        }
+        return result;
+    }
+    
+    state_bound_t bound(const expression_t &node) {
+        const size_t prior_hotspot_count = this->report.hotspots.size();
+        const bool optional = (node.production == 2);
+        const bool ellipsis = node.opt_ellipsis.present;
+        this->optional_depth += optional;
+        this->ellipsis_depth += ellipsis;
+        this->report.max_optional_depth = std::max(this->report.max_optional_depth, this->optional_depth);
+        this->report.max_ellipsis_depth = std::max(this->report.max_ellipsis_depth, this->ellipsis_depth);
+        
+        // Simple clauses and [options] produce at most one state
+        state_bound_t result(1);
+        rstring_t range = node.open_token.merge(node.close_token).merge(node.opt_ellipsis.ellipsis);
+        if (node.simple_clause.get()) {
+            const simple_clause_t &clause = *node.simple_clause;
+            range = range.merge(clause.option.get() ? clause.option.get()->word : clause.fixed.get() ? clause.fixed.get()->word : clause.variable.get()->word);
+        } else if (node.alternation_list.get()) {
+            result = this->bound(*node.alternation_list);
+        }
+        if (ellipsis) {
+            result = this->repeated(result);
+        }
+        if (optional) {
+            // The branch not taken
+            result = result.plus(state_bound_t(1));
+        }
+        
+        this->optional_depth -= optional;
+        this->ellipsis_depth -= ellipsis;
+        this->note_bound(result, range, prior_hotspot_count);
+        return result;
+    }
+    
+    public:
+    complexity_report_t report;
+    
+    explicit complexity_analyzer_t(size_t len) : argv_length(len), optional_depth(0), ellipsis_depth(0) {
+        this->report.argv_length = len;
+    }
+    
+    /* Adds a usage to the report. range is the part of the doc to report if the usage as a whole is too expensive. */
+    void add_usage(const usage_t &usage, const rstring_t &range) {
+        const size_t prior_hotspot_count = this->report.hotspots.size();
+        const state_bound_t bound = this->bound(usage.alternation_list);
+        this->note_bound(bound, range, prior_hotspot_count);
+        
+        // Usages are matched one after another, and their states are kept together
+        this->report.max_live_states += bound.states;
+        this->report.degree = std::max(this->report.degree, bound.degree);
+        this->report.exponential = this->report.exponential || bound.exponential;
+        this->report.likely_to_explode = this->report.max_live_states > complexity_report_t::explosion_threshold;
+    }
+};
+
+struct mapped_file_t;
+
+/* Helper for ordering matched arguments by their position in argv, and then by name */
+static bool compare_first_argv_idx(const keyed_rargument_t &lhs, const keyed_rargument_t &rhs) {
+    if (lhs.arg.first_argv_idx != rhs.arg.first_argv_idx) {
+        return lhs.arg.first_argv_idx < rhs.arg.first_argv_idx;
+    }
+    return lhs.key_idx < rhs.key_idx;
+}
+
+/* Helper for restoring matched arguments to name order */
+static bool compare_key_idx(const keyed_rargument_t &lhs, const keyed_rargument_t &rhs) {
+    return lhs.key_idx < rhs.key_idx;
 }
 
+/* Helpers for sorting result key aliases by name */
+static bool compare_key_aliases(const std::pair<rstring_t, size_t> &lhs, const std::pair<rstring_t, size_t> &rhs) {
+    return lhs.first < rhs.first;
+}
+
+static bool key_aliases_have_same_name(const std::pair<rstring_t, size_t> &lhs, const std::pair<rstring_t, size_t> &rhs) {
+    return lhs.first == rhs.first;
+}
 
 /* Wrapper class that takes either a string or wstring as string_t */
 class docopt_impl {
@@ -1402,17 +1973,108 @@ public:
     /* Storage for our rstrings. Note that this must be shared_ptr so that we can have a sane copy constructor. Otherwise the copy constructor would copy our rstring_ts and have them pointing at the old docopt_impl! Plus this makes copying cheaper. */
     const shared_ptr<const std::string> storage_narrow;
     const shared_ptr<const std::wstring> storage_wide;
-    const rstring_t rsource;
-    docopt_impl(const std::string &s) : storage_narrow(new std::string(s)), rsource(*storage_narrow) {}
-    docopt_impl(const std::wstring &s) : storage_wide(new std::wstring(s)), rsource(*storage_wide) {}
     
-#pragma mark -
-#pragma mark Instance Variables
-#pragma mark -
+    /* Alternatively, the contents of a compiled file containing the source (see load_compiled) */
+    const shared_ptr<const mapped_file_t> storage_mapped;
     
-    /* The usage parse tree. */
+    const rstring_t rsource;
+    const bool narrow_source;
+    docopt_impl(const std::string &s) : storage_narrow(new std::string(s)), rsource(*storage_narrow), narrow_source(true), refcount(1) {
+        this->init_compile_state();
+    }
+    
+    docopt_impl(const std::wstring &s) : storage_wide(new std::wstring(s)), rsource(*storage_wide), narrow_source(false), refcount(1) {
+        this->init_compile_state();
+    }
+    
+    /* Constructor for a source that lives in a mapped file */
+    template<typename stdchar_t>
+    docopt_impl(const shared_ptr<const mapped_file_t> &file, const stdchar_t *chars, size_t length) : storage_mapped(file), rsource(chars, length), narrow_source(sizeof(stdchar_t) == sizeof(char)), refcount(1) {
+        this->init_compile_state();
+    }
+    
+    ~docopt_impl() {
+        pthread_mutex_destroy(&this->compile_lock);
+    }
+
+#pragma mark -
+#pragma mark Reference Counting
+#pragma mark -
+    
+    /* A docopt_impl is immutable once preflighted, and shared between every argument_parser_t copied from the one that created it. The last parser to release it deletes it. The count is manipulated atomically, so parsers sharing an impl may be copied and destroyed from different threads. */
+private:
+    volatile long refcount;
+    
+    /* Not copyable; share it instead */
+    docopt_impl(const docopt_impl &);
+    void operator=(const docopt_impl &);
+
+public:
+    void retain() const {
+        __sync_add_and_fetch(&const_cast<docopt_impl *>(this)->refcount, 1);
+    }
+    
+    void release() const {
+        if (__sync_sub_and_fetch(&const_cast<docopt_impl *>(this)->refcount, 1) == 0) {
+            delete this;
+        }
+    }
+    
+#pragma mark -
+#pragma mark Instance Variables
+#pragma mark -
+    
+    /* Compilation happens in stages. Classifying lines is always done up front; the other stages may be deferred until a query needs them. */
+    enum compile_stage_t {
+        stage_none,
+        stage_lines, // option_and_variable_specs, usage_specs, unknown_leader_line
+        stage_options, // shortcut_options, variables_to_commands
+        stage_usages // everything else
+    };
+    
+    /* The last stage completed, and the last stage visible to ensure_compiled without taking the lock */
+    compile_stage_t compiled_stage;
+    int published_stage;
+    
+    /* Held while running deferred stages */
+    pthread_mutex_t compile_lock;
+    
+    void init_compile_state() {
+        this->compiled_stage = stage_none;
+        this->published_stage = stage_none;
+        this->has_default_usage = false;
+        pthread_mutex_init(&this->compile_lock, NULL);
+    }
+    
+    /* Line groups of option specs and variable command specs, in the order they appear */
+    rstring_list_t option_and_variable_specs;
+    
+    /* Line groups of usage specs. We need to parse these after all of the options, because we need the options to disambiguate some usages. */
+    rstring_list_t usage_specs;
+    
+    /* The line that stopped classification because it began with an unknown character, if any */
+    rstring_t unknown_leader_line;
+    
+    /* What parsing each of option_and_variable_specs produced, in the same order. These are kept so that an edit of the doc can reuse the line groups it did not touch (see compile_edited_impl). */
+    struct spec_result_t {
+        option_t option;
+        variable_command_map_t commands;
+        error_list_t errors;
+    };
+    std::vector<spec_result_t> spec_results;
+    
+    /* Every error from compiling the doc, in the order they were reported. These are kept so that an edit that compiles nothing again can report them (see rebase_edited_impl). */
+    error_list_t compile_errors;
+    
+    /* The errors from parsing each of usage_specs, in the same order. The usage trees themselves are in usages. */
+    std::vector<error_list_t> usage_errors;
+    
+    /* The usage parse tree. */
     usage_list_t usages;
     
+    /* Whether usages is the default usage, because the doc had none. The default usage does not point into our source. */
+    bool has_default_usage;
+    
     /* The list of options parsed from the "Options:" section. Referred to as "shortcut options" because the "[options]" directive can be used as a shortcut to reference them. */
     option_list_t shortcut_options;
     
@@ -1426,10 +2088,161 @@ public:
     rstring_list_t all_static_arguments;
     
     /* Map from variable names to the commands that populate them */
-    variable_command_map_t variables_to_commands;
+    name_index_t<rstring_t> variables_to_commands;
+    
+    /* Every name that may appear as a key in a parse result (options, option values, variables and static arguments), sorted and unique. Parse results are laid out parallel to this list. */
+    rstring_list_t result_keys;
+    
+    /* Map from option names that are not themselves result keys (like -v, when reported as --verbose) to the index in result_keys of the name the option is reported under. Sorted by name. */
+    typedef std::pair<rstring_t, size_t> key_alias_t;
+    std::vector<key_alias_t> result_key_aliases;
+    
+    /* The descriptions of options, keyed by each of their names. If options share a name, the first in all_options wins. */
+    name_index_t<rstring_t> option_descriptions;
+    
+    /* The names that appear in every result generated with flag_generate_empty_args, as indexes into result_keys (so sorted by name), along with the default value each receives (empty if none) */
+    struct empty_arg_t {
+        size_t key_idx;
+        rstring_t default_value;
+    };
+    std::vector<empty_arg_t> empty_args;
+    
+    /* The command names (see get_command_names) and variable names (see get_variables), in the width of our source. The command names are known once lines are classified, unless the default usage is used; the variable names once the usages are compiled. */
+    std::vector<std::string> command_names_narrow, variable_names_narrow;
+    std::vector<std::wstring> command_names_wide, variable_names_wide;
+    
+    const std::vector<std::string> &command_names(const std::string *) const {
+        return this->command_names_narrow;
+    }
+    
+    const std::vector<std::wstring> &command_names(const std::wstring *) const {
+        return this->command_names_wide;
+    }
+    
+    const std::vector<std::string> &variable_names(const std::string *) const {
+        return this->variable_names_narrow;
+    }
+    
+    const std::vector<std::wstring> &variable_names(const std::wstring *) const {
+        return this->variable_names_wide;
+    }
+    
+    /* Fills in empty_args from our options, variables and static arguments. Requires that result_keys is populated. */
+    void build_empty_args() {
+        // Collect the names and defaults, in result_keys order. The first default value for a variable wins.
+        std::vector<bool> is_empty_arg(this->result_keys.size(), false);
+        rstring_list_t defaults(this->result_keys.size());
+        for (size_t i=0; i < all_options.size(); i++) {
+            const option_t &opt = all_options.at(i);
+            is_empty_arg.at(this->index_of_result_key(opt.best_name())) = true;
+            if (opt.has_value() && ! opt.default_value.empty()) {
+                size_t var_idx = this->index_of_result_key(opt.value);
+                is_empty_arg.at(var_idx) = true;
+                if (defaults.at(var_idx).empty()) {
+                    defaults.at(var_idx) = opt.default_value;
+                }
+            }
+        }
+        for (size_t i=0; i < all_variables.size(); i++) {
+            is_empty_arg.at(this->index_of_result_key(all_variables.at(i))) = true;
+        }
+        for (size_t i=0; i < all_static_arguments.size(); i++) {
+            is_empty_arg.at(this->index_of_result_key(all_static_arguments.at(i))) = true;
+        }
+        
+        this->empty_args.clear();
+        for (size_t idx=0; idx < is_empty_arg.size(); idx++) {
+            if (is_empty_arg.at(idx)) {
+                empty_arg_t arg;
+                arg.key_idx = idx;
+                arg.default_value = defaults.at(idx);
+                this->empty_args.push_back(arg);
+            }
+        }
+    }
+    
+    /* Fills in option_descriptions from all_options */
+    void build_option_descriptions() {
+        this->option_descriptions.clear();
+        for (size_t i=0; i < this->all_options.size(); i++) {
+            const option_t &opt = this->all_options.at(i);
+            if (opt.description.empty()) {
+                continue;
+            }
+            for (size_t type_idx=0; type_idx < option_t::NAME_TYPE_COUNT; type_idx++) {
+                if (! opt.names[type_idx].empty()) {
+                    this->option_descriptions.insert(opt.names[type_idx], opt.description);
+                }
+            }
+        }
+    }
+    
+    /* Fills in command_names from the usage specs, or if there are none, from the usages */
+    void build_command_names() {
+        this->fill_name_list(this->command_name_list(), &this->command_names_narrow, &this->command_names_wide);
+    }
+    
+    /* Returns the command names, in order of appearance, each only once */
+    rstring_list_t command_name_list() const {
+        rstring_list_t names;
+        std::set<rstring_t> seen;
+        if (this->usage_specs.empty()) {
+            for (size_t i=0; i < this->usages.size(); i++) {
+                const rstring_t &name = this->usages.at(i).prog_name;
+                if (! name.empty() && seen.insert(name).second) {
+                    names.push_back(name);
+                }
+            }
+        } else {
+            // The name is just the first word of each usage, so we need not parse them
+            for (size_t i=0; i < this->usage_specs.size(); i++) {
+                const rstring_t name = usage_prog_name(this->usage_specs.at(i));
+                if (! name.empty() && seen.insert(name).second) {
+                    names.push_back(name);
+                }
+            }
+        }
+        return names;
+    }
+    
+    /* Fills in variable_names from our variables and the values of our options */
+    void build_variable_names() {
+        this->fill_name_list(this->variable_name_list(), &this->variable_names_narrow, &this->variable_names_wide);
+    }
+    
+    /* Returns the variable names, sorted and unique */
+    rstring_list_t variable_name_list() const {
+        rstring_list_t names(this->all_variables);
+        for (size_t i=0; i < this->all_options.size(); i++) {
+            const rstring_t &value = this->all_options.at(i).value;
+            if (! value.empty()) {
+                names.push_back(value);
+            }
+        }
+        std::sort(names.begin(), names.end());
+        names.erase(std::unique(names.begin(), names.end()), names.end());
+        return names;
+    }
+    
+    /* Copies names into whichever of narrow and wide matches our source, and clears the other */
+    void fill_name_list(const rstring_list_t &names, std::vector<std::string> *narrow, std::vector<std::wstring> *wide) const {
+        narrow->clear();
+        wide->clear();
+        if (this->narrow_source) {
+            narrow->resize(names.size());
+            for (size_t i=0; i < names.size(); i++) {
+                names.at(i).copy_to(&narrow->at(i));
+            }
+        } else {
+            wide->resize(names.size());
+            for (size_t i=0; i < names.size(); i++) {
+                names.at(i).copy_to(&wide->at(i));
+            }
+        }
+    }
     
-    /* Walk over the lines of our source, starting from the beginning. */
-    void populate_by_walking_lines(error_list_t *out_errors) {
+    /* Walk over the lines of our source, starting from the beginning, and sort the line groups into specs. This is the only stage that is always done eagerly. */
+    void classify_lines() {
         // TODO: needs rstring work
         /* Distinguish between normal (docopt) and exposition (e.g. description). */
         enum mode_t {
@@ -1437,12 +2250,9 @@ public:
             mode_exposition
         } mode = mode_normal;
         
-        // We need to parse the usage spec ranges after all of the Options
-        // This is because we need the options to disambiguate some usages
-        rstring_list_t usage_specs;
-        
-        rstring_t line;
-        while (get_next_line(this->rsource, &line)) {
+        source_line_t line;
+        bool have_line = get_next_line(this->rsource, &line);
+        while (have_line) {
             /* There are a couple of possibilitise for each line:
              
              1. It may have a header like "Usage:". If so, we want to strip that header, and optionally
@@ -1454,7 +2264,7 @@ public:
              
              Also note that a (nonempty) line indented more than the previous line is considered a continuation of that line.
              */
-            rstring_t trimmed_line = line.trim_whitespace();
+            rstring_t trimmed_line = line.trimmed;
             
             const rstring_t header = find_header(trimmed_line);
             if (!header.empty()) {
@@ -1477,6 +2287,7 @@ public:
             
             // Skip exposition or empty lines
             if (mode == mode_exposition || trimmed_line.empty()) {
+                have_line = get_next_line(this->rsource, &line);
                 continue;
             }
             
@@ -1487,121 +2298,257 @@ public:
              
              Here 'foo' is indented more than 'bar'.
              */
-            const size_t line_indent = compute_indent(line, trimmed_line);
+            const size_t line_indent = (header.empty() ? line.indent : compute_indent(line.line, trimmed_line));
             
             // Determine the "line group." That is, this line plus all subsequent nonempty lines
-            // that are indented more than this line.
+            // that are indented more than this line. The line that ends the group is visited next, without measuring it again.
             rstring_t line_group = trimmed_line;
-            rstring_t all_consumed_lines = line;
-            rstring_t next_line = line;
-            while (get_next_line(this->rsource, &next_line)) {
-                rstring_t trimmed_next_line = next_line.trim_whitespace();
-                size_t next_line_indent = compute_indent(next_line, trimmed_next_line);
-                if (trimmed_next_line.empty() || next_line_indent <= line_indent) {
+            while ((have_line = get_next_line(this->rsource, &line))) {
+                if (line.trimmed.empty() || line.indent <= line_indent) {
                     break;
                 }
-                line_group = line_group.merge(next_line);
-                all_consumed_lines = all_consumed_lines.merge(next_line);
+                line_group = line_group.merge(line.line);
             }
             
             rstring_t::char_t first_char = line_group[0];
-            if (first_char == '-') {
-                // It's an option spec
-                this->shortcut_options.push_back(parse_one_option_spec(line_group, out_errors));
-                
-            } else if (first_char == '<') {
-                // It's a variable command spec
-                const variable_command_map_t new_var_cmds = parse_one_variable_command_spec(line_group, out_errors);
-                for (variable_command_map_t::const_iterator iter = new_var_cmds.begin(); iter != new_var_cmds.end(); ++iter) {
-                    if (!this->variables_to_commands.insert(*iter).second) {
-                        append_docopt_error(out_errors, line_group, error_one_variable_multiple_commands, "Duplicate command for variable");
-                    }
-                }
+            if (first_char == '-' || first_char == '<') {
+                // It's an option spec or variable command spec. Remember them in order, so that their errors are reported in order.
+                this->option_and_variable_specs.push_back(line_group);
                 
             } else if (isalnum(first_char) || first_char == '_') {
                 // It's a usage spec. We will come back to this.
-                usage_specs.push_back(line_group);
+                this->usage_specs.push_back(line_group);
                 
             } else {
-                // It's an error
-                append_docopt_error(out_errors, trimmed_line, error_unknown_leader, "Lines must start with a normal character, less-than sign, or dash.");
+                // It's an error, reported when the specs are parsed
+                this->unknown_leader_line = trimmed_line;
                 break;
             }
-            
-            // Note the line range we consumed, for the next iteration of the loop
-            line = all_consumed_lines;
+        }
+        this->build_command_names();
+    }
+    
+    /* Parses the option spec or variable command spec at the given index into spec_results */
+    void parse_spec(size_t idx) {
+        const rstring_t &line_group = this->option_and_variable_specs.at(idx);
+        spec_result_t *result = &this->spec_results.at(idx);
+        if (line_group[0] == '-') {
+            result->option = parse_one_option_spec(line_group, &result->errors);
+        } else {
+            result->commands = parse_one_variable_command_spec(line_group, &result->errors);
+        }
+    }
+    
+    /* Parse the option specs and variable command specs found by classify_lines, unless spec_results has already been filled in, and combine them */
+    void parse_option_and_variable_specs(error_list_t *out_errors) {
+        const size_t spec_count = this->option_and_variable_specs.size();
+        if (this->spec_results.size() != spec_count) {
+            this->spec_results.resize(spec_count);
+            for (size_t i=0; i < spec_count; i++) {
+                this->parse_spec(i);
+            }
         }
         
-        // Ensure our shortcut options don't have duplicates
-        uniqueize_options(&this->shortcut_options, true /* error on duplicates */, out_errors);
+        for (size_t i=0; i < spec_count; i++) {
+            const rstring_t &line_group = this->option_and_variable_specs.at(i);
+            const spec_result_t &result = this->spec_results.at(i);
+            if (out_errors != NULL) {
+                out_errors->insert(out_errors->end(), result.errors.begin(), result.errors.end());
+            }
+            if (line_group[0] == '-') {
+                // It's an option spec
+                this->shortcut_options.push_back(result.option);
+                
+            } else {
+                // It's a variable command spec
+                for (variable_command_map_t::const_iterator iter = result.commands.begin(); iter != result.commands.end(); ++iter) {
+                    if (! this->variables_to_commands.insert(iter->first, iter->second)) {
+                        append_docopt_error(out_errors, line_group, error_one_variable_multiple_commands, "Duplicate command for variable");
+                    }
+                }
+            }
+        }
         
-        // Now parse our usage_spec_ranges
-        size_t usages_count = usage_specs.size();
-        this->usages.resize(usages_count);
-        for (size_t i=0; i < usages_count; i++) {
-            parse_one_usage(usage_specs.at(i), this->shortcut_options, &this->usages.at(i), out_errors);
+        if (! this->unknown_leader_line.empty()) {
+            append_docopt_error(out_errors, this->unknown_leader_line, error_unknown_leader, "Lines must start with a normal character, less-than sign, or dash.");
         }
+        
+        // Ensure our shortcut options don't have duplicates
+        uniqueize_options(&this->shortcut_options, true /* error on duplicates */, out_errors);
     }
     
-    /* Given an option map (using rstring), convert it to an option map using the given std::basic_string type. */
+    /* Given a match result, convert it to an option map using the given std::basic_string type. */
     template<typename stdstring_t>
-    typename argument_parser_t<stdstring_t>::argument_map_t finalize_option_map(const option_rmap_t &map, parse_flags_t flags) const {
+    typename argument_parser_t<stdstring_t>::argument_map_t finalize_option_map(const rargument_list_t &args, parse_flags_t flags) const {
         typename argument_parser_t<stdstring_t>::argument_map_t result;
-        // Turn our string_ts into std::strings
-        for (option_rmap_t::const_iterator iter = map.begin(); iter != map.end(); ++iter) {
-            result[iter->first.std_string<stdstring_t>()] = finalize_argument<stdstring_t>(iter->second);
+        this->fill_argument_map<stdstring_t>(args, flags, &result);
+        return result;
+    }
+    
+    /* Makes an option map hold a match result, plus the empty args if flag_generate_empty_args is set. Entries already in the map for names in the result keep their nodes and string storage, so that a map reused across parses is updated with few allocations; other entries are erased. */
+    template<typename stdstring_t>
+    void fill_argument_map(const rargument_list_t &args, parse_flags_t flags, typename argument_parser_t<stdstring_t>::argument_map_t *map) const {
+        typedef typename argument_parser_t<stdstring_t>::argument_map_t argument_map_t;
+        const size_t empty_arg_count = (flags & flag_generate_empty_args) ? this->empty_args.size() : 0;
+        typename argument_map_t::iterator where = map->begin();
+        size_t arg_idx = 0, empty_arg_idx = 0;
+        for (;;) {
+            // Take the next name from the matched arguments or the empty args, both of which are in name order
+            const size_t arg_key_idx = arg_idx < args.size() ? args.at(arg_idx).key_idx : npos;
+            const size_t empty_key_idx = empty_arg_idx < empty_arg_count ? this->empty_args.at(empty_arg_idx).key_idx : npos;
+            const size_t key_idx = std::min(arg_key_idx, empty_key_idx);
+            if (key_idx == npos) {
+                break;
+            }
+            const rargument_t *matched = (key_idx == arg_key_idx ? &args.at(arg_idx++).arg : NULL);
+            const empty_arg_t *empty_arg = (key_idx == empty_key_idx ? &this->empty_args.at(empty_arg_idx++) : NULL);
+            
+            // Find the entry for the name, erasing the entries before it, whose names are not in the result
+            const rstring_t &name = this->result_keys.at(key_idx);
+            while (where != map->end() && rstring_t(where->first) < name) {
+                map->erase(where++);
+            }
+            if (where == map->end() || rstring_t(where->first) != name) {
+                where = map->insert(where, std::make_pair(name.std_string<stdstring_t>(), base_argument_t<stdstring_t>()));
+            }
+            base_argument_t<stdstring_t> *arg = &where->second;
+            ++where;
+            
+            // A matched variable without values (which can happen for option values) gets its default, like an unmatched one
+            arg->count = matched ? matched->count : 0;
+            if (matched && ! matched->values.empty()) {
+                arg->values.resize(matched->values.size());
+                for (size_t i=0; i < matched->values.size(); i++) {
+                    matched->values.at(i).copy_to(&arg->values.at(i));
+                }
+            } else if (empty_arg && ! empty_arg->default_value.empty()) {
+                arg->values.resize(1);
+                empty_arg->default_value.copy_to(&arg->values.at(0));
+            } else {
+                arg->values.clear();
+            }
+        }
+        map->erase(where, map->end());
+    }
+
+    /* Returns the index of the given name in result_keys, or npos if it is not there */
+    size_t index_of_result_key(const rstring_t &name) const {
+        return index_of_key(this->result_keys, name);
+    }
+    
+    /* Resolves a name to an index in result_keys, consulting the aliases of options. Returns npos if not found. */
+    size_t index_of_result_key_or_alias(const rstring_t &name) const {
+        size_t result = this->index_of_result_key(name);
+        if (result == npos) {
+            std::vector<key_alias_t>::const_iterator where = std::lower_bound(this->result_key_aliases.begin(), this->result_key_aliases.end(), key_alias_t(name, 0));
+            if (where != this->result_key_aliases.end() && where->first == name) {
+                result = where->second;
+            }
+        }
+        return result;
+    }
+    
+    /* Given an option map (using rstring), populate a parse result that borrows its keys and values. This mirrors finalize_option_map. */
+    template<typename stdstring_t>
+    void populate_parse_result(const rargument_list_t &args, parse_flags_t flags, base_parse_result_t<stdstring_t> *result) const {
+        typedef typename base_parse_result_t<stdstring_t>::slot_t slot_t;
+        typedef typename stdstring_t::value_type stdchar_t;
+        result->impl = this;
+        result->slots.assign(this->result_keys.size(), slot_t());
+        result->values.clear();
+        
+        for (size_t arg_idx=0; arg_idx < args.size(); arg_idx++) {
+            const rargument_t &arg = args.at(arg_idx).arg;
+            slot_t *slot = &result->slots.at(args.at(arg_idx).key_idx);
+            slot->present = true;
+            slot->count = arg.count;
+            slot->values_start = result->values.size();
+            slot->value_count = arg.values.size();
+            for (size_t i=0; i < arg.values.size(); i++) {
+                const rstring_t &val = arg.values.at(i);
+                result->values.push_back(base_string_view_t<stdchar_t>(val.chars<stdchar_t>(), val.length()));
+            }
         }
         
         // Handle empty args
         if (flags & flag_generate_empty_args) {
-            // For each option, fill in the value in the map
-            // This could be made more efficient via a single call to insert()
-            for (size_t i=0; i < all_options.size(); i++) {
-                const option_t &opt = all_options.at(i);
-                const rstring_t &name = opt.best_name();
-                // We merely invoke operator[]; this will do the insertion with a default value if necessary.
-                // Note that this is somewhat nasty because it may unnecessarily copy the key. We might use a find() beforehand to save memory
-                result[name.std_string<stdstring_t>()];
-                
-                if (opt.has_value() && ! opt.default_value.empty()) {
-                    // Maybe apply the default value for the variable
-                    stdstring_t variable_name = opt.value.std_string<stdstring_t>();
-                    base_argument_t<stdstring_t> *var_arg = &result[variable_name];
-                    if (var_arg->values.empty()) {
-                        var_arg->values.push_back(opt.default_value.std_string<stdstring_t>());
-                    }
+            for (size_t i=0; i < this->empty_args.size(); i++) {
+                const empty_arg_t &empty_arg = this->empty_args.at(i);
+                slot_t *slot = &result->slots.at(empty_arg.key_idx);
+                slot->present = true;
+                if (slot->value_count == 0 && ! empty_arg.default_value.empty()) {
+                    // Apply the default value for the variable
+                    slot->values_start = result->values.size();
+                    slot->value_count = 1;
+                    result->values.push_back(base_string_view_t<stdchar_t>(empty_arg.default_value.chars<stdchar_t>(), empty_arg.default_value.length()));
                 }
             }
+        }
+    }
+    
+    /* Given a match result, report its contents to a visitor in argv order. This mirrors finalize_option_map, but builds nothing: the result is sorted into argv order in place, and back into name order to skip its names among the empty args. */
+    template<typename stdstring_t>
+    void visit_option_map(rargument_list_t *args, parse_flags_t flags, base_argument_visitor_t<stdstring_t> *visitor) const {
+        typedef typename stdstring_t::value_type stdchar_t;
+        typedef base_string_view_t<stdchar_t> string_view_t;
+        
+        // Visit the matched names where they first appear in argv, with ties in name order
+        std::sort(args->begin(), args->end(), compare_first_argv_idx);
+        for (size_t i=0; i < args->size(); i++) {
+            const rstring_t &name = this->result_keys.at(args->at(i).key_idx);
+            const rargument_t &arg = args->at(i).arg;
             
-            // Fill in variables
-            stdstring_t name;
-            for (size_t i=0; i < all_variables.size(); i++) {
-                all_variables.at(i).copy_to(&name);
-                // As above, we merely invoke operator[]
-                result[name];
+            // View the values from the stack, unless there are unusually many
+            string_view_t stack_values[8];
+            std::vector<string_view_t> heap_values;
+            string_view_t *values = stack_values;
+            if (arg.values.size() > sizeof stack_values / sizeof *stack_values) {
+                heap_values.resize(arg.values.size());
+                values = &heap_values.at(0);
             }
-            
-            // Fill in static arguments
-            for (size_t i=0; i < all_static_arguments.size(); i++) {
-                all_static_arguments.at(i).copy_to(&name);
-                // As above, we merely invoke operator[]
-                result[name];
+            for (size_t j=0; j < arg.values.size(); j++) {
+                values[j] = string_view_t(arg.values.at(j).chars<stdchar_t>(), arg.values.at(j).length());
             }
+            visitor->visit(string_view_t(name.chars<stdchar_t>(), name.length()), arg.count, arg.values.empty() ? NULL : values, arg.values.size());
         }
         
-        return result;
+        // Handle empty args. Skip the names that were visited above: both lists are in name order, so walk them together.
+        if (flags & flag_generate_empty_args) {
+            std::sort(args->begin(), args->end(), compare_key_idx);
+            size_t matched_idx = 0;
+            for (size_t i=0; i < this->empty_args.size(); i++) {
+                const empty_arg_t &empty_arg = this->empty_args.at(i);
+                while (matched_idx < args->size() && args->at(matched_idx).key_idx < empty_arg.key_idx) {
+                    matched_idx++;
+                }
+                if (matched_idx < args->size() && args->at(matched_idx).key_idx == empty_arg.key_idx) {
+                    continue;
+                }
+                
+                const rstring_t &name = this->result_keys.at(empty_arg.key_idx);
+                const rstring_t &default_value = empty_arg.default_value;
+                if (default_value.empty()) {
+                    visitor->visit(string_view_t(name.chars<stdchar_t>(), name.length()), 0, NULL, 0);
+                } else {
+                    const string_view_t value(default_value.chars<stdchar_t>(), default_value.length());
+                    visitor->visit(string_view_t(name.chars<stdchar_t>(), name.length()), 0, &value, 1);
+                }
+            }
+        }
     }
-
-    /* Matches argv */
+    
+    /* Matches argv. If usage_matches is not NULL, it has one entry per usage, and the valid ones are reused (see usage_match_t). */
     void match_argv(const rstring_list_t &argv,
                     parse_flags_t flags,
                     const positional_argument_list_t &positionals,
                     const resolved_option_list_t &resolved_options,
-                    option_rmap_t *out_option_map,
+                    rargument_list_t *out_option_map,
                     index_list_t *out_unused_arguments,
+                    match_budget_t *budget,
+                    usage_match_list_t *usage_matches = NULL,
                     bool log_stuff = false) const {
         /* Set flag_stop_after_consuming_everything. This allows us to early-out. */
-        match_context_t ctx(flags | flag_stop_after_consuming_everything, this->shortcut_options, positionals, resolved_options, argv);
+        match_context_t ctx(flags | flag_stop_after_consuming_everything, this->shortcut_options, positionals, resolved_options, argv, this->result_keys, budget, usage_matches);
         match_state_t init_state;
         init_state.consumed_options.resize(resolved_options.size(), false);
         
@@ -1614,9 +2561,9 @@ public:
                 const match_state_t &state = result.at(i);
                 bool is_incomplete = ! ctx.unused_arguments(&state).empty();
                 std::cerr <<  "Result " << i << (is_incomplete ? " (INCOMPLETE)" : "") << ":\n";
-                for (option_rmap_t::const_iterator iter = state.argument_values.begin(); iter != state.argument_values.end(); ++iter) {
-                    const rstring_t &name = iter->first;
-                    const base_argument_t<rstring_t> &arg = iter->second;
+                for (size_t arg_idx=0; arg_idx < state.argument_values.size(); arg_idx++) {
+                    const rstring_t &name = this->result_keys.at(state.argument_values.at(arg_idx).key_idx);
+                    const rargument_t &arg = state.argument_values.at(arg_idx).arg;
                     fprintf(stderr, "\t%ls: ", name.std_string<std::wstring>().c_str());
                     for (size_t j=0; j < arg.values.size(); j++) {
                         if (j > 0) {
@@ -1629,14 +2576,18 @@ public:
             }
         }
         
-        // Determine the index of the one with the fewest unused arguments
+        // Determine the index of the one with the fewest unused arguments. States cut short by the budget are only considered if there is nothing else.
+        const bool only_complete = has_untruncated_state(result);
         size_t best_state_idx = npos;
         index_list_t best_unused_args;
         for (size_t i=0; i < result.size(); i++) {
             const match_state_t &state = result.at(i);
+            if (only_complete && state.truncated) {
+                continue;
+            }
             index_list_t unused_args = ctx.unused_arguments(&state);
             size_t unused_arg_count = unused_args.size();
-            if (i == 0 || unused_arg_count < best_unused_args.size()) {
+            if (best_state_idx == npos || unused_arg_count < best_unused_args.size()) {
                 best_state_idx = i;
                 best_unused_args.swap(unused_args);
                 // If we got zero, we're done
@@ -1669,13 +2620,70 @@ public:
         }
     }
     
-    /* Parses the docopt, etc. Returns true on success, false on error */
+    /* Parses the docopt, etc. Returns true on success, false on error. If out_errors is NULL, nobody is interested in errors, so everything past classifying lines is deferred until a query needs it (see ensure_compiled). */
     bool preflight(error_list_t *out_errors) {
-        // Populate our instance variables
-        this->populate_by_walking_lines(out_errors);
+        this->classify_lines();
+        this->compiled_stage = stage_lines;
+        if (out_errors != NULL) {
+            this->compile_through(stage_usages, out_errors);
+        }
+        this->published_stage = this->compiled_stage;
+        return true;
+    }
+    
+    /* Runs the compilation stages after compiled_stage, through the given stage */
+    void compile_through(compile_stage_t stage, error_list_t *out_errors) {
+        const size_t error_count = this->compile_errors.size();
+        if (this->compiled_stage < stage_options && stage >= stage_options) {
+            this->parse_option_and_variable_specs(&this->compile_errors);
+            this->compiled_stage = stage_options;
+        }
+        if (this->compiled_stage < stage_usages && stage >= stage_usages) {
+            this->parse_usages(&this->compile_errors);
+            this->compiled_stage = stage_usages;
+        }
+        if (out_errors != NULL) {
+            out_errors->insert(out_errors->end(), this->compile_errors.begin() + error_count, this->compile_errors.end());
+        }
+    }
+    
+    /* Ensures that we are compiled through the given stage, doing the work if another thread has not. Queries call this before looking at what the stage produces. The lock is only taken when there is work to do; completed_stage is published only after the stage's results are written. */
+    void ensure_compiled(compile_stage_t stage) const {
+        if (__atomic_load_n(&this->published_stage, __ATOMIC_ACQUIRE) >= stage) {
+            return;
+        }
+        docopt_impl *mutable_this = const_cast<docopt_impl *>(this);
+        pthread_mutex_lock(&mutable_this->compile_lock);
+        mutable_this->compile_through(stage, NULL);
+        __atomic_store_n(&mutable_this->published_stage, this->compiled_stage, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&mutable_this->compile_lock);
+    }
+    
+    /* Parses the usage spec at the given index into usages and usage_errors. The shortcut options must be parsed. */
+    void parse_usage(size_t idx) {
+        parse_one_usage(this->usage_specs.at(idx), this->shortcut_options, &this->usages.at(idx), &this->usage_errors.at(idx));
+    }
+    
+    /* Parses our usages, and computes everything derived from them and the options */
+    void parse_usages(error_list_t *out_errors) {
+        // Parse each usage spec, unless that has already been done
+        const size_t usages_count = this->usage_specs.size();
+        if (this->usages.size() != usages_count || this->usage_errors.size() != usages_count) {
+            this->usages.resize(usages_count);
+            this->usage_errors.resize(usages_count);
+            for (size_t i=0; i < usages_count; i++) {
+                this->parse_usage(i);
+            }
+        }
+        if (out_errors != NULL) {
+            for (size_t i=0; i < usages_count; i++) {
+                out_errors->insert(out_errors->end(), this->usage_errors.at(i).begin(), this->usage_errors.at(i).end());
+            }
+        }
         
         /* If we have no usage, apply the default one */
-        if (this->usages.empty()) {
+        this->has_default_usage = this->usages.empty();
+        if (this->has_default_usage) {
             this->usages.resize(1);
             this->usages.back().make_default();
         }
@@ -1690,6 +2698,48 @@ public:
         this->all_options.insert(this->all_options.end(), this->shortcut_options.begin(), this->shortcut_options.end());
         uniqueize_options(&this->all_options, false /* do not error on duplicates */, out_errors);
         
+        // Determine every name that may appear in a parse result. This must consider the options in the usage tree as well as the (uniqueized) options lists, since matching keys results by the option in the tree.
+        const option_list_t *option_lists[] = {&usage_options, &this->shortcut_options, &this->all_options};
+        for (size_t list_idx = 0; list_idx < sizeof option_lists / sizeof *option_lists; list_idx++) {
+            const option_list_t *opts = option_lists[list_idx];
+            for (size_t i=0; i < opts->size(); i++) {
+                const option_t &opt = opts->at(i);
+                this->result_keys.push_back(opt.best_name());
+                if (opt.has_value()) {
+                    this->result_keys.push_back(opt.value);
+                }
+            }
+        }
+        this->result_keys.insert(this->result_keys.end(), this->all_variables.begin(), this->all_variables.end());
+        this->result_keys.insert(this->result_keys.end(), this->all_static_arguments.begin(), this->all_static_arguments.end());
+        std::sort(this->result_keys.begin(), this->result_keys.end());
+        this->result_keys.erase(std::unique(this->result_keys.begin(), this->result_keys.end()), this->result_keys.end());
+        this->build_empty_args();
+        this->build_option_descriptions();
+        this->build_variable_names();
+        if (this->has_default_usage) {
+            this->build_command_names();
+        }
+        
+        // Options are reported under their best name; remember their other names so they can be resolved to it. Prefer the uniqueized list, which comes first.
+        const option_list_t *alias_lists[] = {&this->all_options, &usage_options, &this->shortcut_options};
+        for (size_t list_idx = 0; list_idx < sizeof alias_lists / sizeof *alias_lists; list_idx++) {
+            const option_list_t *opts = alias_lists[list_idx];
+            for (size_t i=0; i < opts->size(); i++) {
+                const option_t &opt = opts->at(i);
+                const size_t best_idx = this->index_of_result_key(opt.best_name());
+                for (size_t type_idx=0; type_idx < option_t::NAME_TYPE_COUNT; type_idx++) {
+                    const rstring_t &name = opt.names[type_idx];
+                    if (! name.empty() && name != opt.best_name()) {
+                        this->result_key_aliases.push_back(key_alias_t(name, best_idx));
+                    }
+                }
+            }
+        }
+        // Sort by name only, keeping the first (preferred) alias for each name
+        std::stable_sort(this->result_key_aliases.begin(), this->result_key_aliases.end(), compare_key_aliases);
+        this->result_key_aliases.erase(std::unique(this->result_key_aliases.begin(), this->result_key_aliases.end(), key_aliases_have_same_name), this->result_key_aliases.end());
+        
         /* Hackish. Consider the following usage:
          usage: prog [options] [-a]
          options: -a
@@ -1703,18 +2753,7 @@ public:
          TODO: this currently only removes the matched variant. For example, prog -a --alpha would still be allowed.
          */
         
-        for (size_t i=0; i < this->shortcut_options.size(); i++) {
-            const option_t &shortcut_opt = this->shortcut_options.at(i);
-            for (size_t j=0; j < usage_options.size(); j++) {
-                const option_t &usage_opt = usage_options.at(j);
-                if (shortcut_opt.has_same_name(usage_opt)) {
-                    // Remove this shortcut, and decrement the index to reflect the position shift of the remaining items
-                    this->shortcut_options.erase(this->shortcut_options.begin() + i);
-                    i-=1;
-                    break;
-                }
-            }
-        }
+        remove_options_named_in(&this->shortcut_options, usage_options);
         
         
         // Example of how to dump
@@ -1726,14 +2765,12 @@ public:
             }
             fprintf(stderr, "%s\n", dumped.c_str());
         }
-        
-        /* Successfully preflighted */
-        return true;
     }
     
-    // TODO: make this const by stop touching error_list
-    void best_assignment_for_argv(const rstring_list_t &argv, parse_flags_t flags, error_list_t *out_errors, index_list_t *out_unused_arguments, option_rmap_t *out_option_map)
+    /* Matches argv against our usages. Like every query, this is const and keeps all of its state on the stack (or in the caller's out parameters), so it may run concurrently on one impl. */
+    void best_assignment_for_argv(const rstring_list_t &argv, parse_flags_t flags, error_list_t *out_errors, index_list_t *out_unused_arguments, rargument_list_t *out_option_map, match_budget_t *budget = NULL) const
     {
+        this->ensure_compiled(stage_usages);
         positional_argument_list_t positionals;
         resolved_option_list_t resolved_options;
         
@@ -1741,11 +2778,14 @@ public:
         separate_argv_into_options_and_positionals(argv, all_options, flags, &positionals, &resolved_options, out_errors);
         
         // Produce an option map
-        this->match_argv(argv, flags, positionals, resolved_options, out_option_map, out_unused_arguments);
+        this->match_argv(argv, flags, positionals, resolved_options, out_option_map, out_unused_arguments, budget);
     }
     
-    rstring_list_t suggest_next_argument(const rstring_list_t &argv, parse_flags_t flags) const
+    /* Returns the possible next arguments after argv. If prefix is not empty, only those that could complete it are returned. */
+    rstring_list_t suggest_next_argument(const rstring_list_t &argv, const rstring_t &prefix, parse_flags_t flags, match_budget_t *budget = NULL) const
     {
+        this->ensure_compiled(stage_usages);
+        
         /* Set internal flags to generate suggestions */
         flags |= flag_generate_suggestions;
         
@@ -1754,21 +2794,33 @@ public:
         rstring_t suggestion;
         separate_argv_into_options_and_positionals(argv, all_options, flags, &positionals, &resolved_options, NULL /* errors */, &suggestion);
         
+        return this->suggest_next_argument_separated(argv, prefix, flags, positionals, resolved_options, suggestion, budget);
+    }
+    
+    /* Like suggest_next_argument, for an argv that has already been separated (with flag_generate_suggestions). suggestion is what separating suggested, if anything. usage_matches is as in match_argv; reusing them requires an empty prefix. */
+    rstring_list_t suggest_next_argument_separated(const rstring_list_t &argv, const rstring_t &prefix, parse_flags_t flags, const positional_argument_list_t &positionals, const resolved_option_list_t &resolved_options, const rstring_t &suggestion, match_budget_t *budget, usage_match_list_t *usage_matches = NULL) const
+    {
         /* If we got a suggestion, it means that the last argument was of the form --foo, where --foo wants a value. That's all we care about. */
         if (! suggestion.empty()) {
             return rstring_list_t(1, suggestion);
         }
         
-        match_context_t ctx(flags, shortcut_options, positionals, resolved_options, argv);
+        flags |= flag_generate_suggestions;
+        match_context_t ctx(flags, shortcut_options, positionals, resolved_options, argv, result_keys, budget, usage_matches);
+        ctx.suggestion_prefix = prefix;
         match_state_t init_state;
         init_state.consumed_options.resize(resolved_options.size(), false);
         match_state_list_t states;
         match(this->usages, &init_state, &ctx, &states);
         
-        /* Find the state(s) with the fewest unused arguments, and then insert all of their suggestions into a list */
+        /* Find the state(s) with the fewest unused arguments, and then insert all of their suggestions into a list. As in match_argv, states cut short by the budget are only considered if there is nothing else. */
+        const bool only_complete = has_untruncated_state(states);
         rstring_list_t all_suggestions;
         size_t best_unused_arg_count = (size_t)-1;
         for (size_t i=0; i < states.size(); i++) {
+            if (only_complete && states.at(i).truncated) {
+                continue;
+            }
             size_t count = ctx.unused_arguments(&states.at(i)).size();
             if (count < best_unused_arg_count) {
                 best_unused_arg_count = count;
@@ -1776,6 +2828,9 @@ public:
         }
         for (size_t i=0; i < states.size(); i++) {
             const match_state_t &state = states.at(i);
+            if (only_complete && state.truncated) {
+                continue;
+            }
             if (ctx.unused_arguments(&state).size() == best_unused_arg_count) {
                 all_suggestions.insert(all_suggestions.end(), state.suggested_next_arguments.begin(), state.suggested_next_arguments.end());
             }
@@ -1787,12 +2842,9 @@ public:
     }
     
     rstring_t commands_for_variable(const rstring_t &var_name) const {
-        rstring_t result;
-        variable_command_map_t::const_iterator where = this->variables_to_commands.find(var_name);
-        if (where != this->variables_to_commands.end()) {
-            result = where->second;
-        }
-        return result;
+        this->ensure_compiled(stage_options);
+        const rstring_t *command = this->variables_to_commands.find(var_name);
+        return command ? *command : rstring_t();
     }
     
     rstring_t description_for_option(const rstring_t &given_option_name) const {
@@ -1801,105 +2853,1624 @@ public:
             return rstring_t();
         }
         
-        rstring_t result;
-        const bool has_double_dash = (given_option_name.at(1) == '-');
-        // We have to go through our options and compare their names to the given string
-        const rstring_t needle(given_option_name);
-        for (size_t i=0; i < this->all_options.size(); i++) {
-            const option_t &opt = this->all_options.at(i);
-            
-            // We can skip options without descriptions
-            if (opt.description.empty()) {
-                continue;
-            }
-            
-            bool matches = false;
-            if (has_double_dash) {
-                matches = (needle == opt.names[option_t::double_long]);
+        // Options in usages may share names with those in the options section, so this needs everything
+        this->ensure_compiled(stage_usages);
+        
+        // Names carry their dashes, so a --name can only match a double_long name, and so on
+        const rstring_t *description = this->option_descriptions.find(given_option_name);
+        return description ? *description : rstring_t();
+    }
+    
+    /* Returns the suggestions, with their kinds and their descriptions or commands */
+    template<typename stdstring_t>
+    std::vector<base_suggestion_t<stdstring_t> > describe_suggestions(const rstring_list_t &suggestions) const {
+        std::vector<base_suggestion_t<stdstring_t> > result(suggestions.size());
+        for (size_t i=0; i < suggestions.size(); i++) {
+            const rstring_t &text = suggestions.at(i);
+            base_suggestion_t<stdstring_t> *sugg = &result.at(i);
+            text.copy_to(&sugg->text);
+            if (text.has_prefix("<")) {
+                sugg->kind = suggestion_variable;
+                this->commands_for_variable(text).copy_to(&sugg->command);
+            } else if (text.has_prefix("-") && text.length() > 1) {
+                sugg->kind = suggestion_option;
+                this->description_for_option(text).copy_to(&sugg->description);
             } else {
-                matches = (needle == opt.names[option_t::single_long] || needle == opt.names[option_t::single_short]);
-            }
-            
-            if (matches) {
-                result = opt.description;
-                break;
+                sugg->kind = suggestion_fixed;
             }
         }
         return result;
     }
     
     template<typename stdstring_t>
-    std::vector<stdstring_t> get_command_names() const {
-        /* Get the command names. We store a set of seen names so we only return tha names once, but in the order matching their appearance in the usage spec. */
-        std::vector<stdstring_t> result;
-        std::set<rstring_t> seen;
+    const std::vector<stdstring_t> &get_command_names() const {
+        if (this->usage_specs.empty()) {
+            // We will use the default usage, so get the name from that
+            this->ensure_compiled(stage_usages);
+        }
+        return this->command_names(static_cast<const stdstring_t *>(NULL));
+    }
+    
+    /* Predicts how expensive our usages may be to match */
+    complexity_report_t analyze_complexity(size_t argv_length) const {
+        this->ensure_compiled(stage_usages);
+        complexity_analyzer_t analyzer(argv_length);
         for (size_t i=0; i < this->usages.size(); i++) {
+            // The default usage is not in our source. A loaded impl has no usage specs, so fall back to the program name.
             const usage_t &usage = this->usages.at(i);
-            const rstring_t name = usage.prog_name;
-            if (! name.empty() && seen.insert(name).second) {
-                result.push_back(name.std_string<stdstring_t>());
+            if (this->has_default_usage) {
+                analyzer.add_usage(usage, rstring_t());
+            } else {
+                analyzer.add_usage(usage, i < this->usage_specs.size() ? this->usage_specs.at(i) : usage.prog_name);
             }
         }
-        return result;
-        
+        return analyzer.report;
     }
     
     template<typename stdstring_t>
-    std::vector<stdstring_t> get_variables() const {
-        std::vector<stdstring_t> result;
-        
-        // Include explicit variables
-        for (size_t i=0; i < this->all_variables.size(); i++) {
-            const rstring_t &r = this->all_variables.at(i);
-            result.push_back(r.std_string<stdstring_t>());
-        }
-        
-        // Include variables that are part of options
-        for (size_t i=0; i < this->all_options.size(); i++) {
-            const rstring_t &r = this->all_options.at(i).value;
-            if (! r.empty()) {
-                result.push_back(r.std_string<stdstring_t>());
-            }
+    const std::vector<stdstring_t> &get_variables() const {
+        this->ensure_compiled(stage_usages);
+        return this->variable_names(static_cast<const stdstring_t *>(NULL));
+    }
+    
+    /* Returns an estimate of the memory we use, in bytes */
+    size_t memory_estimate() const {
+        // Hold the compile lock, so that a deferred stage is not running while we look
+        pthread_mutex_t *lock = &const_cast<docopt_impl *>(this)->compile_lock;
+        pthread_mutex_lock(lock);
+        size_t result = sizeof *this;
+        result += this->rsource.length() * (this->narrow_source ? sizeof(char) : sizeof(wchar_t));
+        node_size_counter_t counter;
+        for (size_t i=0; i < this->usages.size(); i++) {
+            counter.begin(this->usages.at(i));
         }
-        
-        // Sort and remove duplicates
-        std::sort(result.begin(), result.end());
-        result.erase(std::unique(result.begin(), result.end()), result.end());
+        result += counter.total;
+        result += (this->shortcut_options.size() + this->all_options.size()) * sizeof(option_t);
+        result += (this->all_variables.size() + this->all_static_arguments.size() + this->result_keys.size()) * sizeof(rstring_t);
+        result += this->result_key_aliases.size() * sizeof(key_alias_t);
+        result += this->option_descriptions.memory_estimate() + this->variables_to_commands.memory_estimate();
+        const size_t name_count = this->command_names_narrow.size() + this->command_names_wide.size() + this->variable_names_narrow.size() + this->variable_names_wide.size();
+        result += name_count * sizeof(std::wstring);
+        result += this->empty_args.size() * sizeof(empty_arg_t);
+        result += this->spec_results.size() * sizeof(spec_result_t) + this->usage_errors.size() * sizeof(error_list_t);
+        result += this->compile_errors.size() * sizeof(error_t);
+        pthread_mutex_unlock(lock);
         return result;
     }
     
 }; // docopt_impl
 
-template<typename stdstring_t>
-std::vector<argument_status_t> argument_parser_t<stdstring_t>::validate_arguments(const std::vector<stdstring_t> &argv, parse_flags_t flags) const
-{
-    size_t arg_count = argv.size();
-    std::vector<argument_status_t> result(arg_count, status_valid);
-    
-    index_list_t unused_args;
-    const rstring_list_t argv_rstrs(argv.begin(), argv.end());
-    impl->best_assignment_for_argv(argv_rstrs, flags, NULL /* errors */, &unused_args, NULL);
-    
-    // Unused arguments are all invalid
-    for (size_t i=0; i < unused_args.size(); i++) {
+#pragma mark -
+#pragma mark Parallel Execution
+#pragma mark -
+
+/* A piece of work that can be split into independent items, numbered from 0. Workers are also numbered from 0, so that tasks can keep scratch space per worker. */
+class parallel_task_t {
+    public:
+    virtual void run(size_t worker_idx, size_t item_idx) = 0;
+    virtual ~parallel_task_t() {}
+};
+
+/* The items a worker has yet to run, as a range. The worker takes items from the front; thieves take half from the back. */
+struct work_range_t {
+    pthread_mutex_t lock;
+    size_t begin;
+    size_t end;
+};
+
+struct parallel_run_t {
+    parallel_task_t *task;
+    work_range_t *ranges;
+    size_t worker_count;
+};
+
+struct parallel_worker_t {
+    parallel_run_t *run;
+    size_t worker_idx;
+};
+
+/* Takes the next item from the worker's own range. Returns false if it is empty. */
+static bool take_own_item(work_range_t *range, size_t *out_item) {
+    bool result = false;
+    pthread_mutex_lock(&range->lock);
+    if (range->begin < range->end) {
+        *out_item = range->begin++;
+        result = true;
+    }
+    pthread_mutex_unlock(&range->lock);
+    return result;
+}
+
+/* Moves half of some other worker's remaining items into the (empty) range of the given worker. Returns false if there was nothing left to steal, in which case all work has been claimed. Only one lock is held at a time. */
+static bool steal_items(parallel_run_t *run, size_t worker_idx) {
+    for (size_t i=1; i < run->worker_count; i++) {
+        work_range_t *victim = &run->ranges[(worker_idx + i) % run->worker_count];
+        size_t begin = 0, end = 0;
+        pthread_mutex_lock(&victim->lock);
+        if (victim->begin < victim->end) {
+            size_t half = (victim->end - victim->begin + 1) / 2;
+            end = victim->end;
+            begin = end - half;
+            victim->end = begin;
+        }
+        pthread_mutex_unlock(&victim->lock);
+        
+        if (begin < end) {
+            work_range_t *own = &run->ranges[worker_idx];
+            pthread_mutex_lock(&own->lock);
+            own->begin = begin;
+            own->end = end;
+            pthread_mutex_unlock(&own->lock);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void *run_parallel_worker(void *context) {
+    const parallel_worker_t *worker = static_cast<const parallel_worker_t *>(context);
+    parallel_run_t *run = worker->run;
+    work_range_t *own = &run->ranges[worker->worker_idx];
+    for (;;) {
+        size_t item;
+        if (take_own_item(own, &item)) {
+            run->task->run(worker->worker_idx, item);
+        } else if (! steal_items(run, worker->worker_idx)) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+/* How many items each worker should have before another thread is worth starting. Creating and joining a thread costs tens of microseconds, about ten parses of a typical argv, or one compile of a typical doc. */
+static const size_t parse_batch_min_items_per_worker = 32;
+static const size_t compile_all_min_items_per_worker = 2;
+
+/* Returns the number of workers to use for the given thread count (0 meaning one per online CPU) and number of items, giving each worker at least min_items_per_worker items. Small batches thus get a single worker, and run serially on the calling thread. */
+static size_t effective_worker_count(size_t thread_count, size_t item_count, size_t min_items_per_worker) {
+    if (thread_count == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count = cpus > 0 ? cpus : 1;
+    }
+    return std::max(size_t(1), std::min(thread_count, item_count / min_items_per_worker));
+}
+
+/* Runs every item of the task, across worker_count workers (see effective_worker_count). The calling thread is worker 0. Items are initially split evenly between the workers, and workers that run out steal from the others, so uneven items still balance. If a thread cannot be created, the other workers steal its share. */
+static void run_parallel(parallel_task_t *task, size_t item_count, size_t worker_count) {
+    assert(worker_count > 0);
+    if (worker_count == 1) {
+        // No threads, so nothing to split or lock
+        for (size_t i=0; i < item_count; i++) {
+            task->run(0, i);
+        }
+        return;
+    }
+    
+    parallel_run_t run;
+    run.task = task;
+    run.worker_count = worker_count;
+    run.ranges = new work_range_t[worker_count];
+    for (size_t i=0; i < worker_count; i++) {
+        pthread_mutex_init(&run.ranges[i].lock, NULL);
+        run.ranges[i].begin = item_count * i / worker_count;
+        run.ranges[i].end = item_count * (i + 1) / worker_count;
+    }
+    
+    std::vector<parallel_worker_t> workers(worker_count);
+    std::vector<pthread_t> threads(worker_count);
+    std::vector<bool> started(worker_count, false);
+    for (size_t i=0; i < worker_count; i++) {
+        workers[i].run = &run;
+        workers[i].worker_idx = i;
+    }
+    for (size_t i=1; i < worker_count; i++) {
+        started[i] = (0 == pthread_create(&threads[i], NULL, run_parallel_worker, &workers[i]));
+    }
+    run_parallel_worker(&workers[0]);
+    for (size_t i=1; i < worker_count; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+    
+    for (size_t i=0; i < worker_count; i++) {
+        pthread_mutex_destroy(&run.ranges[i].lock);
+    }
+    delete[] run.ranges;
+}
+
+/* Sets the doc of each of a list of parsers. Parsers (and their impls) are independent, so this needs no scratch or locking. */
+template<typename stdstring_t>
+class compile_all_task_t : public parallel_task_t {
+    typedef typename argument_parser_t<stdstring_t>::error_list_t error_list_t;
+    
+    const std::vector<stdstring_t> &docs;
+    std::vector<argument_parser_t<stdstring_t> > *parsers;
+    std::vector<error_list_t> *out_errors;
+    
+    public:
+    compile_all_task_t(const std::vector<stdstring_t> &d, std::vector<argument_parser_t<stdstring_t> > *p, std::vector<error_list_t> *errs) : docs(d), parsers(p), out_errors(errs) {}
+    
+    void run(size_t worker_idx UNUSED, size_t item_idx) {
+        this->parsers->at(item_idx).set_doc(this->docs.at(item_idx), this->out_errors ? &this->out_errors->at(item_idx) : NULL);
+    }
+};
+
+/* Parses a batch of argvs, as parse_arguments would, with scratch space per worker */
+template<typename stdstring_t>
+class parse_batch_task_t : public parallel_task_t {
+    typedef typename argument_parser_t<stdstring_t>::argument_map_t argument_map_t;
+    
+    const docopt_impl *impl;
+    const std::vector<std::vector<stdstring_t> > &argvs;
+    parse_flags_t flags;
+    std::vector<argument_map_t> *results;
+    std::vector<error_list_t> *out_errors;
+    std::vector<index_list_t> *out_unused_arguments;
+    
+    /* Per worker scratch */
+    struct scratch_t {
+        rstring_list_t argv;
+        rargument_list_t arguments;
+    };
+    std::vector<scratch_t> scratches;
+    
+    public:
+    parse_batch_task_t(const docopt_impl *i, const std::vector<std::vector<stdstring_t> > &a, parse_flags_t f, size_t worker_count, std::vector<argument_map_t> *r, std::vector<error_list_t> *errs, std::vector<index_list_t> *unused) : impl(i), argvs(a), flags(f), results(r), out_errors(errs), out_unused_arguments(unused), scratches(worker_count) {}
+    
+    void run(size_t worker_idx, size_t item_idx) {
+        scratch_t *scratch = &this->scratches.at(worker_idx);
+        const std::vector<stdstring_t> &argv = this->argvs.at(item_idx);
+        scratch->argv.clear();
+        for (size_t i=0; i < argv.size(); i++) {
+            scratch->argv.push_back(rstring_t(argv[i]));
+        }
+        scratch->arguments.clear();
+        
+        // Each item writes only to its own slots in the output, so no locking is needed
+        impl->best_assignment_for_argv(scratch->argv, this->flags,
+                                       this->out_errors ? &this->out_errors->at(item_idx) : NULL,
+                                       this->out_unused_arguments ? &this->out_unused_arguments->at(item_idx) : NULL,
+                                       &scratch->arguments);
+        impl->fill_argument_map<stdstring_t>(scratch->arguments, this->flags, &this->results->at(item_idx));
+    }
+};
+
+#pragma mark -
+#pragma mark Asynchronous Queries
+#pragma mark -
+
+/* What a base_async_query_t shares with its thread */
+template<typename string_t, typename result_t>
+struct async_query_state_t {
+    const argument_parser_t<string_t> parser;
+    const std::vector<string_t> argv;
+    const parse_flags_t flags;
+    match_budget_t budget;
+    result_t result;
+    
+    pthread_t thread;
+    bool has_thread;
+    volatile int finished;
+    
+    async_query_state_t(const argument_parser_t<string_t> &p, const std::vector<string_t> &av, parse_flags_t f, const match_budget_t &b) : parser(p), argv(av), flags(f), budget(b), has_thread(false), finished(0) {}
+};
+
+/* Runs the query that produces the given type of result */
+template<typename string_t>
+static void run_async_query(async_query_state_t<string_t, std::vector<argument_status_t> > *state) {
+    state->result = state->parser.validate_arguments(state->argv, state->flags, &state->budget);
+}
+
+template<typename string_t>
+static void run_async_query(async_query_state_t<string_t, std::vector<string_t> > *state) {
+    state->result = state->parser.suggest_next_argument(state->argv, state->flags, &state->budget);
+}
+
+template<typename string_t, typename result_t>
+static void *run_async_query_thread(void *context) {
+    async_query_state_t<string_t, result_t> *state = static_cast<async_query_state_t<string_t, result_t> *>(context);
+    run_async_query(state);
+    __atomic_store_n(&state->finished, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+template<typename string_t, typename result_t>
+base_async_query_t<string_t, result_t>::base_async_query_t() : state(NULL) {}
+
+template<typename string_t, typename result_t>
+base_async_query_t<string_t, result_t>::~base_async_query_t() {
+    this->reset();
+}
+
+template<typename string_t, typename result_t>
+void base_async_query_t<string_t, result_t>::reset() {
+    if (this->state != NULL) {
+        this->cancel();
+        this->wait();
+        delete this->state;
+        this->state = NULL;
+    }
+}
+
+template<typename string_t, typename result_t>
+void base_async_query_t<string_t, result_t>::start(const argument_parser_t<string_t> &parser, const std::vector<string_t> &argv, parse_flags_t flags, const match_budget_t &budget) {
+    this->reset();
+    this->state = new async_query_state_t<string_t, result_t>(parser, argv, flags, budget);
+    this->state->has_thread = (0 == pthread_create(&this->state->thread, NULL, run_async_query_thread<string_t, result_t>, this->state));
+    if (! this->state->has_thread) {
+        // No thread to be had; run it now
+        run_async_query_thread<string_t, result_t>(this->state);
+    }
+}
+
+template<typename string_t, typename result_t>
+bool base_async_query_t<string_t, result_t>::is_ready() const {
+    return this->state != NULL && __atomic_load_n(&this->state->finished, __ATOMIC_ACQUIRE);
+}
+
+template<typename string_t, typename result_t>
+const result_t &base_async_query_t<string_t, result_t>::wait() {
+    if (this->state == NULL) {
+        // Nothing was started. Make an empty state to hold an empty result.
+        this->state = new async_query_state_t<string_t, result_t>(argument_parser_t<string_t>(), std::vector<string_t>(), flags_default, match_budget_t());
+        this->state->finished = 1;
+    }
+    if (this->state->has_thread) {
+        pthread_join(this->state->thread, NULL);
+        this->state->has_thread = false;
+    }
+    return this->state->result;
+}
+
+template<typename string_t, typename result_t>
+void base_async_query_t<string_t, result_t>::cancel() {
+    if (this->state != NULL) {
+        this->state->budget.cancel();
+    }
+}
+
+template<typename string_t, typename result_t>
+const match_budget_t &base_async_query_t<string_t, result_t>::budget() const {
+    static const match_budget_t empty_budget;
+    return this->state ? this->state->budget : empty_budget;
+}
+
+#pragma mark -
+#pragma mark Compiled Form
+#pragma mark -
+
+/* The contents of a file: mapped read-only into memory and unmapped when destroyed, or, if it is small, read into a buffer and freed when destroyed */
+struct mapped_file_t {
+    const void *addr;
+    size_t length;
+    bool mapped;
+    
+    mapped_file_t(const void *a, size_t len, bool m) : addr(a), length(len), mapped(m) {}
+    ~mapped_file_t() {
+        if (this->mapped) {
+            munmap(const_cast<void *>(this->addr), this->length);
+        } else {
+            free(const_cast<void *>(this->addr));
+        }
+    }
+};
+
+/* Files up to this size are read rather than mapped. Mapping and unmapping, and faulting the pages in, cost several times more than reading a few pages. */
+static const size_t mapped_file_min_length = 64 * 1024;
+
+/* Returns the contents of the file at path, or NULL if it cannot be read or is shorter than min_length */
+static mapped_file_t *read_or_map_file(const char *path, size_t min_length) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    mapped_file_t *result = NULL;
+    struct stat st;
+    if (0 == fstat(fd, &st) && st.st_size >= (off_t)min_length) {
+        const size_t length = st.st_size;
+        if (length >= mapped_file_min_length) {
+            void *addr = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr != MAP_FAILED) {
+                result = new mapped_file_t(addr, length, true);
+            }
+        } else {
+            char *buffer = static_cast<char *>(malloc(length));
+            size_t amount_read = 0;
+            while (buffer != NULL && amount_read < length) {
+                ssize_t amt = read(fd, buffer + amount_read, length - amount_read);
+                if (amt <= 0) {
+                    break;
+                }
+                amount_read += amt;
+            }
+            if (amount_read == length) {
+                result = new mapped_file_t(buffer, length, false);
+            } else {
+                free(buffer);
+            }
+        }
+    }
+    close(fd);
+    return result;
+}
+
+/* The compiled form of a docopt_impl, as written by save_compiled and mapped by load_compiled, is:
+   
+   a compiled_header_t
+   word_count 32 bit words, encoding everything derived from the source
+   padding to a multiple of 8 bytes
+   the source, source_length code units of char_size bytes each
+ 
+ Every string is encoded as the (start, length) of a range of the source, so the encoding is position independent, and loading borrows the source in place rather than copying it. Lists are encoded as a count followed by their elements. Integers are in native byte order; byte_order detects files from a machine that differs. The words and the source are hashed separately, and the padding must be zero, so that a corrupted file is rejected before its words are decoded. The source hash is only checked when there is no expected doc to compare the source against. Besides the usages and names, the words hold the tables derived from them (name indexes with their slots, empty args, and name lists), so loading decodes them rather than building them.
+ */
+struct compiled_header_t {
+    char magic[4];
+    uint32_t byte_order;
+    uint32_t version;
+    uint32_t char_size;
+    uint32_t flags;
+    uint32_t word_count;
+    uint64_t source_length;
+    uint64_t source_hash;
+    uint64_t words_hash;
+};
+
+static const char compiled_magic[4] = {'D', 'O', 'C', 'F'};
+static const uint32_t compiled_byte_order = 0x01020304;
+static const uint32_t compiled_version = 3;
+
+enum {
+    compiled_flag_default_usage = 1U << 0,
+    compiled_all_flags = compiled_flag_default_usage
+};
+
+/* How deeply brackets may nest in a compiled file. Deeper docs fail to load, and are compiled from source instead. */
+static const size_t compiled_max_depth = 256;
+
+/* Returns the offset of the source within a compiled file with the given number of words */
+static size_t compiled_source_offset(size_t word_count) {
+    size_t offset = sizeof(compiled_header_t) + word_count * sizeof(uint32_t);
+    return (offset + 7) & ~size_t(7);
+}
+
+/* FNV-1a over the bytes of a source, used to detect stale compiled files */
+static uint64_t hash_source(const void *chars, size_t byte_count) {
+    const unsigned char *bytes = static_cast<const unsigned char *>(chars);
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i=0; i < byte_count; i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+/* FNV-1a taking a word at a time, for the encoded words of a compiled file */
+static uint64_t hash_words(const uint32_t *words, size_t word_count) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i=0; i < word_count; i++) {
+        hash = (hash ^ words[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+/* Encodes a docopt_impl into words */
+class compiled_writer_t {
+    const rstring_t &source;
+    
+    public:
+    std::vector<uint32_t> words;
+    
+    /* Set if something could not be encoded, e.g. a string that does not point into the source */
+    bool failed;
+    
+    explicit compiled_writer_t(const rstring_t &src) : source(src), failed(false) {}
+    
+    void write(size_t val) {
+        if (val > UINT32_MAX) {
+            this->failed = true;
+        }
+        this->words.push_back(static_cast<uint32_t>(val));
+    }
+    
+    void write(const rstring_t &str) {
+        if (str.empty()) {
+            this->write(size_t(0));
+            this->write(size_t(0));
+        } else {
+            if (str.base() != this->source.base() || str.end() > this->source.length()) {
+                this->failed = true;
+            }
+            this->write(str.start());
+            this->write(str.length());
+        }
+    }
+    
+    void write(const option_t &opt) {
+        for (size_t i=0; i < option_t::NAME_TYPE_COUNT; i++) {
+            this->write(opt.names[i]);
+        }
+        this->write(opt.value);
+        this->write(opt.description);
+        this->write(opt.default_value);
+        this->write(size_t(opt.separator));
+    }
+    
+    template<typename T>
+    void write(const std::vector<T> &list) {
+        this->write(list.size());
+        for (size_t i=0; i < list.size(); i++) {
+            this->write(list.at(i));
+        }
+    }
+    
+    template<typename T1, typename T2>
+    void write(const std::pair<T1, T2> &pair) {
+        this->write(pair.first);
+        this->write(pair.second);
+    }
+    
+    /* Name indexes are written with their slots, so that loading need not hash every name again */
+    void write(const name_index_t<rstring_t> &index) {
+        this->write(index.entries());
+        this->write(index.slots());
+    }
+    
+    void write(const simple_clause_t &node) {
+        const uint32_t present = (node.option.get() ? 1 : 0) | (node.fixed.get() ? 2 : 0) | (node.variable.get() ? 4 : 0);
+        this->write(size_t(present));
+        if (node.option.get()) {
+            this->write(node.option.get()->word);
+            this->write(node.option.get()->option);
+        }
+        if (node.fixed.get()) {
+            this->write(node.fixed.get()->word);
+        }
+        if (node.variable.get()) {
+            this->write(node.variable.get()->word);
+        }
+    }
+    
+    void write(const expression_t &node) {
+        this->write(size_t(node.production));
+        const uint32_t present = (node.simple_clause.get() ? 1 : 0) | (node.alternation_list.get() ? 2 : 0) | (node.opt_ellipsis.present ? 4 : 0) | (node.options_shortcut.present ? 8 : 0);
+        this->write(size_t(present));
+        this->write(node.open_token);
+        this->write(node.close_token);
+        this->write(node.opt_ellipsis.ellipsis);
+        if (node.simple_clause.get()) {
+            this->write(*node.simple_clause);
+        }
+        if (node.alternation_list.get()) {
+            this->write(*node.alternation_list);
+        }
+    }
+    
+    void write(const expression_list_t &node) {
+        this->write(node.expressions);
+    }
+    
+    void write(const alternation_list_t &node) {
+        this->write(node.alternations);
+    }
+    
+    void write(const usage_t &node) {
+        this->write(node.prog_name);
+        this->write(node.alternation_list);
+    }
+    
+    void write(const docopt_impl &impl) {
+        // The default usage is rebuilt when loading, rather than encoded
+        if (impl.has_default_usage) {
+            this->write(size_t(0));
+        } else {
+            this->write(impl.usages);
+        }
+        this->write(impl.shortcut_options);
+        this->write(impl.all_options);
+        this->write(impl.all_variables);
+        this->write(impl.all_static_arguments);
+        this->write(impl.variables_to_commands);
+        this->write(impl.result_keys);
+        this->write(impl.result_key_aliases);
+        
+        // The tables derived from the above are written too, so that loading does not derive them again
+        this->write(impl.option_descriptions);
+        this->write(impl.empty_args.size());
+        for (size_t i=0; i < impl.empty_args.size(); i++) {
+            this->write(impl.empty_args.at(i).key_idx);
+            this->write(impl.empty_args.at(i).default_value);
+        }
+        if (! impl.has_default_usage) {
+            // The default usage's command name is not in the source, so it is derived when loading
+            this->write(impl.command_name_list());
+        }
+        this->write(impl.variable_name_list());
+    }
+};
+
+/* Decodes what compiled_writer_t encodes. Every read is bounds checked, and every node is checked against the shape the parser gives it, so a malformed file fails to load rather than producing an impl that matching would trip over. */
+class compiled_reader_t {
+    const uint32_t *cursor;
+    const uint32_t *end;
+    const rstring_t &source;
+    
+    /* How many expressions enclose the one being read */
+    size_t depth;
+    
+    public:
+    compiled_reader_t(const uint32_t *words, size_t word_count, const rstring_t &src) : cursor(words), end(words + word_count), source(src), depth(0) {}
+    
+    bool at_end() const {
+        return this->cursor == this->end;
+    }
+    
+    bool read(size_t *val) {
+        if (this->cursor == this->end) {
+            return false;
+        }
+        *val = *this->cursor++;
+        return true;
+    }
+    
+    /* Reads a count of elements, each of which takes at least min_words */
+    bool read_count(size_t *count, size_t min_words) {
+        return this->read(count) && *count <= size_t(this->end - this->cursor) / min_words;
+    }
+    
+    bool read(rstring_t *str) {
+        size_t start, length;
+        if (! this->read(&start) || ! this->read(&length)) {
+            return false;
+        }
+        if (start > this->source.length() || length > this->source.length() - start) {
+            return false;
+        }
+        *str = length ? this->source.substr(start, length) : rstring_t();
+        return true;
+    }
+    
+    bool read(option_t *opt) {
+        size_t separator;
+        for (size_t i=0; i < option_t::NAME_TYPE_COUNT; i++) {
+            if (! this->read(&opt->names[i])) {
+                return false;
+            }
+        }
+        if (! this->read(&opt->value) || ! this->read(&opt->description) || ! this->read(&opt->default_value) || ! this->read(&separator) || separator > option_t::sep_none) {
+            return false;
+        }
+        opt->separator = static_cast<option_t::separator_t>(separator);
+        return true;
+    }
+    
+    template<typename T>
+    bool read(std::vector<T> *list) {
+        size_t count;
+        if (! this->read_count(&count, 1)) {
+            return false;
+        }
+        list->resize(count);
+        for (size_t i=0; i < count; i++) {
+            if (! this->read(&list->at(i))) {
+                return false;
+            }
+        }
+        return true;
+    }
+    
+    template<typename T1, typename T2>
+    bool read(std::pair<T1, T2> *pair) {
+        return this->read(&pair->first) && this->read(&pair->second);
+    }
+    
+    bool read(name_index_t<rstring_t> *index) {
+        std::vector<name_index_t<rstring_t>::entry_t> entries;
+        std::vector<size_t> slots;
+        return this->read(&entries) && this->read(&slots) && index->assign(&entries, &slots);
+    }
+    
+    bool read(simple_clause_t *node) {
+        // Exactly one of option, fixed and variable
+        size_t present;
+        if (! this->read(&present) || (present != 1 && present != 2 && present != 4)) {
+            return false;
+        }
+        if (present & 1) {
+            node->option.reset(new option_clause_t());
+            if (! this->read(&node->option.get()->word) || ! this->read(&node->option.get()->option)) {
+                return false;
+            }
+        }
+        if (present & 2) {
+            node->fixed.reset(new fixed_clause_t());
+            if (! this->read(&node->fixed.get()->word)) {
+                return false;
+            }
+        }
+        if (present & 4) {
+            node->variable.reset(new variable_clause_t());
+            if (! this->read(&node->variable.get()->word)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    
+    bool read(expression_t *node) {
+        // A simple clause for production 0, an alternation list for the brackets of 1 and 2, and the shortcut alone for [options], which has no ellipsis
+        static const size_t present_for_production[] = {1, 2, 2, 8};
+        size_t production, present;
+        if (! this->read(&production) || ! this->read(&present) || production > 3 ||
+            (present & ~size_t(4)) != present_for_production[production] || (production == 3 && present != 8)) {
+            return false;
+        }
+        node->production = static_cast<uint8_t>(production);
+        node->opt_ellipsis.present = !! (present & 4);
+        node->options_shortcut.present = !! (present & 8);
+        if (! this->read(&node->open_token) || ! this->read(&node->close_token) || ! this->read(&node->opt_ellipsis.ellipsis)) {
+            return false;
+        }
+        if (present & 1) {
+            node->simple_clause.reset(new simple_clause_t());
+            if (! this->read(node->simple_clause.get())) {
+                return false;
+            }
+        }
+        if (present & 2) {
+            if (this->depth >= compiled_max_depth) {
+                return false;
+            }
+            this->depth++;
+            node->alternation_list.reset(new alternation_list_t());
+            bool success = this->read(node->alternation_list.get());
+            this->depth--;
+            if (! success) {
+                return false;
+            }
+        }
+        return true;
+    }
+    
+    bool read(expression_list_t *node) {
+        return this->read(&node->expressions);
+    }
+    
+    bool read(alternation_list_t *node) {
+        return this->read(&node->alternations);
+    }
+    
+    bool read(usage_t *node) {
+        return this->read(&node->prog_name) && this->read(&node->alternation_list);
+    }
+    
+    /* Returns true if the names are all result keys */
+    static bool are_result_keys(const docopt_impl &impl, const rstring_list_t &names) {
+        for (size_t i=0; i < names.size(); i++) {
+            if (impl.index_of_result_key(names.at(i)) == npos) {
+                return false;
+            }
+        }
+        return true;
+    }
+    
+    /* Returns true if the names that matching records for the options, and their variables, are all result keys */
+    static bool are_result_keys(const docopt_impl &impl, const option_list_t &options) {
+        for (size_t i=0; i < options.size(); i++) {
+            const option_t &opt = options.at(i);
+            if (impl.index_of_result_key(opt.best_name()) == npos || (opt.has_value() && impl.index_of_result_key(opt.value) == npos)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    
+    bool read(docopt_impl *impl, bool has_default_usage) {
+        size_t count;
+        if (! this->read(&impl->usages) || ! this->read(&impl->shortcut_options) || ! this->read(&impl->all_options) ||
+            ! this->read(&impl->all_variables) || ! this->read(&impl->all_static_arguments)) {
+            return false;
+        }
+        impl->has_default_usage = has_default_usage;
+        if (has_default_usage) {
+            if (! impl->usages.empty()) {
+                return false;
+            }
+            impl->usages.resize(1);
+            impl->usages.back().make_default();
+        }
+        
+        if (! this->read(&impl->variables_to_commands)) {
+            return false;
+        }
+        
+        // Keys and aliases are binary searched, so must be sorted, without duplicates
+        if (! this->read(&impl->result_keys) || ! this->read_count(&count, 3)) {
+            return false;
+        }
+        for (size_t i=1; i < impl->result_keys.size(); i++) {
+            if (! (impl->result_keys.at(i - 1) < impl->result_keys.at(i))) {
+                return false;
+            }
+        }
+        impl->result_key_aliases.resize(count);
+        for (size_t i=0; i < count; i++) {
+            docopt_impl::key_alias_t *alias = &impl->result_key_aliases.at(i);
+            if (! this->read(&alias->first) || ! this->read(&alias->second) || alias->second >= impl->result_keys.size()) {
+                return false;
+            }
+            if (i > 0 && ! (impl->result_key_aliases.at(i - 1).first < alias->first)) {
+                return false;
+            }
+        }
+        
+        // Everything that parsing looks up by name must be present in result_keys. Matching looks up the names in the usage trees, and in the options that [options] stands for.
+        option_list_t usage_options;
+        rstring_list_t usage_variables, usage_static_arguments;
+        collect_options_and_variables(impl->usages, &usage_options, &usage_variables, &usage_static_arguments);
+        if (! are_result_keys(*impl, impl->all_options) || ! are_result_keys(*impl, impl->shortcut_options) || ! are_result_keys(*impl, usage_options)) {
+            return false;
+        }
+        if (! are_result_keys(*impl, impl->all_variables) || ! are_result_keys(*impl, usage_variables) ||
+            ! are_result_keys(*impl, impl->all_static_arguments) || ! are_result_keys(*impl, usage_static_arguments)) {
+            return false;
+        }
+        
+        // The derived tables. Empty args index result_keys, and are merged with match results in key order.
+        if (! this->read(&impl->option_descriptions) || ! this->read_count(&count, 3)) {
+            return false;
+        }
+        impl->empty_args.resize(count);
+        for (size_t i=0; i < count; i++) {
+            docopt_impl::empty_arg_t *arg = &impl->empty_args.at(i);
+            if (! this->read(&arg->key_idx) || ! this->read(&arg->default_value) || arg->key_idx >= impl->result_keys.size()) {
+                return false;
+            }
+            if (i > 0 && impl->empty_args.at(i - 1).key_idx >= arg->key_idx) {
+                return false;
+            }
+        }
+        rstring_list_t names;
+        if (has_default_usage) {
+            impl->build_command_names();
+        } else {
+            if (! this->read(&names)) {
+                return false;
+            }
+            impl->fill_name_list(names, &impl->command_names_narrow, &impl->command_names_wide);
+        }
+        if (! this->read(&names)) {
+            return false;
+        }
+        impl->fill_name_list(names, &impl->variable_names_narrow, &impl->variable_names_wide);
+        impl->compiled_stage = docopt_impl::stage_usages;
+        impl->published_stage = docopt_impl::stage_usages;
+        return true;
+    }
+};
+
+/* Writes the compiled form of an impl to a file. Returns true on success. */
+template<typename stdchar_t>
+static bool save_compiled_impl(const docopt_impl *impl, const char *path) {
+    impl->ensure_compiled(docopt_impl::stage_usages);
+    compiled_writer_t writer(impl->rsource);
+    writer.write(*impl);
+    if (writer.failed) {
+        return false;
+    }
+    
+    const stdchar_t *chars = impl->rsource.chars<stdchar_t>();
+    const size_t source_length = impl->rsource.length();
+    compiled_header_t header;
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, compiled_magic, sizeof header.magic);
+    header.byte_order = compiled_byte_order;
+    header.version = compiled_version;
+    header.char_size = sizeof(stdchar_t);
+    header.flags = impl->has_default_usage ? compiled_flag_default_usage : 0;
+    header.word_count = static_cast<uint32_t>(writer.words.size());
+    header.source_length = source_length;
+    header.source_hash = hash_source(chars, source_length * sizeof(stdchar_t));
+    header.words_hash = hash_words(&writer.words[0], writer.words.size());
+    
+    FILE *file = fopen(path, "wb");
+    if (! file) {
+        return false;
+    }
+    const size_t words_end = sizeof header + writer.words.size() * sizeof(uint32_t);
+    const char padding[8] = {};
+    bool success = (fwrite(&header, sizeof header, 1, file) == 1 &&
+                    fwrite(&writer.words[0], sizeof(uint32_t), writer.words.size(), file) == writer.words.size() &&
+                    fwrite(padding, 1, compiled_source_offset(writer.words.size()) - words_end, file) == compiled_source_offset(writer.words.size()) - words_end &&
+                    fwrite(chars, sizeof(stdchar_t), source_length, file) == source_length);
+    success = (0 == fclose(file)) && success;
+    return success;
+}
+
+/* Reads or maps a compiled file and builds an impl from it. Returns NULL if the file cannot be read, is malformed, was written for a different version or character width, or (if expected_doc is not NULL) was not compiled from expected_doc. */
+template<typename stdstring_t>
+static docopt_impl *load_compiled_impl(const char *path, const stdstring_t *expected_doc) {
+    typedef typename stdstring_t::value_type stdchar_t;
+    mapped_file_t *contents = read_or_map_file(path, sizeof(compiled_header_t));
+    if (! contents) {
+        return NULL;
+    }
+    const shared_ptr<const mapped_file_t> file(contents);
+    const char *bytes = static_cast<const char *>(contents->addr);
+    const size_t file_length = contents->length;
+    
+    // Validate the header, and that the file is large enough for what it describes
+    compiled_header_t header;
+    memcpy(&header, bytes, sizeof header);
+    if (memcmp(header.magic, compiled_magic, sizeof header.magic) || header.byte_order != compiled_byte_order ||
+        header.version != compiled_version || header.char_size != sizeof(stdchar_t) || (header.flags & ~uint32_t(compiled_all_flags))) {
+        return NULL;
+    }
+    const size_t source_offset = compiled_source_offset(header.word_count);
+    if (source_offset > file_length || header.source_length > (file_length - source_offset) / sizeof(stdchar_t)) {
+        return NULL;
+    }
+    
+    // Validate the words and padding, before decoding anything
+    const uint32_t *words = reinterpret_cast<const uint32_t *>(bytes + sizeof header);
+    if (hash_words(words, header.word_count) != header.words_hash) {
+        return NULL;
+    }
+    for (const char *padding = reinterpret_cast<const char *>(words + header.word_count); padding < bytes + source_offset; padding++) {
+        if (*padding) {
+            return NULL;
+        }
+    }
+    
+    // Validate the source. Comparing it against the expected doc, if we have one, is both stricter and cheaper than hashing it.
+    const stdchar_t *chars = reinterpret_cast<const stdchar_t *>(bytes + source_offset);
+    const size_t source_length = header.source_length;
+    if (expected_doc) {
+        if (expected_doc->length() != source_length || memcmp(expected_doc->data(), chars, source_length * sizeof(stdchar_t))) {
+            return NULL;
+        }
+    } else if (hash_source(chars, source_length * sizeof(stdchar_t)) != header.source_hash) {
+        return NULL;
+    }
+    
+    docopt_impl *impl = new docopt_impl(file, chars, source_length);
+    compiled_reader_t reader(words, header.word_count, impl->rsource);
+    if (! reader.read(impl, !! (header.flags & compiled_flag_default_usage)) || ! reader.at_end()) {
+        impl->release();
+        return NULL;
+    }
+    return impl;
+}
+
+#pragma mark -
+#pragma mark Editing
+#pragma mark -
+
+/* A replacement of removed_length characters at offset with inserted_length others. A range of the old source that does not overlap the removed characters is found in the new source at the same place, if it is before them, or shifted by the change in length, if it is after them. */
+struct source_edit_t {
+    size_t offset;
+    size_t removed_length;
+    size_t inserted_length;
+    
+    /* Maps the start of a range from the old source to the new source. Returns false if the range overlaps the removed characters. */
+    bool map(size_t *start, size_t length) const {
+        if (*start + length <= this->offset) {
+            return true;
+        } else if (*start >= this->offset + this->removed_length) {
+            *start = *start - this->removed_length + this->inserted_length;
+            return true;
+        }
+        return false;
+    }
+    
+    /* Returns the edit that undoes this one */
+    source_edit_t inverse() const {
+        source_edit_t result = {this->offset, this->inserted_length, this->removed_length};
+        return result;
+    }
+};
+
+/* Moves values that refer to the source of one impl to the source of another, which is the first with an edit applied. A string away from the edit is moved per source_edit_t. A string the edit touched, or that ends where it starts or starts where it ends, is moved to its substitute, from parsing its line group again; if it has none, it is moved per source_edit_t if it can be, and otherwise moving fails. Strings that do not refer to the old source, like those of the default usage, are left alone. */
+class source_rebaser_t {
+    const rstring_t &old_source;
+    const rstring_t &new_source;
+    const source_edit_t &edit;
+    
+    /* Strings of the old source that the edit touched, and what they become */
+    std::vector<std::pair<rstring_t, rstring_t> > substitutes;
+    
+    public:
+    
+    /* Set if something could not be moved */
+    bool failed;
+    
+    source_rebaser_t(const rstring_t &old_src, const rstring_t &new_src, const source_edit_t &e) : old_source(old_src), new_source(new_src), edit(e), failed(false) {}
+    
+    /* Whether a string of the old source overlaps the edit or is next to it */
+    bool near_edit(const rstring_t &str) const {
+        return str.end() >= this->edit.offset && str.start() <= this->edit.offset + this->edit.removed_length;
+    }
+    
+    /* Given a string of the old source and the one parsed from the same place in the new source, arranges for the first to be moved to the second. If it is away from the edit, it must have simply moved. If same_text is set, it must keep its text, as names must for anything derived from them to stay valid; otherwise it must at least stay empty or nonempty. */
+    void substitute(const rstring_t &old_str, const rstring_t &new_str, bool same_text) {
+        if (old_str.empty() != new_str.empty() || (same_text && old_str != new_str)) {
+            this->failed = true;
+        } else if (! old_str.empty()) {
+            size_t start = old_str.start();
+            const bool moved = this->edit.map(&start, old_str.length()) && start == new_str.start() && old_str.length() == new_str.length();
+            if (! moved && ! this->near_edit(old_str)) {
+                this->failed = true;
+            } else if (! moved) {
+                this->substitutes.push_back(std::make_pair(old_str, new_str));
+            }
+        }
+    }
+    
+    void substitute(const option_t &old_opt, const option_t &new_opt) {
+        for (size_t i=0; i < option_t::NAME_TYPE_COUNT; i++) {
+            this->substitute(old_opt.names[i], new_opt.names[i], true);
+        }
+        this->substitute(old_opt.value, new_opt.value, true);
+        this->substitute(old_opt.description, new_opt.description, false);
+        this->substitute(old_opt.default_value, new_opt.default_value, false);
+        if (old_opt.separator != new_opt.separator) {
+            this->failed = true;
+        }
+    }
+    
+    void rebase(rstring_t *str) {
+        if (str->empty() || str->base() != this->old_source.base()) {
+            return;
+        }
+        if (this->near_edit(*str)) {
+            for (size_t i=0; i < this->substitutes.size(); i++) {
+                const rstring_t &old_str = this->substitutes.at(i).first;
+                if (old_str.start() == str->start() && old_str.length() == str->length()) {
+                    *str = this->substitutes.at(i).second;
+                    return;
+                }
+            }
+        }
+        size_t start = str->start();
+        if (this->edit.map(&start, str->length())) {
+            *str = this->new_source.substr(start, str->length());
+        } else {
+            this->failed = true;
+        }
+    }
+    
+    void rebase(error_t *error) {
+        if (! this->edit.map(&error->location, 0)) {
+            this->failed = true;
+        }
+    }
+    
+    void rebase(option_t *opt) {
+        for (size_t i=0; i < option_t::NAME_TYPE_COUNT; i++) {
+            this->rebase(&opt->names[i]);
+        }
+        this->rebase(&opt->value);
+        this->rebase(&opt->description);
+        this->rebase(&opt->default_value);
+    }
+    
+    template<typename T>
+    void rebase(std::vector<T> *list) {
+        for (size_t i=0; i < list->size(); i++) {
+            this->rebase(&list->at(i));
+        }
+    }
+    
+    void rebase(std::pair<rstring_t, rstring_t> *pair) {
+        this->rebase(&pair->first);
+        this->rebase(&pair->second);
+    }
+    
+    void rebase(docopt_impl::key_alias_t *alias) {
+        this->rebase(&alias->first);
+    }
+    
+    void rebase(variable_command_map_t *commands) {
+        // Keys are const in the map, but moving them keeps their order
+        variable_command_map_t result;
+        for (variable_command_map_t::const_iterator iter = commands->begin(); iter != commands->end(); ++iter) {
+            std::pair<rstring_t, rstring_t> entry = *iter;
+            this->rebase(&entry);
+            result.insert(result.end(), entry);
+        }
+        commands->swap(result);
+    }
+    
+    /* Moving names keeps their hashes, so the slots are kept too */
+    void rebase(name_index_t<rstring_t> *index) {
+        std::vector<name_index_t<rstring_t>::entry_t> entries = index->entries();
+        std::vector<size_t> slots = index->slots();
+        this->rebase(&entries);
+        index->assign(&entries, &slots);
+    }
+    
+    void rebase(docopt_impl::spec_result_t *spec) {
+        this->rebase(&spec->option);
+        this->rebase(&spec->commands);
+        this->rebase(&spec->errors);
+    }
+    
+    void rebase(docopt_impl::empty_arg_t *arg) {
+        this->rebase(&arg->default_value);
+    }
+    
+    void rebase(simple_clause_t *node) {
+        if (node->option.get()) {
+            this->rebase(&node->option.get()->word);
+            this->rebase(&node->option.get()->option);
+        }
+        if (node->fixed.get()) {
+            this->rebase(&node->fixed.get()->word);
+        }
+        if (node->variable.get()) {
+            this->rebase(&node->variable.get()->word);
+        }
+    }
+    
+    void rebase(expression_t *node) {
+        this->rebase(&node->open_token);
+        this->rebase(&node->close_token);
+        this->rebase(&node->opt_ellipsis.ellipsis);
+        if (node->simple_clause.get()) {
+            this->rebase(node->simple_clause.get());
+        }
+        if (node->alternation_list.get()) {
+            this->rebase(node->alternation_list.get());
+        }
+    }
+    
+    void rebase(expression_list_t *node) {
+        this->rebase(&node->expressions);
+    }
+    
+    void rebase(alternation_list_t *node) {
+        this->rebase(&node->alternations);
+    }
+    
+    void rebase(usage_t *node) {
+        this->rebase(&node->prog_name);
+        this->rebase(&node->alternation_list);
+    }
+};
+
+/* Moves a value that refers to the source of old_impl to the source of new_impl, which is the old source with the given edit applied. Returns false if the value refers to characters the edit removed. */
+template<typename T>
+static bool rebase_for_edit(const T &value, const docopt_impl &old_impl, const docopt_impl &new_impl, const source_edit_t &edit, T *out) {
+    source_rebaser_t rebaser(old_impl.rsource, new_impl.rsource, edit);
+    *out = value;
+    rebaser.rebase(out);
+    return ! rebaser.failed;
+}
+
+static bool line_group_starts_before(const rstring_t &group, size_t start) {
+    return group.start() < start;
+}
+
+/* Given a line group of the new source of an edit, returns the index of the same line group among old_groups (which are in source order), or npos if the edit changed it */
+static size_t find_unedited_line_group(const rstring_list_t &old_groups, const rstring_t &new_group, const source_edit_t &edit) {
+    size_t start = new_group.start();
+    if (! edit.inverse().map(&start, new_group.length())) {
+        return npos;
+    }
+    rstring_list_t::const_iterator where = std::lower_bound(old_groups.begin(), old_groups.end(), start, line_group_starts_before);
+    if (where == old_groups.end() || where->start() != start || where->length() != new_group.length()) {
+        return npos;
+    }
+    return where - old_groups.begin();
+}
+
+/* Compiles new_impl, whose source is the source of old_impl with the given edit applied. The result is the same as compiling new_impl from scratch, but line groups that the edit did not touch are not parsed again: their results are moved over from old_impl. Parsing an option or variable command spec depends only on its text, so those are reused whenever their line group is unchanged. Parsing a usage also depends on the shortcut options, so usages are reused only if every spec was. The passes over everything (uniqueizing, result keys, etc.) are run again. */
+static void compile_edited_impl(docopt_impl *new_impl, const docopt_impl &old_impl, const source_edit_t &edit, error_list_t *out_errors) {
+    typedef docopt_impl::spec_result_t spec_result_t;
+    old_impl.ensure_compiled(docopt_impl::stage_usages);
+    new_impl->classify_lines();
+    new_impl->compiled_stage = docopt_impl::stage_lines;
+    
+    // Reuse or parse each option spec and variable command spec. A loaded impl has no per-spec results to reuse.
+    const rstring_list_t &old_specs = old_impl.option_and_variable_specs;
+    const bool old_specs_available = old_impl.spec_results.size() == old_specs.size();
+    const size_t spec_count = new_impl->option_and_variable_specs.size();
+    size_t reused_spec_count = 0;
+    new_impl->spec_results.resize(spec_count);
+    for (size_t i=0; i < spec_count; i++) {
+        const size_t old_idx = old_specs_available ? find_unedited_line_group(old_specs, new_impl->option_and_variable_specs.at(i), edit) : npos;
+        if (old_idx != npos && rebase_for_edit(old_impl.spec_results.at(old_idx), old_impl, *new_impl, edit, &new_impl->spec_results.at(i))) {
+            reused_spec_count++;
+        } else {
+            new_impl->spec_results.at(i) = spec_result_t();
+            new_impl->parse_spec(i);
+        }
+    }
+    new_impl->compile_through(docopt_impl::stage_options, out_errors);
+    
+    // Reuse or parse each usage
+    const rstring_list_t &old_usage_specs = old_impl.usage_specs;
+    const bool old_usages_available = (reused_spec_count == spec_count && spec_count == old_specs.size() &&
+                                       ! old_impl.has_default_usage && old_impl.usages.size() == old_usage_specs.size() && old_impl.usage_errors.size() == old_usage_specs.size());
+    const size_t usage_count = new_impl->usage_specs.size();
+    new_impl->usages.resize(usage_count);
+    new_impl->usage_errors.resize(usage_count);
+    for (size_t i=0; i < usage_count; i++) {
+        const size_t old_idx = old_usages_available ? find_unedited_line_group(old_usage_specs, new_impl->usage_specs.at(i), edit) : npos;
+        if (old_idx == npos ||
+            ! rebase_for_edit(old_impl.usages.at(old_idx), old_impl, *new_impl, edit, &new_impl->usages.at(i)) ||
+            ! rebase_for_edit(old_impl.usage_errors.at(old_idx), old_impl, *new_impl, edit, &new_impl->usage_errors.at(i))) {
+            new_impl->usages.at(i) = usage_t();
+            new_impl->usage_errors.at(i).clear();
+            new_impl->parse_usage(i);
+        }
+    }
+    new_impl->compile_through(docopt_impl::stage_usages, out_errors);
+    new_impl->published_stage = new_impl->compiled_stage;
+}
+
+/* Returns the index of the line group among groups (which are in source order) that contains the characters from offset through offset + length, or npos if there is none */
+static size_t line_group_containing(const rstring_list_t &groups, size_t offset, size_t length) {
+    rstring_list_t::const_iterator where = std::lower_bound(groups.begin(), groups.end(), offset + 1, line_group_starts_before);
+    if (where == groups.begin() || (where - 1)->end() < offset + length) {
+        return npos;
+    }
+    return where - 1 - groups.begin();
+}
+
+/* Compiles new_impl, whose source is the source of old_impl with the given edit applied, without running any of the passes over the whole doc, if the edit leaves everything they compute the same. That is so if the edit is within the text of one line after its first character, so that every line keeps its header, indent and leading character, and so its classification; and if the edit is in prose, or in an option spec or variable command spec that keeps its names, and changes only the text of its description, default value or command. Then at most one line group is parsed again, and everything else is moved over from old_impl by rebasing. Returns false if the edit is not like that, or an error is in the way, in which case new_impl must be discarded. */
+static bool rebase_edited_impl(docopt_impl *new_impl, const docopt_impl &old_impl, const source_edit_t &edit, error_list_t *out_errors) {
+    typedef docopt_impl::spec_result_t spec_result_t;
+    old_impl.ensure_compiled(docopt_impl::stage_usages);
+    const rstring_t &old_source = old_impl.rsource;
+    const rstring_t &new_source = new_impl->rsource;
+    
+    // A loaded impl has neither the line groups nor the errors that we would move over
+    if (old_impl.storage_mapped || old_impl.spec_results.size() != old_impl.option_and_variable_specs.size()) {
+        return false;
+    }
+    
+    // Find the line of the edit, which neither the removed nor the inserted characters may end
+    if (old_source.substr(edit.offset, edit.removed_length).find_newline(0) != rstring_t::npos ||
+        new_source.substr(edit.offset, edit.inserted_length).find_newline(0) != rstring_t::npos) {
+        return false;
+    }
+    size_t line_start = edit.offset;
+    while (line_start > 0 && old_source[line_start - 1] != '\n') {
+        line_start--;
+    }
+    size_t line_end = old_source.find_newline(edit.offset + edit.removed_length);
+    if (line_end == rstring_t::npos) {
+        line_end = old_source.length();
+    }
+    const rstring_t old_line = old_source.substr(line_start, line_end - line_start).trim_whitespace();
+    const rstring_t new_line = new_source.substr(line_start, line_end - edit.removed_length + edit.inserted_length - line_start).trim_whitespace();
+    
+    // The text of the line after its header must start before the edit, so that it keeps its header and first character, and end the same way after it, so that it changes by the length of the edit
+    const rstring_t old_header = find_header(old_line), new_header = find_header(new_line);
+    const rstring_t old_text = old_line.substr_from(old_header.length()).trim_whitespace();
+    const rstring_t new_text = new_line.substr_from(new_header.length()).trim_whitespace();
+    if (old_text.empty() || old_text.start() >= edit.offset || new_header.length() != old_header.length() ||
+        new_text.end() != old_text.end() - edit.removed_length + edit.inserted_length) {
+        return false;
+    }
+    
+    // An edit in a usage may change its options, variables and commands; leave it to compile_edited_impl
+    if (line_group_containing(old_impl.usage_specs, edit.offset, edit.removed_length) != npos) {
+        return false;
+    }
+    
+    // Parse the spec the edit is in again, if any, and check that it agrees with the old one but for the text that may change
+    source_rebaser_t rebaser(old_source, new_source, edit);
+    const size_t spec_idx = line_group_containing(old_impl.option_and_variable_specs, edit.offset, edit.removed_length);
+    if (spec_idx != npos) {
+        const rstring_t &old_group = old_impl.option_and_variable_specs.at(spec_idx);
+        const rstring_t new_group = new_source.substr(old_group.start(), old_group.length() - edit.removed_length + edit.inserted_length);
+        const spec_result_t &old_spec = old_impl.spec_results.at(spec_idx);
+        spec_result_t new_spec;
+        rebaser.substitute(old_group, new_group, false);
+        if (old_group[0] == '-') {
+            // Duplicate options compete on the length of their descriptions
+            for (size_t i=0; i < old_impl.compile_errors.size(); i++) {
+                if (old_impl.compile_errors.at(i).code == error_option_duplicated_in_options_section) {
+                    return false;
+                }
+            }
+            new_spec.option = parse_one_option_spec(new_group, &new_spec.errors);
+            rebaser.substitute(old_spec.option, new_spec.option);
+        } else {
+            new_spec.commands = parse_one_variable_command_spec(new_group, &new_spec.errors);
+            if (new_spec.commands.size() != old_spec.commands.size()) {
+                return false;
+            }
+            variable_command_map_t::const_iterator old_iter = old_spec.commands.begin(), new_iter = new_spec.commands.begin();
+            for (; old_iter != old_spec.commands.end(); ++old_iter, ++new_iter) {
+                rebaser.substitute(old_iter->first, new_iter->first, true);
+                rebaser.substitute(old_iter->second, new_iter->second, false);
+            }
+        }
+        if (! old_spec.errors.empty() || ! new_spec.errors.empty() || rebaser.failed) {
+            return false;
+        }
+    }
+    
+    // Move everything over. The names keep their text, so the lists of them and their indexes keep their order.
+    new_impl->option_and_variable_specs = old_impl.option_and_variable_specs;
+    new_impl->usage_specs = old_impl.usage_specs;
+    new_impl->unknown_leader_line = old_impl.unknown_leader_line;
+    new_impl->compile_errors = old_impl.compile_errors;
+    new_impl->spec_results = old_impl.spec_results;
+    new_impl->usage_errors = old_impl.usage_errors;
+    new_impl->usages = old_impl.usages;
+    new_impl->has_default_usage = old_impl.has_default_usage;
+    new_impl->shortcut_options = old_impl.shortcut_options;
+    new_impl->all_options = old_impl.all_options;
+    new_impl->all_variables = old_impl.all_variables;
+    new_impl->all_static_arguments = old_impl.all_static_arguments;
+    new_impl->variables_to_commands = old_impl.variables_to_commands;
+    new_impl->result_keys = old_impl.result_keys;
+    new_impl->result_key_aliases = old_impl.result_key_aliases;
+    new_impl->option_descriptions = old_impl.option_descriptions;
+    new_impl->empty_args = old_impl.empty_args;
+    rebaser.rebase(&new_impl->option_and_variable_specs);
+    rebaser.rebase(&new_impl->usage_specs);
+    rebaser.rebase(&new_impl->unknown_leader_line);
+    rebaser.rebase(&new_impl->compile_errors);
+    rebaser.rebase(&new_impl->spec_results);
+    rebaser.rebase(&new_impl->usage_errors);
+    rebaser.rebase(&new_impl->usages);
+    rebaser.rebase(&new_impl->shortcut_options);
+    rebaser.rebase(&new_impl->all_options);
+    rebaser.rebase(&new_impl->all_variables);
+    rebaser.rebase(&new_impl->all_static_arguments);
+    rebaser.rebase(&new_impl->variables_to_commands);
+    rebaser.rebase(&new_impl->result_keys);
+    rebaser.rebase(&new_impl->result_key_aliases);
+    rebaser.rebase(&new_impl->option_descriptions);
+    rebaser.rebase(&new_impl->empty_args);
+    if (rebaser.failed) {
+        return false;
+    }
+    new_impl->command_names_narrow = old_impl.command_names_narrow;
+    new_impl->command_names_wide = old_impl.command_names_wide;
+    new_impl->variable_names_narrow = old_impl.variable_names_narrow;
+    new_impl->variable_names_wide = old_impl.variable_names_wide;
+    new_impl->compiled_stage = docopt_impl::stage_usages;
+    new_impl->published_stage = docopt_impl::stage_usages;
+    if (out_errors != NULL) {
+        out_errors->insert(out_errors->end(), new_impl->compile_errors.begin(), new_impl->compile_errors.end());
+    }
+    return true;
+}
+
+#pragma mark -
+#pragma mark Registry
+#pragma mark -
+
+/* One independently locked part of an argument_parser_registry_t */
+template<typename stdstring_t>
+struct registry_shard_t {
+    typedef std::list<stdstring_t> lru_list_t;
+    
+    struct entry_t {
+        stdstring_t doc;
+        std::string compiled_path;
+        
+        /* The parser, if compiled */
+        argument_parser_t<stdstring_t> parser;
+        bool compiled;
+        size_t memory;
+        
+        /* Where we are in the shard's LRU list, if compiled */
+        typename lru_list_t::iterator lru_position;
+        
+        /* Bumped whenever the doc is replaced, so that a compile of the old doc is not installed */
+        unsigned long generation;
+        
+        entry_t() : compiled(false), memory(0), generation(0) {}
+    };
+    
+    pthread_mutex_t lock;
+    std::map<stdstring_t, entry_t> entries;
+    
+    /* Names of compiled entries, most recently used first */
+    lru_list_t lru;
+    
+    registry_shard_t() {
+        pthread_mutex_init(&this->lock, NULL);
+    }
+    
+    ~registry_shard_t() {
+        pthread_mutex_destroy(&this->lock);
+    }
+    
+    /* Forgets the compiled parser of an entry, deducting its memory from the registry's total. The lock must be held. Outstanding copies of the parser stay valid. */
+    void uncompile(entry_t *entry, size_t *total_memory) {
+        if (entry->compiled) {
+            this->lru.erase(entry->lru_position);
+            __atomic_sub_fetch(total_memory, entry->memory, __ATOMIC_RELAXED);
+            entry->parser = argument_parser_t<stdstring_t>();
+            entry->compiled = false;
+            entry->memory = 0;
+        }
+    }
+    
+    /* Evicts least recently used parsers until the registry's total is within budget, keeping at least keep_count of ours. The lock must be held. */
+    void evict(size_t keep_count, size_t *total_memory, size_t memory_budget) {
+        while (__atomic_load_n(total_memory, __ATOMIC_RELAXED) > memory_budget && this->lru.size() > keep_count) {
+            typename std::map<stdstring_t, entry_t>::iterator where = this->entries.find(this->lru.back());
+            assert(where != this->entries.end());
+            this->uncompile(&where->second, total_memory);
+        }
+    }
+};
+
+/* Mutex guard, for the scope of a block */
+class scoped_lock_t {
+    pthread_mutex_t *mutex;
+    
+    public:
+    explicit scoped_lock_t(pthread_mutex_t *m) : mutex(m) {
+        pthread_mutex_lock(this->mutex);
+    }
+    
+    ~scoped_lock_t() {
+        pthread_mutex_unlock(this->mutex);
+    }
+};
+
+static const size_t registry_shard_count = 16;
+
+template<typename stdstring_t>
+static registry_shard_t<stdstring_t> *shard_for_name(registry_shard_t<stdstring_t> *shards, const stdstring_t &name) {
+    uint64_t hash = hash_source(name.data(), name.length() * sizeof(typename stdstring_t::value_type));
+    return &shards[hash % registry_shard_count];
+}
+
+/* Helpers to wrap argv in rstrings, in its various forms. Note the rstrings borrow the caller's storage. */
+template<typename stdstring_t>
+static rstring_list_t rstrings_for_argv(const std::vector<stdstring_t> &argv) {
+    return rstring_list_t(argv.begin(), argv.end());
+}
+
+template<typename stdchar_t>
+static rstring_list_t rstrings_for_argv(const stdchar_t * const *argv, size_t argc) {
+    rstring_list_t result;
+    result.reserve(argc);
+    for (size_t i=0; i < argc; i++) {
+        result.push_back(rstring_t(argv[i], std::char_traits<stdchar_t>::length(argv[i])));
+    }
+    return result;
+}
+
+template<typename stdchar_t>
+static rstring_list_t rstrings_for_argv(const base_string_view_t<stdchar_t> *argv, size_t argc) {
+    rstring_list_t result;
+    result.reserve(argc);
+    for (size_t i=0; i < argc; i++) {
+        result.push_back(rstring_t(argv[i].data(), argv[i].length()));
+    }
+    return result;
+}
+
+/* Returns arg_count statuses, where the unused arguments are invalid and the rest valid */
+static std::vector<argument_status_t> statuses_for_unused_arguments(size_t arg_count, const index_list_t &unused_args) {
+    std::vector<argument_status_t> result(arg_count, status_valid);
+    
+    // Unused arguments are all invalid
+    for (size_t i=0; i < unused_args.size(); i++) {
         size_t unused_arg_idx = unused_args.at(i);
         result.at(unused_arg_idx) = status_invalid;
     }
     return result;
 }
 
+/* The shared guts of the public query functions, which differ only in how argv arrives */
+static std::vector<argument_status_t> validate_rstring_arguments(const docopt_impl *impl, const rstring_list_t &argv, parse_flags_t flags, match_budget_t *budget) {
+    index_list_t unused_args;
+    impl->best_assignment_for_argv(argv, flags, NULL /* errors */, &unused_args, NULL, budget);
+    return statuses_for_unused_arguments(argv.size(), unused_args);
+}
+
+/* Copies rstrings out into a vector of standard strings */
+template<typename stdstring_t>
+static std::vector<stdstring_t> std_strings_for_rstrings(const rstring_list_t &strs) {
+    size_t length = strs.size();
+    std::vector<stdstring_t> result(length);
+    for (size_t i=0; i < length; i++) {
+        strs[i].copy_to(&result[i]);
+    }
+    return result;
+}
+
+template<typename stdstring_t>
+static std::vector<stdstring_t> suggest_next_rstring_argument(const docopt_impl *impl, const rstring_list_t &argv, const rstring_t &prefix, parse_flags_t flags, match_budget_t *budget) {
+    return std_strings_for_rstrings<stdstring_t>(impl->suggest_next_argument(argv, prefix, flags, budget));
+}
+
+template<typename stdstring_t>
+static std::vector<base_suggestion_t<stdstring_t> > describe_next_rstring_argument(const docopt_impl *impl, const rstring_list_t &argv, const rstring_t &prefix, parse_flags_t flags, match_budget_t *budget) {
+    return impl->describe_suggestions<stdstring_t>(impl->suggest_next_argument(argv, prefix, flags, budget));
+}
+
+template<typename stdstring_t>
+static typename argument_parser_t<stdstring_t>::argument_map_t parse_rstring_arguments(const docopt_impl *impl, const rstring_list_t &argv, parse_flags_t flags, error_list_t *out_errors, index_list_t *out_unused_arguments, match_budget_t *budget) {
+    rargument_list_t arguments;
+    impl->best_assignment_for_argv(argv, flags, out_errors, out_unused_arguments, &arguments, budget);
+    return impl->finalize_option_map<stdstring_t>(arguments, flags);
+}
+
+template<typename stdstring_t>
+static void parse_rstring_arguments_view(const docopt_impl *impl, const rstring_list_t &argv, parse_flags_t flags, base_parse_result_t<stdstring_t> *out_result, error_list_t *out_errors, index_list_t *out_unused_arguments) {
+    rargument_list_t arguments;
+    impl->best_assignment_for_argv(argv, flags, out_errors, out_unused_arguments, &arguments);
+    impl->populate_parse_result<stdstring_t>(arguments, flags, out_result);
+}
+
+template<typename stdstring_t>
+static void parse_rstring_arguments_visit(const docopt_impl *impl, const rstring_list_t &argv, parse_flags_t flags, base_argument_visitor_t<stdstring_t> *visitor, error_list_t *out_errors, index_list_t *out_unused_arguments) {
+    rargument_list_t arguments;
+    impl->best_assignment_for_argv(argv, flags, out_errors, out_unused_arguments, &arguments);
+    impl->visit_option_map<stdstring_t>(&arguments, flags, visitor);
+}
+
+template<typename stdstring_t>
+std::vector<argument_status_t> argument_parser_t<stdstring_t>::validate_arguments(const std::vector<stdstring_t> &argv, parse_flags_t flags, match_budget_t *budget) const
+{
+    return validate_rstring_arguments(impl, rstrings_for_argv(argv), flags, budget);
+}
+
+template<typename stdstring_t>
+std::vector<argument_status_t> argument_parser_t<stdstring_t>::validate_arguments(const char_t * const *argv, size_t argc, parse_flags_t flags, match_budget_t *budget) const
+{
+    return validate_rstring_arguments(impl, rstrings_for_argv(argv, argc), flags, budget);
+}
+
+template<typename stdstring_t>
+std::vector<argument_status_t> argument_parser_t<stdstring_t>::validate_arguments(const string_view_t *argv, size_t argc, parse_flags_t flags, match_budget_t *budget) const
+{
+    return validate_rstring_arguments(impl, rstrings_for_argv(argv, argc), flags, budget);
+}
+
+template<typename string_t>
+std::vector<string_t> argument_parser_t<string_t>::suggest_next_argument(const std::vector<string_t> &argv, parse_flags_t flags, match_budget_t *budget) const
+{
+    return suggest_next_rstring_argument<string_t>(impl, rstrings_for_argv(argv), rstring_t(), flags, budget);
+}
+
+template<typename string_t>
+std::vector<string_t> argument_parser_t<string_t>::suggest_next_argument(const std::vector<string_t> &argv, const string_t &partial, parse_flags_t flags, match_budget_t *budget) const
+{
+    return suggest_next_rstring_argument<string_t>(impl, rstrings_for_argv(argv), rstring_t(partial), flags, budget);
+}
+
+template<typename string_t>
+std::vector<typename argument_parser_t<string_t>::suggestion_t> argument_parser_t<string_t>::describe_next_argument(const std::vector<string_t> &argv, const string_t &partial, parse_flags_t flags, match_budget_t *budget) const
+{
+    return describe_next_rstring_argument<string_t>(impl, rstrings_for_argv(argv), rstring_t(partial), flags, budget);
+}
+
+template<typename string_t>
+std::vector<string_t> argument_parser_t<string_t>::suggest_next_argument(const char_t * const *argv, size_t argc, parse_flags_t flags, match_budget_t *budget) const
+{
+    return suggest_next_rstring_argument<string_t>(impl, rstrings_for_argv(argv, argc), rstring_t(), flags, budget);
+}
+
+template<typename string_t>
+std::vector<string_t> argument_parser_t<string_t>::suggest_next_argument(const string_view_t *argv, size_t argc, parse_flags_t flags, match_budget_t *budget) const
+{
+    return suggest_next_rstring_argument<string_t>(impl, rstrings_for_argv(argv, argc), rstring_t(), flags, budget);
+}
+
 template<typename string_t>
-std::vector<string_t> argument_parser_t<string_t>::suggest_next_argument(const std::vector<string_t> &argv, parse_flags_t flags) const
+void argument_parser_t<string_t>::validate_arguments_async(const std::vector<string_t> &argv, parse_flags_t flags, const match_budget_t &budget, async_validation_t *out_query) const
 {
-    const rstring_list_t argv_rstrs(argv.begin(), argv.end());
-    rstring_list_t suggestions = impl->suggest_next_argument(argv_rstrs, flags);
-    
-    size_t length = suggestions.size();
-    std::vector<string_t> result(length);
-    for (size_t i=0; i < length; i++) {
-        suggestions[i].copy_to(&result[i]);
-    }
-    return result;
+    out_query->start(*this, argv, flags, budget);
+}
+
+template<typename string_t>
+void argument_parser_t<string_t>::suggest_next_argument_async(const std::vector<string_t> &argv, parse_flags_t flags, const match_budget_t &budget, async_suggestion_t *out_query) const
+{
+    out_query->start(*this, argv, flags, budget);
 }
 
 template<typename stdstring_t>
@@ -1915,29 +4486,220 @@ stdstring_t argument_parser_t<stdstring_t>::description_for_option(const stdstri
 }
 
 template<typename stdstring_t>
-std::vector<stdstring_t> argument_parser_t<stdstring_t>::get_command_names() const
+const std::vector<stdstring_t> &argument_parser_t<stdstring_t>::get_command_names() const
 {
     return impl->get_command_names<stdstring_t>();
 }
 
 template<typename stdstring_t>
-std::vector<stdstring_t> argument_parser_t<stdstring_t>::get_variables() const
+const std::vector<stdstring_t> &argument_parser_t<stdstring_t>::get_variables() const
 {
     return impl->get_variables<stdstring_t>();
 }
 
+template<typename stdstring_t>
+complexity_report_t argument_parser_t<stdstring_t>::analyze_complexity(size_t argv_length) const
+{
+    if (! this->impl) {
+        complexity_report_t empty;
+        empty.argv_length = argv_length;
+        return empty;
+    }
+    return impl->analyze_complexity(argv_length);
+}
+
 template<typename stdstring_t>
 typename argument_parser_t<stdstring_t>::argument_map_t
 argument_parser_t<stdstring_t>::parse_arguments(const std::vector<stdstring_t> &argv,
                                                 parse_flags_t flags,
                                                 error_list_t *out_errors,
-                                                std::vector<size_t> *out_unused_arguments) const {
-    const rstring_list_t argv_rstrs(argv.begin(), argv.end());
-    option_rmap_t option_rmap;
-    impl->best_assignment_for_argv(argv_rstrs, flags, out_errors, out_unused_arguments, &option_rmap);
-    return impl->finalize_option_map<stdstring_t>(option_rmap, flags);
+                                                std::vector<size_t> *out_unused_arguments,
+                                                match_budget_t *budget) const {
+    return parse_rstring_arguments<stdstring_t>(impl, rstrings_for_argv(argv), flags, out_errors, out_unused_arguments, budget);
+}
+
+template<typename stdstring_t>
+typename argument_parser_t<stdstring_t>::argument_map_t
+argument_parser_t<stdstring_t>::parse_arguments(const char_t * const *argv, size_t argc,
+                                                parse_flags_t flags,
+                                                error_list_t *out_errors,
+                                                std::vector<size_t> *out_unused_arguments,
+                                                match_budget_t *budget) const {
+    return parse_rstring_arguments<stdstring_t>(impl, rstrings_for_argv(argv, argc), flags, out_errors, out_unused_arguments, budget);
+}
+
+template<typename stdstring_t>
+typename argument_parser_t<stdstring_t>::argument_map_t
+argument_parser_t<stdstring_t>::parse_arguments(const string_view_t *argv, size_t argc,
+                                                parse_flags_t flags,
+                                                error_list_t *out_errors,
+                                                std::vector<size_t> *out_unused_arguments,
+                                                match_budget_t *budget) const {
+    return parse_rstring_arguments<stdstring_t>(impl, rstrings_for_argv(argv, argc), flags, out_errors, out_unused_arguments, budget);
+}
+
+template<typename stdstring_t>
+void argument_parser_t<stdstring_t>::parse_arguments_into(const std::vector<stdstring_t> &argv,
+                                                          parse_flags_t flags,
+                                                          argument_map_t *inout_arguments,
+                                                          error_list_t *out_errors,
+                                                          std::vector<size_t> *out_unused_arguments,
+                                                          match_budget_t *budget) const {
+    rargument_list_t arguments;
+    impl->best_assignment_for_argv(rstrings_for_argv(argv), flags, out_errors, out_unused_arguments, &arguments, budget);
+    impl->fill_argument_map<stdstring_t>(arguments, flags, inout_arguments);
+}
+
+
+template<typename stdstring_t>
+void argument_parser_t<stdstring_t>::parse_arguments_view(const std::vector<stdstring_t> &argv,
+                                                     parse_flags_t flags,
+                                                     parse_result_t *out_result,
+                                                     error_list_t *out_errors,
+                                                     std::vector<size_t> *out_unused_arguments) const {
+    parse_rstring_arguments_view<stdstring_t>(impl, rstrings_for_argv(argv), flags, out_result, out_errors, out_unused_arguments);
+}
+
+template<typename stdstring_t>
+void argument_parser_t<stdstring_t>::parse_arguments_view(const char_t * const *argv, size_t argc,
+                                                     parse_flags_t flags,
+                                                     parse_result_t *out_result,
+                                                     error_list_t *out_errors,
+                                                     std::vector<size_t> *out_unused_arguments) const {
+    parse_rstring_arguments_view<stdstring_t>(impl, rstrings_for_argv(argv, argc), flags, out_result, out_errors, out_unused_arguments);
+}
+
+template<typename stdstring_t>
+void argument_parser_t<stdstring_t>::parse_arguments_view(const string_view_t *argv, size_t argc,
+                                                     parse_flags_t flags,
+                                                     parse_result_t *out_result,
+                                                     error_list_t *out_errors,
+                                                     std::vector<size_t> *out_unused_arguments) const {
+    parse_rstring_arguments_view<stdstring_t>(impl, rstrings_for_argv(argv, argc), flags, out_result, out_errors, out_unused_arguments);
+}
+
+template<typename stdstring_t>
+void argument_parser_t<stdstring_t>::parse_arguments_visit(const std::vector<stdstring_t> &argv,
+                                                      parse_flags_t flags,
+                                                      argument_visitor_t *visitor,
+                                                      error_list_t *out_errors,
+                                                      std::vector<size_t> *out_unused_arguments) const {
+    parse_rstring_arguments_visit<stdstring_t>(impl, rstrings_for_argv(argv), flags, visitor, out_errors, out_unused_arguments);
+}
+
+template<typename stdstring_t>
+void argument_parser_t<stdstring_t>::parse_arguments_visit(const char_t * const *argv, size_t argc,
+                                                      parse_flags_t flags,
+                                                      argument_visitor_t *visitor,
+                                                      error_list_t *out_errors,
+                                                      std::vector<size_t> *out_unused_arguments) const {
+    parse_rstring_arguments_visit<stdstring_t>(impl, rstrings_for_argv(argv, argc), flags, visitor, out_errors, out_unused_arguments);
+}
+
+template<typename stdstring_t>
+void argument_parser_t<stdstring_t>::parse_arguments_visit(const string_view_t *argv, size_t argc,
+                                                      parse_flags_t flags,
+                                                      argument_visitor_t *visitor,
+                                                      error_list_t *out_errors,
+                                                      std::vector<size_t> *out_unused_arguments) const {
+    parse_rstring_arguments_visit<stdstring_t>(impl, rstrings_for_argv(argv, argc), flags, visitor, out_errors, out_unused_arguments);
+}
+
+template<typename stdstring_t>
+std::vector<typename argument_parser_t<stdstring_t>::argument_map_t>
+argument_parser_t<stdstring_t>::parse_batch(const std::vector<std::vector<stdstring_t> > &argvs,
+                                            parse_flags_t flags,
+                                            std::vector<error_list_t> *out_errors,
+                                            std::vector<std::vector<size_t> > *out_unused_arguments,
+                                            size_t thread_count) const {
+    std::vector<argument_map_t> results(argvs.size());
+    if (out_errors) {
+        out_errors->assign(argvs.size(), error_list_t());
+    }
+    if (out_unused_arguments) {
+        out_unused_arguments->assign(argvs.size(), index_list_t());
+    }
+    if (! argvs.empty()) {
+        size_t worker_count = effective_worker_count(thread_count, argvs.size(), parse_batch_min_items_per_worker);
+        parse_batch_task_t<stdstring_t> task(impl, argvs, flags, worker_count, &results, out_errors, out_unused_arguments);
+        run_parallel(&task, argvs.size(), worker_count);
+    }
+    return results;
+}
+
+template<typename stdstring_t>
+std::vector<argument_parser_t<stdstring_t> >
+argument_parser_t<stdstring_t>::compile_all(const std::vector<stdstring_t> &docs,
+                                            std::vector<error_list_t> *out_errors,
+                                            size_t thread_count) {
+    std::vector<argument_parser_t> parsers(docs.size());
+    if (out_errors) {
+        out_errors->assign(docs.size(), error_list_t());
+    }
+    if (! docs.empty()) {
+        size_t worker_count = effective_worker_count(thread_count, docs.size(), compile_all_min_items_per_worker);
+        compile_all_task_t<stdstring_t> task(docs, &parsers, out_errors);
+        run_parallel(&task, docs.size(), worker_count);
+    }
+    return parsers;
+}
+
+template<typename stdstring_t>
+key_handle_t argument_parser_t<stdstring_t>::key_handle(const string_view_t &name) const {
+    impl->ensure_compiled(docopt_impl::stage_usages);
+    return key_handle_t(impl->index_of_result_key_or_alias(rstring_t(name.data(), name.length())));
 }
 
+/* Parse results */
+template<typename string_t>
+typename base_parse_result_t<string_t>::argument_view_t base_parse_result_t<string_t>::view_for_slot(const slot_t &slot) const {
+    argument_view_t result;
+    result.count = slot.count;
+    result.value_count = slot.value_count;
+    result.values = slot.value_count ? &this->values.at(slot.values_start) : NULL;
+    return result;
+}
+
+template<typename string_t>
+bool base_parse_result_t<string_t>::lookup(const string_view_t &name, argument_view_t *out_arg) const {
+    if (this->impl == NULL) {
+        return false;
+    }
+    size_t idx = this->impl->index_of_result_key(rstring_t(name.data(), name.length()));
+    if (idx == npos || ! this->slots.at(idx).present) {
+        return false;
+    }
+    if (out_arg != NULL) {
+        *out_arg = this->view_for_slot(this->slots.at(idx));
+    }
+    return true;
+}
+
+template<typename string_t>
+typename base_parse_result_t<string_t>::argument_view_t base_parse_result_t<string_t>::operator[](const string_view_t &name) const {
+    argument_view_t result;
+    this->lookup(name, &result);
+    return result;
+}
+
+template<typename string_t>
+typename base_parse_result_t<string_t>::string_view_t base_parse_result_t<string_t>::slot_name(size_t idx) const {
+    assert(this->impl != NULL && idx < this->slots.size());
+    const rstring_t &key = this->impl->result_keys.at(idx);
+    return string_view_t(key.chars<typename string_t::value_type>(), key.length());
+}
+
+template<typename string_t>
+typename base_parse_result_t<string_t>::argument_map_t base_parse_result_t<string_t>::to_map() const {
+    argument_map_t result;
+    // Slots are sorted, so we can always insert at the end
+    for (size_t i=0; i < this->slots.size(); i++) {
+        if (this->slots.at(i).present) {
+            result.insert(result.end(), typename argument_map_t::value_type(this->slot_name(i).str(), this->slot_argument(i).to_argument()));
+        }
+    }
+    return result;
+}
 
 template<typename stdstring_t>
 bool argument_parser_t<stdstring_t>::set_doc(const stdstring_t &doc, error_list_t *out_errors) {
@@ -1946,14 +4708,58 @@ bool argument_parser_t<stdstring_t>::set_doc(const stdstring_t &doc, error_list_
     bool preflighted = new_impl->preflight(out_errors);
     
     if (! preflighted) {
-        delete new_impl;
+        new_impl->release();
     } else {
-        delete this->impl; // may be null
+        if (this->impl) {
+            this->impl->release();
+        }
         this->impl = new_impl;
     }
     return preflighted;
 }
 
+template<typename stdstring_t>
+bool argument_parser_t<stdstring_t>::apply_edit(size_t offset, size_t removed_length, const stdstring_t &inserted, error_list_t *out_errors) {
+    if (this->impl == NULL || offset > this->impl->rsource.length() || removed_length > this->impl->rsource.length() - offset) {
+        return false;
+    }
+    stdstring_t doc = this->impl->rsource.std_string<stdstring_t>();
+    doc.replace(offset, removed_length, inserted);
+    
+    docopt_impl *new_impl = new docopt_impl(doc);
+    const source_edit_t edit = {offset, removed_length, inserted.length()};
+    if (! rebase_edited_impl(new_impl, *this->impl, edit, out_errors)) {
+        new_impl->release();
+        new_impl = new docopt_impl(doc);
+        compile_edited_impl(new_impl, *this->impl, edit, out_errors);
+    }
+    this->impl->release();
+    this->impl = new_impl;
+    return true;
+}
+
+template<typename stdstring_t>
+bool argument_parser_t<stdstring_t>::save_compiled(const char *path) const {
+    return this->impl != NULL && save_compiled_impl<char_t>(this->impl, path);
+}
+
+template<typename stdstring_t>
+bool argument_parser_t<stdstring_t>::load_compiled(const char *path, const stdstring_t *expected_doc) {
+    docopt_impl *new_impl = load_compiled_impl(path, expected_doc);
+    if (new_impl != NULL) {
+        if (this->impl) {
+            this->impl->release();
+        }
+        this->impl = new_impl;
+    }
+    return new_impl != NULL;
+}
+
+template<typename stdstring_t>
+size_t argument_parser_t<stdstring_t>::memory_estimate() const {
+    return this->impl ? this->impl->memory_estimate() : 0;
+}
+
 /* Constructors */
 template<typename string_t>
 argument_parser_t<string_t>::argument_parser_t() : impl(NULL) {}
@@ -1964,24 +4770,23 @@ argument_parser_t<string_t>::argument_parser_t(const string_t &doc, error_list_t
 }
 
 template<typename string_t>
-argument_parser_t<string_t>::argument_parser_t(const argument_parser_t &rhs) {
-    if (rhs.impl == NULL) {
-        this->impl = NULL;
-    } else {
-        this->impl = new docopt_impl(*rhs.impl);
+argument_parser_t<string_t>::argument_parser_t(const argument_parser_t &rhs) : impl(rhs.impl) {
+    // The impl is immutable, so copies just share it
+    if (this->impl) {
+        this->impl->retain();
     }
 }
 
 template<typename string_t>
 argument_parser_t<string_t> &argument_parser_t<string_t>::operator=(const argument_parser_t &rhs) {
-    if (this != &rhs) {
-        delete this->impl;
-        if (rhs.impl == NULL) {
-            this->impl = NULL;
-        } else {
-            this->impl = new docopt_impl(*rhs.impl);
-        }
+    // Retain before releasing, in case both share an impl
+    if (rhs.impl) {
+        rhs.impl->retain();
     }
+    if (this->impl) {
+        this->impl->release();
+    }
+    this->impl = rhs.impl;
     return *this;
 }
 
@@ -1989,7 +4794,370 @@ argument_parser_t<string_t> &argument_parser_t<string_t>::operator=(const argume
 /* Destructor */
 template<typename string_t>
 argument_parser_t<string_t>::~argument_parser_t<string_t>() {
-    delete impl; // may be null
+    if (this->impl) {
+        this->impl->release();
+    }
+}
+
+template<typename string_t>
+argument_parser_registry_t<string_t>::argument_parser_registry_t(size_t budget) : shards(new registry_shard_t<string_t>[registry_shard_count]), memory_budget(budget), memory_used(0) {
+}
+
+template<typename string_t>
+argument_parser_registry_t<string_t>::~argument_parser_registry_t() {
+    delete[] this->shards;
+}
+
+template<typename string_t>
+void argument_parser_registry_t<string_t>::add(const string_t &name, const string_t &doc, const char *compiled_path) {
+    registry_shard_t<string_t> *shard = shard_for_name(this->shards, name);
+    scoped_lock_t locker(&shard->lock);
+    typename registry_shard_t<string_t>::entry_t *entry = &shard->entries[name];
+    shard->uncompile(entry, &this->memory_used);
+    entry->doc = doc;
+    entry->compiled_path = compiled_path ? compiled_path : "";
+    entry->generation++;
+}
+
+template<typename string_t>
+bool argument_parser_registry_t<string_t>::remove(const string_t &name) {
+    registry_shard_t<string_t> *shard = shard_for_name(this->shards, name);
+    scoped_lock_t locker(&shard->lock);
+    typename std::map<string_t, typename registry_shard_t<string_t>::entry_t>::iterator where = shard->entries.find(name);
+    if (where == shard->entries.end()) {
+        return false;
+    }
+    shard->uncompile(&where->second, &this->memory_used);
+    shard->entries.erase(where);
+    return true;
+}
+
+template<typename string_t>
+bool argument_parser_registry_t<string_t>::get(const string_t &name, parser_t *out_parser, std::vector<error_t> *out_errors) {
+    typedef typename registry_shard_t<string_t>::entry_t entry_t;
+    registry_shard_t<string_t> *shard = shard_for_name(this->shards, name);
+    
+    // Look for the entry. If it is compiled, we are done.
+    string_t doc;
+    std::string compiled_path;
+    unsigned long generation;
+    {
+        scoped_lock_t locker(&shard->lock);
+        typename std::map<string_t, entry_t>::iterator where = shard->entries.find(name);
+        if (where == shard->entries.end()) {
+            return false;
+        }
+        entry_t *entry = &where->second;
+        if (entry->compiled) {
+            shard->lru.splice(shard->lru.begin(), shard->lru, entry->lru_position);
+            *out_parser = entry->parser;
+            return true;
+        }
+        doc = entry->doc;
+        compiled_path = entry->compiled_path;
+        generation = entry->generation;
+    }
+    
+    // Compile without holding the lock, so other names in this shard are not held up. Always pass errors, so that the whole doc is compiled now and memory_estimate() is accurate.
+    parser_t parser;
+    if (compiled_path.empty() || ! parser.load_compiled(compiled_path.c_str(), &doc)) {
+        std::vector<error_t> errors;
+        parser.set_doc(doc, &errors);
+        if (out_errors) {
+            out_errors->insert(out_errors->end(), errors.begin(), errors.end());
+        }
+    }
+    
+    // Install it, unless another thread beat us to it, or the doc changed meanwhile
+    scoped_lock_t locker(&shard->lock);
+    typename std::map<string_t, entry_t>::iterator where = shard->entries.find(name);
+    if (where != shard->entries.end() && where->second.generation == generation) {
+        entry_t *entry = &where->second;
+        if (entry->compiled) {
+            shard->lru.splice(shard->lru.begin(), shard->lru, entry->lru_position);
+            parser = entry->parser;
+        } else {
+            entry->parser = parser;
+            entry->compiled = true;
+            entry->memory = parser.memory_estimate();
+            entry->lru_position = shard->lru.insert(shard->lru.begin(), name);
+            __atomic_add_fetch(&this->memory_used, entry->memory, __ATOMIC_RELAXED);
+            this->evict_over_budget(shard, entry->memory);
+        }
+    }
+    *out_parser = parser;
+    return true;
+}
+
+template<typename string_t>
+size_t argument_parser_registry_t<string_t>::compiled_count() const {
+    size_t result = 0;
+    for (size_t i=0; i < registry_shard_count; i++) {
+        scoped_lock_t locker(&this->shards[i].lock);
+        result += this->shards[i].lru.size();
+    }
+    return result;
+}
+
+template<typename string_t>
+size_t argument_parser_registry_t<string_t>::compiled_memory() const {
+    return __atomic_load_n(&this->memory_used, __ATOMIC_RELAXED);
+}
+
+template<typename string_t>
+void argument_parser_registry_t<string_t>::evict_over_budget(registry_shard_t<string_t> *shard, size_t newest_memory) {
+    // Our own older parsers go first
+    shard->evict(1, &this->memory_used, this->memory_budget);
+    
+    // Then other shards' parsers. We already hold our lock, so only try theirs: blocking could deadlock against a thread doing the same from the other shard. A busy shard is skipped, leaving us over budget until a later install.
+    for (size_t i=0; i < registry_shard_count && __atomic_load_n(&this->memory_used, __ATOMIC_RELAXED) > this->memory_budget; i++) {
+        registry_shard_t<string_t> *other = &this->shards[i];
+        if (other != shard && 0 == pthread_mutex_trylock(&other->lock)) {
+            other->evict(0, &this->memory_used, this->memory_budget);
+            pthread_mutex_unlock(&other->lock);
+        }
+    }
+    
+    // A parser larger than the whole budget is not kept
+    if (newest_memory > this->memory_budget) {
+        shard->evict(0, &this->memory_used, this->memory_budget);
+    }
+}
+
+#pragma mark -
+#pragma mark Argv Sessions
+#pragma mark -
+
+/* Where separating a session's argv stood just before separating the argument at idx */
+struct argv_checkpoint_t {
+    size_t idx;
+    bool saw_double_dash;
+    size_t positional_count;
+    size_t resolved_option_count;
+    
+    argv_checkpoint_t(size_t i, bool dd, size_t pc, size_t rc) : idx(i), saw_double_dash(dd), positional_count(pc), resolved_option_count(rc) {}
+};
+
+/* The guts of a base_argv_session_t */
+template<typename string_t>
+struct argv_session_state_t {
+    /* Our copy of the parser keeps impl alive. impl is NULL if the parser has no doc. */
+    const argument_parser_t<string_t> parser;
+    const docopt_impl *const impl;
+    const parse_flags_t flags;
+    
+    /* The arguments, and rstrings borrowing them. A deque does not move its elements as it grows or shrinks at the end. */
+    std::deque<string_t> args;
+    rstring_list_t argv;
+    
+    /* The separated argv. The checkpoints are taken before separating each argument, and end is where separating stopped. The suggestion is the value wanted by an option at the end of argv, if any. */
+    positional_argument_list_t positionals;
+    resolved_option_list_t resolved_options;
+    rstring_t suggestion;
+    std::vector<argv_checkpoint_t> checkpoints;
+    argv_checkpoint_t end;
+    
+    /* Cached results for argv */
+    std::vector<argument_status_t> statuses;
+    std::vector<string_t> suggestions;
+    bool has_statuses;
+    bool has_suggestions;
+    
+    /* What each usage matched when validating and when suggesting. Those that depend on nothing argv changed stay valid, and are not matched again. */
+    usage_match_list_t validate_matches;
+    usage_match_list_t suggest_matches;
+    
+    argv_session_state_t(const argument_parser_t<string_t> &p, const docopt_impl *i, parse_flags_t f) : parser(p), impl(i), flags(f), end(0, false, 0, 0), has_statuses(false), has_suggestions(false) {
+        if (this->impl != NULL) {
+            this->impl->ensure_compiled(docopt_impl::stage_usages);
+            this->validate_matches.resize(this->impl->usages.size());
+            this->suggest_matches.resize(this->impl->usages.size());
+        }
+    }
+    
+    /* Invalidates the usage matches that looked at more than the first unchanged_positionals positionals */
+    static void invalidate_usage_matches(usage_match_list_t *usage_matches, size_t unchanged_positionals) {
+        for (size_t i=0; i < usage_matches->size(); i++) {
+            usage_match_t *usage_match = &usage_matches->at(i);
+            if (usage_match->positionals_examined > unchanged_positionals) {
+                usage_match->valid = false;
+                usage_match->states.clear();
+            }
+        }
+    }
+    
+    /* Brings the separated argv up to date after argv changed, leaving its first unchanged_count arguments as they were */
+    void resync(size_t unchanged_count) {
+        this->has_statuses = false;
+        this->has_suggestions = false;
+        if (this->impl == NULL) {
+            return;
+        }
+        
+        const positional_argument_list_t old_positionals = this->positionals;
+        const resolved_option_list_t old_resolved_options = this->resolved_options;
+        
+        /* Separating an argument looks at no more than the two arguments after it, so a checkpoint is still good if those are unchanged. Return to the first one that is not. */
+        size_t keep = 0;
+        while (keep < this->checkpoints.size() && this->checkpoints.at(keep).idx + 2 < unchanged_count) {
+            keep++;
+        }
+        if (keep < this->checkpoints.size()) {
+            this->end = this->checkpoints.at(keep);
+            this->checkpoints.erase(this->checkpoints.begin() + keep, this->checkpoints.end());
+            this->positionals.erase(this->positionals.begin() + this->end.positional_count, this->positionals.end());
+            this->resolved_options.erase(this->resolved_options.begin() + this->end.resolved_option_count, this->resolved_options.end());
+            this->suggestion = rstring_t();
+        }
+        
+        /* Always generate the suggestion, so that the separated argv serves both queries. It does not change what is separated. */
+        argv_separation_state_t st(this->argv, this->impl->all_options, this->flags | flag_generate_suggestions);
+        st.idx = this->end.idx;
+        st.saw_double_dash = this->end.saw_double_dash;
+        while (st.idx < this->argv.size()) {
+            this->checkpoints.push_back(argv_checkpoint_t(st.idx, st.saw_double_dash, this->positionals.size(), this->resolved_options.size()));
+            separate_one_argument(&st, &this->positionals, &this->resolved_options, NULL /* errors */, &this->suggestion);
+        }
+        this->end = argv_checkpoint_t(st.idx, st.saw_double_dash, this->positionals.size(), this->resolved_options.size());
+        
+        /* Matching looks at every resolved option, so if any changed, no usage match is any use. Otherwise the matches that only looked at unchanged positionals are still good. */
+        size_t unchanged_positionals = 0;
+        if (resolved_options_unchanged(old_resolved_options, this->resolved_options, unchanged_count)) {
+            size_t limit = std::min(old_positionals.size(), this->positionals.size());
+            while (unchanged_positionals < limit &&
+                   this->positionals.at(unchanged_positionals).idx_in_argv < unchanged_count &&
+                   old_positionals.at(unchanged_positionals).idx_in_argv == this->positionals.at(unchanged_positionals).idx_in_argv) {
+                unchanged_positionals++;
+            }
+        }
+        invalidate_usage_matches(&this->validate_matches, unchanged_positionals);
+        invalidate_usage_matches(&this->suggest_matches, unchanged_positionals);
+    }
+    
+    /* Returns true if the resolved options are the same, and come from arguments before unchanged_count */
+    static bool resolved_options_unchanged(const resolved_option_list_t &lhs, const resolved_option_list_t &rhs, size_t unchanged_count) {
+        if (lhs.size() != rhs.size()) {
+            return false;
+        }
+        for (size_t i=0; i < lhs.size(); i++) {
+            const resolved_option_t &left = lhs.at(i), &right = rhs.at(i);
+            if (left.name_idx_in_argv != right.name_idx_in_argv || left.name_idx_in_argv >= unchanged_count) {
+                return false;
+            }
+            if (left.value_idx_in_argv != right.value_idx_in_argv || (left.value_idx_in_argv != npos && left.value_idx_in_argv >= unchanged_count)) {
+                return false;
+            }
+            if (! left.option.has_same_name(right.option) || left.value_in_arg.start() != right.value_in_arg.start() || left.value_in_arg.length() != right.value_in_arg.length()) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+template<typename string_t>
+base_argv_session_t<string_t>::base_argv_session_t(const argument_parser_t<string_t> &parser, parse_flags_t flags) : state(new argv_session_state_t<string_t>(parser, parser.impl, flags)) {}
+
+template<typename string_t>
+base_argv_session_t<string_t>::~base_argv_session_t() {
+    delete this->state;
+}
+
+template<typename string_t>
+void base_argv_session_t<string_t>::push(const string_t &arg) {
+    size_t unchanged_count = this->state->args.size();
+    this->state->args.push_back(arg);
+    this->state->argv.push_back(rstring_t(this->state->args.back()));
+    this->state->resync(unchanged_count);
+}
+
+template<typename string_t>
+void base_argv_session_t<string_t>::pop() {
+    if (! this->state->args.empty()) {
+        this->state->args.pop_back();
+        this->state->argv.pop_back();
+        this->state->resync(this->state->args.size());
+    }
+}
+
+template<typename string_t>
+void base_argv_session_t<string_t>::clear() {
+    this->state->args.clear();
+    this->state->argv.clear();
+    this->state->resync(0);
+}
+
+template<typename string_t>
+void base_argv_session_t<string_t>::assign(const std::vector<string_t> &argv, size_t first_changed) {
+    argv_session_state_t<string_t> *st = this->state;
+    size_t unchanged_count = std::min(first_changed, std::min(argv.size(), st->args.size()));
+    if (unchanged_count == argv.size() && unchanged_count == st->args.size()) {
+        // Nothing changed; keep the cached results
+        return;
+    }
+    
+    // Drop the changed arguments from the end, so that the unchanged ones keep their storage
+    while (st->args.size() > unchanged_count) {
+        st->args.pop_back();
+        st->argv.pop_back();
+    }
+    for (size_t i=unchanged_count; i < argv.size(); i++) {
+        st->args.push_back(argv.at(i));
+        st->argv.push_back(rstring_t(st->args.back()));
+    }
+    st->resync(unchanged_count);
+}
+
+template<typename string_t>
+size_t base_argv_session_t<string_t>::size() const {
+    return this->state->args.size();
+}
+
+template<typename string_t>
+const string_t &base_argv_session_t<string_t>::at(size_t idx) const {
+    return this->state->args.at(idx);
+}
+
+template<typename string_t>
+const std::vector<argument_status_t> &base_argv_session_t<string_t>::validate(match_budget_t *budget) {
+    argv_session_state_t<string_t> *st = this->state;
+    if (! st->has_statuses) {
+        if (st->impl == NULL) {
+            // Without a doc, nothing is valid
+            st->statuses.assign(st->argv.size(), status_invalid);
+        } else {
+            index_list_t unused_args;
+            st->impl->match_argv(st->argv, st->flags, st->positionals, st->resolved_options, NULL, &unused_args, budget, &st->validate_matches);
+            st->statuses = statuses_for_unused_arguments(st->argv.size(), unused_args);
+        }
+        st->has_statuses = (budget == NULL || ! budget->truncated);
+    }
+    return st->statuses;
+}
+
+template<typename string_t>
+const std::vector<string_t> &base_argv_session_t<string_t>::suggest(match_budget_t *budget) {
+    argv_session_state_t<string_t> *st = this->state;
+    if (! st->has_suggestions) {
+        rstring_list_t suggestions;
+        if (st->impl != NULL) {
+            suggestions = st->impl->suggest_next_argument_separated(st->argv, rstring_t(), st->flags, st->positionals, st->resolved_options, st->suggestion, budget, &st->suggest_matches);
+        }
+        st->suggestions = std_strings_for_rstrings<string_t>(suggestions);
+        st->has_suggestions = (budget == NULL || ! budget->truncated);
+    }
+    return st->suggestions;
+}
+
+template<typename string_t>
+std::vector<argument_status_t> argument_parser_t<string_t>::validate_arguments(const std::vector<string_t> &argv, argv_session_t *previous, size_t first_changed, match_budget_t *budget) const
+{
+    // What the session separated and matched is only any use against the doc it was made with
+    if (previous == NULL || previous->state->impl != this->impl) {
+        return std::vector<argument_status_t>(argv.size(), status_invalid);
+    }
+    previous->assign(argv, first_changed);
+    return previous->validate(budget);
 }
 
 // close the namespace
@@ -1998,5 +5166,15 @@ CLOSE_DOCOPT_IMPL
 // Force template instantiation
 template class docopt_fish::argument_parser_t<std::string>;
 template class docopt_fish::argument_parser_t<std::wstring>;
+template class docopt_fish::base_parse_result_t<std::string>;
+template class docopt_fish::base_parse_result_t<std::wstring>;
+template class docopt_fish::argument_parser_registry_t<std::string>;
+template class docopt_fish::argument_parser_registry_t<std::wstring>;
+template class docopt_fish::base_async_query_t<std::string, std::vector<docopt_fish::argument_status_t> >;
+template class docopt_fish::base_async_query_t<std::wstring, std::vector<docopt_fish::argument_status_t> >;
+template class docopt_fish::base_async_query_t<std::string, std::vector<std::string> >;
+template class docopt_fish::base_async_query_t<std::wstring, std::vector<std::wstring> >;
+template class docopt_fish::base_argv_session_t<std::string>;
+template class docopt_fish::base_argv_session_t<std::wstring>;
 
 
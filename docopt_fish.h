@@ -4,6 +4,7 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <assert.h>
 
 namespace docopt_fish
 {
@@ -32,6 +33,13 @@ namespace docopt_fish
         status_valid_prefix // the argument is a prefix of something that may work
     };
     
+    /* The kind of a suggested next argument */
+    enum suggestion_kind_t {
+        suggestion_option, // an option name, like --verbose
+        suggestion_fixed, // a fixed word, like checkout
+        suggestion_variable // a variable, like <file>, standing for a value
+    };
+    
     /* Represents an error. */
     struct error_t {
         /* Location of the token where the error occurred, in either the docopt doc or the argument */
@@ -50,6 +58,31 @@ namespace docopt_fish
         {}
     };
     
+    /* A borrowed string: a pointer and a length. It does not own its storage, which must outlive it, and need not be nul-terminated. This lets callers pass argv (or their own token buffers) without first copying each argument into a string_t. */
+    template<typename char_t>
+    class base_string_view_t {
+        const char_t *chars_;
+        size_t length_;
+        
+        public:
+        
+        const char_t *data() const { return chars_; }
+        size_t length() const { return length_; }
+        bool empty() const { return length_ == 0; }
+        
+        /* Returns an owning copy */
+        std::basic_string<char_t> str() const {
+            return std::basic_string<char_t>(chars_, length_);
+        }
+        
+        base_string_view_t() : chars_(NULL), length_(0) {}
+        base_string_view_t(const char_t *s, size_t len) : chars_(s), length_(len) {}
+        
+        /* Implicit conversions from nul-terminated and std strings. These borrow the storage. */
+        base_string_view_t(const char_t *s) : chars_(s), length_(std::char_traits<char_t>::length(s)) {}
+        base_string_view_t(const std::basic_string<char_t> &s) : chars_(s.data()), length_(s.length()) {}
+    };
+    
     /* A processed docopt file is called an argument parser. */
     class docopt_impl;
     
@@ -71,25 +104,282 @@ namespace docopt_fish
         base_argument_t() : count(0) {}
     };
     
+    /* A suggested next argument, with what is known about it */
+    template<typename string_t>
+    struct base_suggestion_t {
+        /* The suggestion itself, like --verbose, checkout or <file> */
+        string_t text;
+        
+        suggestion_kind_t kind;
+        
+        /* For options, the description from the Options section, if any */
+        string_t description;
+        
+        /* For variables, the command that produces their values (see commands_for_variable), if any */
+        string_t command;
+        
+        base_suggestion_t() : kind(suggestion_fixed) {}
+    };
+    
+    /* Represents an argument in a parse result. Unlike base_argument_t, this borrows its values, which point into argv (or into the doc, for default values). */
+    template<typename string_t>
+    struct base_argument_view_t {
+        typedef base_string_view_t<typename string_t::value_type> string_view_t;
+        
+        /* The values specified in the argument, as with base_argument_t */
+        const string_view_t *values;
+        size_t value_count;
+        
+        /* How many times the argument appeared, as with base_argument_t */
+        unsigned int count;
+        
+        /* Helper function to return a single value */
+        const string_view_t &value() const {
+            assert(value_count > 0);
+            return values[0];
+        }
+        
+        /* Returns an owning copy */
+        base_argument_t<string_t> to_argument() const {
+            base_argument_t<string_t> result;
+            result.count = count;
+            result.values.reserve(value_count);
+            for (size_t i=0; i < value_count; i++) {
+                result.values.push_back(values[i].str());
+            }
+            return result;
+        }
+        
+        base_argument_view_t() : values(NULL), value_count(0), count(0) {}
+    };
+    
+    template<typename string_t> class argument_parser_t;
+    template<typename string_t> class base_parse_result_t;
+    template<typename string_t, typename result_t> class base_async_query_t;
+    template<typename string_t> class base_argv_session_t;
+    
+    /* An opaque handle for a name in a parse result, like "--verbose" or "<file>". Handles are resolved once via argument_parser_t::key_handle(), and then index parse results from that parser in constant time. A handle is only meaningful for the parser that produced it, until its doc is next set. */
+    class key_handle_t {
+        template<typename string_t> friend class argument_parser_t;
+        template<typename string_t> friend class base_parse_result_t;
+        
+        size_t idx;
+        explicit key_handle_t(size_t i) : idx(i) {}
+        
+        public:
+        
+        /* The default handle is invalid, and is also what key_handle() returns for an unknown name */
+        key_handle_t() : idx(-1) {}
+        bool valid() const { return idx != size_t(-1); }
+    };
+    
+    /* The result of parsing argv, as a view. Keys are borrowed from the parser that produced the result, and values from the argv that was parsed, so both must outlive it. Lookups do not allocate; copies are made only by to_argument() and to_map(). */
+    template<typename string_t>
+    class base_parse_result_t {
+        friend class docopt_impl;
+        
+        public:
+        typedef base_string_view_t<typename string_t::value_type> string_view_t;
+        typedef base_argument_view_t<string_t> argument_view_t;
+        typedef std::map<string_t, base_argument_t<string_t> > argument_map_t;
+        
+        private:
+        /* One slot per name that may appear in a result, in the order of the parser's sorted key list */
+        struct slot_t {
+            size_t values_start;
+            size_t value_count;
+            unsigned int count;
+            bool present;
+            slot_t() : values_start(0), value_count(0), count(0), present(false) {}
+        };
+        
+        /* The parser's guts, which own the keys */
+        const docopt_impl *impl;
+        std::vector<slot_t> slots;
+        
+        /* Storage for all values, referenced by slots */
+        std::vector<string_view_t> values;
+        
+        argument_view_t view_for_slot(const slot_t &slot) const;
+        
+        public:
+        
+        /* Looks up an argument by name, like "--foo" or "<bar>". Returns true and populates out_arg (if not NULL) if the argument is present. */
+        bool lookup(const string_view_t &name, argument_view_t *out_arg = NULL) const;
+        
+        /* Returns the argument with the given name, or an empty argument (count 0, no values) if it is not present. */
+        argument_view_t operator[](const string_view_t &name) const;
+        
+        /* Variants of the above taking a handle from the parser that produced this result. These are constant time. */
+        bool lookup(key_handle_t key, argument_view_t *out_arg = NULL) const {
+            if (! key.valid() || key.idx >= slots.size() || ! slots[key.idx].present) {
+                return false;
+            }
+            if (out_arg != NULL) {
+                *out_arg = view_for_slot(slots[key.idx]);
+            }
+            return true;
+        }
+        
+        argument_view_t operator[](key_handle_t key) const {
+            argument_view_t result;
+            this->lookup(key, &result);
+            return result;
+        }
+        
+        /* Iteration. Slots run over every name the parser knows about, in sorted order; not every slot is present in every result. */
+        size_t slot_count() const { return slots.size(); }
+        bool slot_present(size_t idx) const { return slots.at(idx).present; }
+        string_view_t slot_name(size_t idx) const;
+        argument_view_t slot_argument(size_t idx) const { return view_for_slot(slots.at(idx)); }
+        
+        /* Returns an owning map, equivalent to what parse_arguments() returns */
+        argument_map_t to_map() const;
+        
+        base_parse_result_t() : impl(NULL) {}
+    };
+    
+    /* Receives the results of argument_parser_t::parse_arguments_visit(), one name at a time, without any map being built. Subclass this and override visit(). */
+    template<typename string_t>
+    class base_argument_visitor_t {
+        public:
+        typedef base_string_view_t<typename string_t::value_type> string_view_t;
+        
+        /* Called once for each name in the result, like "--foo" or "<bar>", with its count and values (as in base_argument_t). Names are visited in the order they first appear in argv. If flag_generate_empty_args is set, the names that were not matched are then visited with a count of 0 and their default value, if any. The name and values are borrowed from the parser and argv, and are only guaranteed to be valid during the call. */
+        virtual void visit(const string_view_t &name, unsigned int count, const string_view_t *values, size_t value_count) = 0;
+        
+        virtual ~base_argument_visitor_t() {}
+    };
+    
+    /* Limits the work of a single query, so that a pathological doc cannot freeze an interactive caller. A query stops when it has created max_states match states, when the clock passes the deadline, or when another thread cancels it, whichever is first. It then stops branching, and finishes each state it has by following the single most promising way on, letting missing clauses go as flag_match_allow_incomplete does. A match that finished before the budget ran out is preferred; otherwise the result is the best of the finished states, an incomplete match that may claim less than the best possible. truncated is set either way. Each query resets states_created, truncated and timed_out, so a budget may be reused, but not by concurrent queries. */
+    struct match_budget_t {
+        /* The most states a query may create before it stops. 0 means no limit. */
+        size_t max_states;
+        
+        /* When the query stops, in seconds on the monotonic clock (see set_timeout). 0 means no deadline. The clock is checked periodically, not for every state. */
+        double deadline;
+        
+        /* Set by cancel() */
+        volatile int cancelled;
+        
+        /* Set by the query. states_created may go slightly past max_states, as the states already on their way finish. */
+        size_t states_created;
+        bool truncated;
+        bool timed_out;
+        
+        explicit match_budget_t(size_t max = 0) : max_states(max), deadline(0), cancelled(0), states_created(0), truncated(false), timed_out(false)
+        {}
+        
+        /* Sets the deadline to the given number of seconds from now */
+        void set_timeout(double seconds);
+        
+        /* Asks a query using this budget to stop. This may be called from any thread, and is sticky: queries started with a cancelled budget stop at once. */
+        void cancel();
+        bool is_cancelled() const;
+    };
+    
+    /* A prediction of how expensive a doc may be to match, from the shape of its usages alone (see argument_parser_t::analyze_complexity). Matching keeps a list of live states, one for each way of matching so far, and their number is what makes it slow. Each optional clause in a sequence may double them, and an ellipsis over a clause that can match in more than one way may multiply them for every argument. The bounds are worst cases: an actual argv usually creates far fewer states. */
+    struct complexity_report_t {
+        /* The deepest nesting of optional clauses like [foo], and of clauses with an ellipsis like foo... */
+        size_t max_optional_depth;
+        size_t max_ellipsis_depth;
+        
+        /* How the bound on live states grows with the number of arguments: like a polynomial of the given degree, or exponentially */
+        size_t degree;
+        bool exponential;
+        
+        /* The number of arguments the bounds below are computed for */
+        size_t argv_length;
+        
+        /* A bound on the number of live states when matching argv_length arguments */
+        double max_live_states;
+        
+        /* Whether max_live_states exceeds explosion_threshold */
+        bool likely_to_explode;
+        
+        /* A part of the doc that may create more than explosion_threshold states: the smallest clause that does, or the usage, if no single clause does. location and length are a range of the doc. */
+        struct hotspot_t {
+            size_t location;
+            size_t length;
+            double max_live_states;
+            
+            hotspot_t() : location(-1), length(0), max_live_states(0)
+            {}
+        };
+        std::vector<hotspot_t> hotspots;
+        
+        static const size_t explosion_threshold = 4096;
+        
+        complexity_report_t() : max_optional_depth(0), max_ellipsis_depth(0), degree(0), exponential(false), argv_length(0), max_live_states(0), likely_to_explode(false)
+        {}
+    };
+    
+    /* A parser compiled from a docopt doc. Once compiled, the parser is immutable: copies are cheap and share the compiled form, which is freed when the last copy is destroyed. Const methods may be called concurrently from any number of threads, on one parser or on copies of it. Copying and destroying parsers that share a compiled form is also safe from different threads. As with standard containers, a single parser must not be assigned to (or have set_doc called) while other threads use that same parser object. */
     template<typename string_t>
     class argument_parser_t {
-        /* Guts */
-        docopt_impl *impl;
+        /* Guts. Immutable, and shared between copies. */
+        const docopt_impl *impl;
+        
+        friend class base_argv_session_t<string_t>;
         
         public:
         
         typedef base_argument_t<string_t> argument_t;
         typedef std::map<string_t, argument_t> argument_map_t;
         typedef std::vector<error_t> error_list_t;
+        typedef typename string_t::value_type char_t;
+        typedef base_string_view_t<char_t> string_view_t;
+        typedef base_argument_view_t<string_t> argument_view_t;
+        typedef base_parse_result_t<string_t> parse_result_t;
+        typedef base_argument_visitor_t<string_t> argument_visitor_t;
         
-        /* Sets the docopt doc for this parser. Returns any parse errors by reference. Returns true if successful. */
+        /* Sets the docopt doc for this parser. Returns any parse errors by reference. Returns true if successful. If out_errors is NULL, only the lines of the doc are classified now; the options and usages are compiled when a query first needs them. */
         bool set_doc(const string_t &doc, error_list_t *out_errors);
         
-        /* Given a list of arguments, this returns a corresponding parallel array validating the arguments */
-        std::vector<argument_status_t> validate_arguments(const std::vector<string_t> &argv, parse_flags_t flags) const;
+        /* Edits the doc, replacing removed_length characters at offset with inserted, and returns any parse errors of the edited doc by reference. This is equivalent to calling set_doc with the edited doc, but cheaper for large docs. An edit within one line of prose, or of the description, default value or command of an option spec or variable command spec, is fastest: the rest of the compiled doc is moved over as is. Other edits parse only the line groups they touched again, but redo the work over the whole doc. The edited doc is compiled immediately. Copies of this parser keep the doc as it was. Returns false, leaving the parser unchanged, if no doc has been set or the range is out of bounds. */
+        bool apply_edit(size_t offset, size_t removed_length, const string_t &inserted, error_list_t *out_errors);
+        
+        /* Saves the compiled form of this parser to a file, so that load_compiled() can later restore it without compiling the doc again. Returns true on success. */
+        bool save_compiled(const char *path) const;
         
-        /* Given a list of arguments, returns an array of potential next values. A value may be either a literal flag -foo, or a variable; these may be distinguished by the <> surrounding the variable. */
-        std::vector<string_t> suggest_next_argument(const std::vector<string_t> &argv, parse_flags_t flags) const;
+        /* Replaces this parser with one saved by save_compiled(). The parser uses the doc in place in the file, which is mapped read-only (or, if it is small, read into memory). If expected_doc is not NULL, the file is only accepted if it was compiled from expected_doc, so that stale files are detected. Returns false, leaving the parser unchanged, if the file is missing, malformed, stale, or was saved by a different version or for a different string type. */
+        bool load_compiled(const char *path, const string_t *expected_doc = NULL);
+        
+        /* Returns an estimate of the memory used by this parser's compiled form, in bytes. Only the parts compiled so far are counted (see set_doc). Copies share the compiled form, so this is not additive across copies. Returns 0 if no doc has been set. */
+        size_t memory_estimate() const;
+        
+        /* Given a list of arguments, this returns a corresponding parallel array validating the arguments. If budget is not NULL, it limits the work done (see match_budget_t). */
+        std::vector<argument_status_t> validate_arguments(const std::vector<string_t> &argv, parse_flags_t flags, match_budget_t *budget = NULL) const;
+        
+        /* Variants of validate_arguments that borrow argv as a pointer and count (like main()'s argv), or as an array of string views, so that no argument is copied. */
+        std::vector<argument_status_t> validate_arguments(const char_t * const *argv, size_t argc, parse_flags_t flags, match_budget_t *budget = NULL) const;
+        std::vector<argument_status_t> validate_arguments(const string_view_t *argv, size_t argc, parse_flags_t flags, match_budget_t *budget = NULL) const;
+        
+        /* Given a list of arguments, returns an array of potential next values. A value may be either a literal flag -foo, or a variable; these may be distinguished by the <> surrounding the variable. If budget is not NULL, it limits the work done. */
+        std::vector<string_t> suggest_next_argument(const std::vector<string_t> &argv, parse_flags_t flags, match_budget_t *budget = NULL) const;
+        
+        /* Variant of suggest_next_argument for when the user has begun typing the next argument, as partial (which is not part of argv). Only suggestions that could complete partial are made, so this is cheaper than filtering them afterwards. Variables like <file> are always suggested, since partial may be the start of their value. */
+        std::vector<string_t> suggest_next_argument(const std::vector<string_t> &argv, const string_t &partial, parse_flags_t flags, match_budget_t *budget = NULL) const;
+        
+        /* Variant of suggest_next_argument that also reports the kind of each suggestion, and its description or command, as description_for_option and commands_for_variable would. If partial is not empty, it filters the suggestions as above. */
+        typedef base_suggestion_t<string_t> suggestion_t;
+        std::vector<suggestion_t> describe_next_argument(const std::vector<string_t> &argv, const string_t &partial, parse_flags_t flags, match_budget_t *budget = NULL) const;
+        
+        /* Borrowing variants of suggest_next_argument, as with validate_arguments */
+        std::vector<string_t> suggest_next_argument(const char_t * const *argv, size_t argc, parse_flags_t flags, match_budget_t *budget = NULL) const;
+        std::vector<string_t> suggest_next_argument(const string_view_t *argv, size_t argc, parse_flags_t flags, match_budget_t *budget = NULL) const;
+        
+        /* Variants of validate_arguments and suggest_next_argument that run on a background thread. argv is copied, and so is this parser, so both may change while the query runs. The query uses a copy of budget; cancel it through the handle. Any query that out_query was running is cancelled first. */
+        typedef base_async_query_t<string_t, std::vector<argument_status_t> > async_validation_t;
+        typedef base_async_query_t<string_t, std::vector<string_t> > async_suggestion_t;
+        void validate_arguments_async(const std::vector<string_t> &argv, parse_flags_t flags, const match_budget_t &budget, async_validation_t *out_query) const;
+        void suggest_next_argument_async(const std::vector<string_t> &argv, parse_flags_t flags, const match_budget_t &budget, async_suggestion_t *out_query) const;
+        
+        /* A session for an argv that is typed one argument at a time. See base_argv_session_t. */
+        typedef base_argv_session_t<string_t> argv_session_t;
+        
+        /* Variant of validate_arguments for an argv that was edited: argv is the same as previous's argv before first_changed. previous becomes argv, and only the arguments and usages the edit may affect are separated and matched again (see base_argv_session_t). Pass the same session after each edit. previous must have been made from this parser, or a copy of it made since its doc last changed; if it was not, or is NULL, every argument is returned as invalid and previous is left alone. */
+        std::vector<argument_status_t> validate_arguments(const std::vector<string_t> &argv, argv_session_t *previous, size_t first_changed, match_budget_t *budget = NULL) const;
         
         /* Given a variable name, returns the commands for that variable, or the empty string if none. */
         string_t commands_for_variable(const string_t &var) const;
@@ -97,26 +387,209 @@ namespace docopt_fish
         /* Given an option name like --foo, returns the description of that option name, or the empty string if none. */
         string_t description_for_option(const string_t &option) const;
         
-        /* Returns the list of command names (i.e. prog in `Usage: prog [options]`. Duplicate names are only returned once. */
-        std::vector<string_t> get_command_names() const;
+        /* Returns the list of command names (i.e. prog in `Usage: prog [options]`. Duplicate names are only returned once. The list is computed once, and remains valid while this parser (or a copy of it) keeps its doc. */
+        const std::vector<string_t> &get_command_names() const;
 
-        /* Returns the list of variables like '<foo>'. Duplicate names are only returned once. */
-        std::vector<string_t> get_variables() const;
+        /* Returns the list of variables like '<foo>'. Duplicate names are only returned once. The list is computed once, and remains valid as with get_command_names. */
+        const std::vector<string_t> &get_variables() const;
+        
+        /* Predicts how expensive this parser may be to match against argv_length arguments. Use this to warn about docs that are likely to be slow. */
+        complexity_report_t analyze_complexity(size_t argv_length = 16) const;
         
-        /* Given a list of arguments (argv), parse them, producing a map from option names to values */
+        /* Given a list of arguments (argv), parse them, producing a map from option names to values. If budget is not NULL, it limits the work done. */
         argument_map_t parse_arguments(const std::vector<string_t> &argv,
                         parse_flags_t flags,
                         error_list_t *out_errors = NULL,
-                        std::vector<size_t> *out_unused_arguments = NULL) const;
+                        std::vector<size_t> *out_unused_arguments = NULL,
+                        match_budget_t *budget = NULL) const;
 
+        /* Borrowing variants of parse_arguments, as with validate_arguments */
+        argument_map_t parse_arguments(const char_t * const *argv, size_t argc,
+                        parse_flags_t flags,
+                        error_list_t *out_errors = NULL,
+                        std::vector<size_t> *out_unused_arguments = NULL,
+                        match_budget_t *budget = NULL) const;
+        argument_map_t parse_arguments(const string_view_t *argv, size_t argc,
+                        parse_flags_t flags,
+                        error_list_t *out_errors = NULL,
+                        std::vector<size_t> *out_unused_arguments = NULL,
+                        match_budget_t *budget = NULL) const;
+        
+        /* Like parse_arguments, but fills in a map the caller keeps. Entries whose names are in the new result keep their nodes and string storage, so a map reused across calls is not rebuilt; this matters most with flag_generate_empty_args, where every result has the same names. */
+        void parse_arguments_into(const std::vector<string_t> &argv,
+                        parse_flags_t flags,
+                        argument_map_t *inout_arguments,
+                        error_list_t *out_errors = NULL,
+                        std::vector<size_t> *out_unused_arguments = NULL,
+                        match_budget_t *budget = NULL) const;
+        
+        /* Given a list of arguments (argv), parse them into a parse_result_t that borrows from argv and from this parser instead of copying keys and values. Reusing the same out_result across calls recycles its storage. */
+        void parse_arguments_view(const std::vector<string_t> &argv,
+                        parse_flags_t flags,
+                        parse_result_t *out_result,
+                        error_list_t *out_errors = NULL,
+                        std::vector<size_t> *out_unused_arguments = NULL) const;
+        void parse_arguments_view(const char_t * const *argv, size_t argc,
+                        parse_flags_t flags,
+                        parse_result_t *out_result,
+                        error_list_t *out_errors = NULL,
+                        std::vector<size_t> *out_unused_arguments = NULL) const;
+        void parse_arguments_view(const string_view_t *argv, size_t argc,
+                        parse_flags_t flags,
+                        parse_result_t *out_result,
+                        error_list_t *out_errors = NULL,
+                        std::vector<size_t> *out_unused_arguments = NULL) const;
+        
+        /* Given a list of arguments (argv), parse them, reporting each matched name and its values to the visitor in argv order instead of building a result. */
+        void parse_arguments_visit(const std::vector<string_t> &argv,
+                        parse_flags_t flags,
+                        argument_visitor_t *visitor,
+                        error_list_t *out_errors = NULL,
+                        std::vector<size_t> *out_unused_arguments = NULL) const;
+        void parse_arguments_visit(const char_t * const *argv, size_t argc,
+                        parse_flags_t flags,
+                        argument_visitor_t *visitor,
+                        error_list_t *out_errors = NULL,
+                        std::vector<size_t> *out_unused_arguments = NULL) const;
+        void parse_arguments_visit(const string_view_t *argv, size_t argc,
+                        parse_flags_t flags,
+                        argument_visitor_t *visitor,
+                        error_list_t *out_errors = NULL,
+                        std::vector<size_t> *out_unused_arguments = NULL) const;
+        
+        /* Parses many argvs, each as parse_arguments() would, spread across up to thread_count threads (0 means one per online CPU). Batches too small to repay starting threads are parsed on the calling thread. Results are returned in the order of argvs, and errors and unused arguments, if requested, are parallel to it. */
+        std::vector<argument_map_t> parse_batch(const std::vector<std::vector<string_t> > &argvs,
+                        parse_flags_t flags,
+                        std::vector<error_list_t> *out_errors = NULL,
+                        std::vector<std::vector<size_t> > *out_unused_arguments = NULL,
+                        size_t thread_count = 0) const;
+        
+        /* Resolves a name, like "--verbose" or "<file>", to a handle for indexing parse results from this parser. Option names resolve to the name under which the option is reported, so "-v" gives the handle for "--verbose" in `prog [-v | --verbose]`. Returns an invalid handle for unknown names. */
+        key_handle_t key_handle(const string_view_t &name) const;
+        
         /* Constructor for when you either know the doc is error-free, or you aren't interested in the results, only the errors */
         argument_parser_t(const string_t &doc, error_list_t *out_errors);
+        
+        /* Compiles many docs at once, spread across up to thread_count threads (0 means one per online CPU), or on the calling thread for small batches. Returns a parser for each doc, in the order of docs, as if constructed from it. Errors, if requested, are parallel to docs. */
+        static std::vector<argument_parser_t> compile_all(const std::vector<string_t> &docs,
+                                                          std::vector<error_list_t> *out_errors = NULL,
+                                                          size_t thread_count = 0);
 
         argument_parser_t();
         ~argument_parser_t();
         argument_parser_t(const argument_parser_t &rhs);
         argument_parser_t &operator=(const argument_parser_t &rhs);
     };
+    
+    template<typename string_t, typename result_t> struct async_query_state_t;
+    
+    /* A query running on a background thread, like a future. argument_parser_t's *_async methods start one; wait() returns its result. Destroying or restarting the handle cancels the query it was running, and waits for it to stop. Not copyable. */
+    template<typename string_t, typename result_t>
+    class base_async_query_t {
+        async_query_state_t<string_t, result_t> *state;
+        
+        /* Not copyable */
+        base_async_query_t(const base_async_query_t &);
+        void operator=(const base_async_query_t &);
+        
+        /* Stops and forgets any running query */
+        void reset();
+        
+        friend class argument_parser_t<string_t>;
+        void start(const argument_parser_t<string_t> &parser, const std::vector<string_t> &argv, parse_flags_t flags, const match_budget_t &budget);
+        
+        public:
+        base_async_query_t();
+        ~base_async_query_t();
+        
+        /* Returns true if the query has finished, so that wait() will not block. Returns false if no query was started. */
+        bool is_ready() const;
+        
+        /* Waits for the query to finish and returns its result. The result is empty if no query was started. */
+        const result_t &wait();
+        
+        /* Asks the query to stop soon. wait() then returns a best-effort result, and budget().truncated is set. */
+        void cancel();
+        
+        /* The query's budget, with the counts it set. Only meaningful after wait(). */
+        const match_budget_t &budget() const;
+    };
+    
+    template<typename string_t> struct argv_session_state_t;
+    
+    /* An argv that changes a little at a time, as when the user types or edits a command line, validated and completed against a parser. Changing it only separates the arguments the change can affect again, instead of the whole argv. The session also remembers what each usage matched, and only matches again the usages that looked at a changed positional argument; changing an option matches every usage again. Results are cached until argv next changes. The session keeps a copy of the parser, so the parser may change while the session is in use. Not copyable, and not safe to use from several threads at once. */
+    template<typename string_t>
+    class base_argv_session_t {
+        argv_session_state_t<string_t> *state;
+        
+        /* Not copyable */
+        base_argv_session_t(const base_argv_session_t &);
+        void operator=(const base_argv_session_t &);
+        
+        friend class argument_parser_t<string_t>;
+        
+        public:
+        base_argv_session_t(const argument_parser_t<string_t> &parser, parse_flags_t flags);
+        ~base_argv_session_t();
+        
+        /* Appends an argument to argv */
+        void push(const string_t &arg);
+        
+        /* Removes the last argument from argv, if there is one */
+        void pop();
+        
+        /* Removes every argument */
+        void clear();
+        
+        /* Replaces argv with a new argv that is the same before first_changed (which may be anywhere, not just at the end) */
+        void assign(const std::vector<string_t> &argv, size_t first_changed = 0);
+        
+        /* The number of arguments in argv, and the argument at idx */
+        size_t size() const;
+        const string_t &at(size_t idx) const;
+        
+        /* Equivalent to the parser's validate_arguments and suggest_next_argument for the current argv. If budget is not NULL, it limits the work done; its count only includes usages matched again, and results cut short by the budget are not cached. */
+        const std::vector<argument_status_t> &validate(match_budget_t *budget = NULL);
+        const std::vector<string_t> &suggest(match_budget_t *budget = NULL);
+    };
+    
+    template<typename string_t> struct registry_shard_t;
+    
+    /* A collection of docs keyed by command name, whose parsers are compiled on first use. Compiled parsers are evicted, least recently used first, when their memory estimates exceed a budget. Names are spread across independently locked shards, so lookups from different threads rarely contend. All methods may be called concurrently. */
+    template<typename string_t>
+    class argument_parser_registry_t {
+        registry_shard_t<string_t> *shards;
+        
+        /* The sum of the compiled parsers' memory estimates, over all shards, is kept in memory_used and updated atomically */
+        const size_t memory_budget;
+        size_t memory_used;
+        
+        void evict_over_budget(registry_shard_t<string_t> *shard, size_t newest_memory);
+        
+        /* Not copyable */
+        argument_parser_registry_t(const argument_parser_registry_t &);
+        void operator=(const argument_parser_registry_t &);
+        
+        public:
+        typedef argument_parser_t<string_t> parser_t;
+        
+        /* Creates a registry that keeps compiled parsers within memory_budget bytes in total. Installing a parser evicts older parsers of its own shard first, then those of other shards. A parser larger than the whole budget is returned by get() but not kept. The total may briefly exceed the budget while another thread holds a shard that would be evicted from. */
+        explicit argument_parser_registry_t(size_t memory_budget);
+        ~argument_parser_registry_t();
+        
+        /* Adds or replaces the doc for a name. The doc is not compiled until the name is looked up. If compiled_path is not NULL, lookups first try to load the parser from that file (see load_compiled), falling back to compiling the doc if it is missing or stale. */
+        void add(const string_t &name, const string_t &doc, const char *compiled_path = NULL);
+        
+        /* Removes a name. Returns true if it was present. */
+        bool remove(const string_t &name);
+        
+        /* Looks up the parser for a name, compiling it if necessary, and returns a copy of it by reference. Copies are cheap and stay valid even if the registry later evicts or replaces the name. Returns false if the name is unknown. Errors from compiling the doc, if any, are returned the first time it is compiled. */
+        bool get(const string_t &name, parser_t *out_parser, std::vector<error_t> *out_errors = NULL);
+        
+        /* Returns how many parsers are currently compiled, and the sum of their memory estimates */
+        size_t compiled_count() const;
+        size_t compiled_memory() const;
+    };
 }
 
 #endif
@@ -1,7 +1,12 @@
 #include <string>
 #include <vector>
 #include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
 #include <sys/time.h>
+#include <unistd.h>
 #include "docopt_fish.h"
 
 using namespace std;
@@ -31,6 +36,44 @@ static const char * const g_bind_usage =
 ;
 
 
+/* Count heap allocations so the benchmark can report them per parse */
+static size_t g_allocation_count = 0;
+
+#if __cplusplus > 199711L
+#define BENCHMARK_THROWS_BAD_ALLOC
+#define BENCHMARK_NOTHROW noexcept
+#else
+#define BENCHMARK_THROWS_BAD_ALLOC throw(std::bad_alloc)
+#define BENCHMARK_NOTHROW throw()
+#endif
+
+void *operator new(size_t size) BENCHMARK_THROWS_BAD_ALLOC
+{
+    __atomic_add_fetch(&g_allocation_count, 1, __ATOMIC_RELAXED);
+    void *result = malloc(size ? size : 1);
+    if (result == NULL) {
+        throw std::bad_alloc();
+    }
+    return result;
+}
+
+void operator delete(void *ptr) BENCHMARK_NOTHROW
+{
+    free(ptr);
+}
+
+#if __cplusplus >= 201402L
+void operator delete(void *ptr, size_t) BENCHMARK_NOTHROW
+{
+    free(ptr);
+}
+#endif
+
+static size_t allocation_count()
+{
+    return __atomic_load_n(&g_allocation_count, __ATOMIC_RELAXED);
+}
+
 static double timef()
 {
     int time_res;
@@ -61,11 +104,100 @@ int main(int argc, char *argv[])
         parser.set_doc(g_bind_usage, NULL);
     }
     after = timef();
-    fprintf(stderr, "construct msec per: %f\n", (after - before) * (1000.0) / amt);
+    fprintf(stderr, "construct (lazy) msec per: %f\n", (after - before) * (1000.0) / amt);
+    
+    before = timef();
+    for (size_t i=0; i < amt; i++) {
+        argument_parser_t<string>::error_list_t errors;
+        parser.set_doc(g_bind_usage, &errors);
+    }
+    after = timef();
+    fprintf(stderr, "construct (eager) msec per: %f\n", (after - before) * (1000.0) / amt);
+    
+    before = timef();
+    for (size_t i=0; i < amt; i++) {
+        parser.set_doc(g_bind_usage, NULL);
+        parser.get_command_names();
+    }
+    after = timef();
+    fprintf(stderr, "construct and list command names msec per: %f\n", (after - before) * (1000.0) / amt);
 
+    vector<string> docs(amt, g_bind_usage);
+    before = timef();
+    argument_parser_t<string>::compile_all(docs);
+    after = timef();
+    fprintf(stderr, "compile_all msec per (all cpus): %f\n", (after - before) * (1000.0) / amt);
+    
+    // Small batches, where starting threads would cost more than the work
+    const vector<string> small_docs(4, g_bind_usage);
+    before = timef();
+    for (size_t i=0; i < amt; i += small_docs.size()) {
+        for (size_t j=0; j < small_docs.size(); j++) {
+            argument_parser_t<string>::error_list_t errors;
+            parser.set_doc(small_docs.at(j), &errors);
+        }
+    }
+    after = timef();
+    fprintf(stderr, "compile batches of 4 msec per (serial): %f\n", (after - before) * (1000.0) / amt);
+    
+    before = timef();
+    for (size_t i=0; i < amt; i += small_docs.size()) {
+        vector<argument_parser_t<string>::error_list_t> errors;
+        argument_parser_t<string>::compile_all(small_docs, &errors, 4);
+    }
+    after = timef();
+    fprintf(stderr, "compile batches of 4 msec per (compile_all, 4 threads): %f\n", (after - before) * (1000.0) / amt);
+    
     bool parsed = parser.set_doc(g_bind_usage, NULL);
     assert(parsed);
 
+    const char *compiled_path = "/tmp/docopt_fish_benchmark.compiled";
+    const string bind_usage = g_bind_usage;
+    parser.save_compiled(compiled_path);
+    before = timef();
+    for (size_t i=0; i < amt; i++) {
+        parser.load_compiled(compiled_path, &bind_usage);
+    }
+    after = timef();
+    fprintf(stderr, "load_compiled msec per: %f\n", (after - before) * (1000.0) / amt);
+    unlink(compiled_path);
+    
+    // A man page sized doc: a few usages and 2000 options, edited in the middle of one description
+    string large_usage = "Usage:\n    big [options] <file>...\n    big (-h | --help)\nOptions:\n";
+    for (size_t i=0; i < 2000; i++) {
+        char line[128];
+        snprintf(line, sizeof line, "    --option-%lu <VALUE>    Describes option %lu\n", (unsigned long)i, (unsigned long)i);
+        large_usage.append(line);
+    }
+    const size_t edit_offset = large_usage.find("Describes option 1000");
+    const size_t large_amt = amt / 50 + 1;
+    argument_parser_t<string> large_parser;
+    before = timef();
+    for (size_t i=0; i < large_amt; i++) {
+        argument_parser_t<string>::error_list_t errors;
+        large_parser.set_doc(large_usage, &errors);
+    }
+    after = timef();
+    fprintf(stderr, "construct 2000 options (eager) msec per: %f\n", (after - before) * (1000.0) / large_amt);
+    
+    before = timef();
+    for (size_t i=0; i < large_amt; i++) {
+        argument_parser_t<string>::error_list_t errors;
+        large_parser.apply_edit(edit_offset, 1, i % 2 ? "D" : "d", &errors);
+    }
+    after = timef();
+    fprintf(stderr, "edit 2000 options msec per: %f\n", (after - before) * (1000.0) / large_amt);
+    
+    // Renaming an option changes the names, so the whole doc is compiled again, but for the untouched line groups
+    const size_t rename_offset = large_usage.find("--option-1000 ") + strlen("--option-");
+    before = timef();
+    for (size_t i=0; i < large_amt; i++) {
+        argument_parser_t<string>::error_list_t errors;
+        large_parser.apply_edit(rename_offset, 1, i % 2 ? "1" : "x", &errors);
+    }
+    after = timef();
+    fprintf(stderr, "rename in 2000 options msec per: %f\n", (after - before) * (1000.0) / large_amt);
+    
     vector<string> doc_argv;
     doc_argv.push_back("bind");
     doc_argv.push_back("abc");
@@ -77,5 +209,57 @@ int main(int argc, char *argv[])
     }
     after = timef();
     fprintf(stderr, "argv msec per: %f\n", (after - before) * (1000.0) / amt);
+    
+    size_t allocations_before = allocation_count();
+    before = timef();
+    for (size_t i=0; i < amt; i++) {
+        parser.parse_arguments(doc_argv, flag_generate_empty_args, NULL, NULL);
+    }
+    after = timef();
+    fprintf(stderr, "argv with empty args msec per: %f, allocations per: %f\n", (after - before) * (1000.0) / amt, (double)(allocation_count() - allocations_before) / amt);
+    
+    argument_parser_t<string>::argument_map_t reused_arguments;
+    allocations_before = allocation_count();
+    before = timef();
+    for (size_t i=0; i < amt; i++) {
+        parser.parse_arguments_into(doc_argv, flag_generate_empty_args, &reused_arguments);
+    }
+    after = timef();
+    fprintf(stderr, "argv with empty args into a reused map msec per: %f, allocations per: %f\n", (after - before) * (1000.0) / amt, (double)(allocation_count() - allocations_before) / amt);
+    
+    const vector<vector<string> > small_batch(8, doc_argv);
+    before = timef();
+    for (size_t i=0; i < amt; i += small_batch.size()) {
+        for (size_t j=0; j < small_batch.size(); j++) {
+            parser.parse_arguments(small_batch.at(j), flags_default, NULL, NULL);
+        }
+    }
+    after = timef();
+    fprintf(stderr, "argv batches of 8 msec per (serial): %f\n", (after - before) * (1000.0) / amt);
+    
+    before = timef();
+    for (size_t i=0; i < amt; i += small_batch.size()) {
+        parser.parse_batch(small_batch, flags_default, NULL, NULL, 4);
+    }
+    after = timef();
+    fprintf(stderr, "argv batches of 8 msec per (parse_batch, 4 threads): %f\n", (after - before) * (1000.0) / amt);
+    
+    vector<vector<string> > batch(amt * 4, doc_argv);
+    before = timef();
+    for (size_t i=0; i < batch.size(); i++) {
+        parser.parse_arguments(batch.at(i), flags_default, NULL, NULL);
+    }
+    after = timef();
+    fprintf(stderr, "batch argv msec per (serial): %f\n", (after - before) * (1000.0) / batch.size());
+    
+    before = timef();
+    parser.parse_batch(batch, flags_default, NULL, NULL, 1);
+    after = timef();
+    fprintf(stderr, "batch argv msec per (1 thread): %f\n", (after - before) * (1000.0) / batch.size());
+    
+    before = timef();
+    parser.parse_batch(batch, flags_default);
+    after = timef();
+    fprintf(stderr, "batch argv msec per (all cpus): %f\n", (after - before) * (1000.0) / batch.size());
     return 0;
 }
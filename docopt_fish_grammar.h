@@ -264,6 +264,9 @@ struct variable_clause_t {
 
 bool parse_one_usage(const rstring_t &src, const option_list_t &shortcut_options, usage_t *out_usage, vector<error_t> *out_errors);
 
+/* Returns the program name of a usage spec (its first word), as parse_one_usage would, without parsing the rest */
+rstring_t usage_prog_name(const rstring_t &src);
+
 
 // Node visitor class, using CRTP. Child classes should override accept().
 template<typename T>
@@ -199,14 +199,22 @@ struct parse_context_t {
     
     // Parse a usage_t
     parse_result_t parse(usage_t *result) {
+        if (! this->scan_prog_name(&result->prog_name)) {
+            return parsed_done;
+        }
+        return parse(&result->alternation_list);
+    }
+    
+    // Scan the program name that begins a usage. Returns false if there is nothing to scan.
+    bool scan_prog_name(rstring_t *prog_name) {
         consume_leading_whitespace();
         if (this->is_at_end()) {
-            return parsed_done;
+            return false;
         }
         
-        bool scanned = this->scan_word(&result->prog_name);
+        bool scanned = this->scan_word(prog_name);
         assert(scanned); // else we should not have tried to parse this as a usage
-        return parse(&result->alternation_list);
+        return true;
     }
     
     // Parse ellipsis
@@ -362,6 +370,8 @@ struct parse_context_t {
                 rstring_t close_token;
                 if (this->scan(is_paren ? ')' : ']', &close_token)) {
                     result->production = is_paren ? 1 : 2;
+                    result->open_token = token;
+                    result->close_token = close_token;
                     parse(&result->opt_ellipsis); // never fails
                 } else {
                     // No closing bracket or paren
@@ -451,5 +461,13 @@ bool parse_one_usage(const rstring_t &source, const option_list_t &shortcut_opti
     return status != parsed_error;
 }
 
+rstring_t usage_prog_name(const rstring_t &source) {
+    const option_list_t no_options;
+    parse_context_t ctx(source, no_options);
+    rstring_t result;
+    ctx.scan_prog_name(&result);
+    return result;
+}
+
 CLOSE_DOCOPT_IMPL /* namespace */
 
@@ -7,6 +7,8 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
 
 using namespace docopt_fish;
 using namespace std;
@@ -148,6 +150,21 @@ static map<string_t, string_t> parse_expected_results(const char *joined_expecte
 }
 
 
+/* Returns true if two argument maps have the same keys, counts and values */
+template<typename string_t>
+static bool arg_maps_equal(const map<string_t, base_argument_t<string_t> > &lhs, const map<string_t, base_argument_t<string_t> > &rhs) {
+    typedef typename map<string_t, base_argument_t<string_t> >::const_iterator iter_t;
+    if (lhs.size() != rhs.size()) {
+        return false;
+    }
+    for (iter_t liter = lhs.begin(), riter = rhs.begin(); liter != lhs.end(); ++liter, ++riter) {
+        if (liter->first != riter->first || liter->second.count != riter->second.count || liter->second.values != riter->second.values) {
+            return false;
+        }
+    }
+    return true;
+}
+
 template<typename string_t>
 static void run_1_suggestion_test(const char *usage, const char *joined_argv, const char *joined_expected_suggestions, size_t test_idx, size_t arg_idx) {
     using namespace docopt_fish;
@@ -161,7 +178,7 @@ static void run_1_suggestion_test(const char *usage, const char *joined_argv, co
     /* Usage as a string */
     const string_t usage_str(usage, usage + strlen(usage));
     
-    std::vector<error_t> errors;
+    std::vector<docopt_fish::error_t> errors;
     argument_parser_t<string_t> parser(usage_str, &errors);
     
     if (! errors.empty()) {
@@ -202,12 +219,19 @@ static void run_1_correctness_test(const char *usage, const char *joined_argv, c
     
     /* Perform the parsing */
     arg_map_t results;
-    std::vector<error_t> error_list;
+    std::vector<docopt_fish::error_t> error_list;
     vector<size_t> unused_args;
     argument_parser_t<string_t> parser;
     bool parse_success = parser.set_doc(usage_str, &error_list);
     if (parse_success) {
         results = parser.parse_arguments(argv, flag_generate_empty_args | flag_resolve_unambiguous_prefixes, &error_list, &unused_args);
+        
+        /* The borrowing parse result should agree with the map */
+        typename argument_parser_t<string_t>::parse_result_t result_view;
+        parser.parse_arguments_view(argv, flag_generate_empty_args | flag_resolve_unambiguous_prefixes, &result_view);
+        if (! arg_maps_equal(result_view.to_map(), results)) {
+            err("Correctness test %lu.%lu: parse result view disagrees with map", test_idx, arg_idx);
+        }
     }
     
     bool expects_error = ! strcmp(joined_expected_results, ERROR_EXPECTED);
@@ -327,7 +351,7 @@ static void run_1_usage_err_test(const char *usage, int expected_error_code, siz
     const string_t usage_str(usage, usage + strlen(usage));
     
     /* Perform the parsing */
-    std::vector<error_t> error_list;
+    std::vector<docopt_fish::error_t> error_list;
     argument_parser_t<string_t> parser(usage_str, &error_list);
     
     /* Check errors */
@@ -352,7 +376,7 @@ static void run_1_argv_err_test(const char *usage, const char *joined_argv, int
     const string_t usage_str(usage, usage + strlen(usage));
     
     /* Perform the parsing */
-    std::vector<error_t> error_list;
+    std::vector<docopt_fish::error_t> error_list;
     argument_parser_t<string_t> parser(usage_str, &error_list);
     
     /* Check arguments */
@@ -2336,6 +2360,1672 @@ static void test_command_names()
 }
 
 
+/* Verify that the borrowing (pointer and count, and string view) entry points agree with the vector ones */
+template<typename string_t>
+static void test_borrowed_argv()
+{
+    typedef typename argument_parser_t<string_t>::argument_map_t arg_map_t;
+    typedef typename argument_parser_t<string_t>::char_t char_t;
+    typedef typename argument_parser_t<string_t>::string_view_t string_view_t;
+    
+    const char *usage =
+    "Usage: prog [-v | --verbose] checkout <branch>\n"
+    "       prog --line=<val> <file>...\n";
+    const char *const joined_argvs[] = {
+        "checkout -v master",
+        "--line=3 a b",
+        "checkout",
+        "--line",
+        NULL
+    };
+    
+    argument_parser_t<string_t> parser(to_string<string_t>(usage), NULL);
+    for (size_t test_idx=0; joined_argvs[test_idx] != NULL; test_idx++) {
+        vector<string_t> argv = split_nonempty<string_t>(joined_argvs[test_idx], ' ');
+        argv.insert(argv.begin(), to_string<string_t>("prog"));
+        
+        vector<const char_t *> argv_ptrs;
+        vector<string_view_t> argv_views;
+        for (size_t i=0; i < argv.size(); i++) {
+            argv_ptrs.push_back(argv.at(i).c_str());
+            argv_views.push_back(string_view_t(argv.at(i)));
+        }
+        const size_t argc = argv.size();
+        
+        vector<size_t> unused, unused_ptrs, unused_views;
+        const arg_map_t expected = parser.parse_arguments(argv, flag_generate_empty_args, NULL, &unused);
+        if (! arg_maps_equal(parser.parse_arguments(&argv_ptrs[0], argc, flag_generate_empty_args, NULL, &unused_ptrs), expected) || unused_ptrs != unused) {
+            err("Borrowed argv test %lu: pointer parse disagrees", test_idx);
+        }
+        if (! arg_maps_equal(parser.parse_arguments(&argv_views[0], argc, flag_generate_empty_args, NULL, &unused_views), expected) || unused_views != unused) {
+            err("Borrowed argv test %lu: view parse disagrees", test_idx);
+        }
+        
+        const vector<argument_status_t> statuses = parser.validate_arguments(argv, flag_match_allow_incomplete);
+        if (parser.validate_arguments(&argv_ptrs[0], argc, flag_match_allow_incomplete) != statuses ||
+            parser.validate_arguments(&argv_views[0], argc, flag_match_allow_incomplete) != statuses) {
+            err("Borrowed argv test %lu: validation disagrees", test_idx);
+        }
+        
+        const vector<string_t> suggestions = parser.suggest_next_argument(argv, flag_match_allow_incomplete);
+        if (parser.suggest_next_argument(&argv_ptrs[0], argc, flag_match_allow_incomplete) != suggestions ||
+            parser.suggest_next_argument(&argv_views[0], argc, flag_match_allow_incomplete) != suggestions) {
+            err("Borrowed argv test %lu: suggestions disagree", test_idx);
+        }
+    }
+}
+
+/* Verify that parse result views borrow from argv, and look up names correctly */
+template<typename string_t>
+static void test_parse_result_view()
+{
+    typedef typename argument_parser_t<string_t>::parse_result_t parse_result_t;
+    typedef typename argument_parser_t<string_t>::argument_view_t argument_view_t;
+    
+    const string_t usage = to_string<string_t>("Usage: prog [-v | --verbose] [--level=<num>] <file>...\n"
+                                               "Options: --level=<num>  Level [default: 3]");
+    argument_parser_t<string_t> parser(usage, NULL);
+    
+    vector<string_t> argv = split_nonempty<string_t>("prog -v a.txt b.txt", ' ');
+    parse_result_t result;
+    parser.parse_arguments_view(argv, flags_default, &result);
+    
+    argument_view_t arg;
+    if (! result.lookup(to_string<string_t>("--verbose"), &arg) || arg.count != 1) {
+        err("Parse result view: --verbose missing or wrong count");
+    }
+    if (! result.lookup(to_string<string_t>("<file>"), &arg) || arg.value_count != 2) {
+        err("Parse result view: <file> missing or wrong value count");
+    } else if (arg.values[0].data() != argv.at(2).data() || arg.values[1].data() != argv.at(3).data()) {
+        err("Parse result view: values were copied rather than borrowed from argv");
+    }
+    if (result.lookup(to_string<string_t>("--level")) || result.lookup(to_string<string_t>("--bogus"))) {
+        err("Parse result view: unexpected key without flag_generate_empty_args");
+    }
+    if (result[to_string<string_t>("--bogus")].count != 0) {
+        err("Parse result view: missing key has nonzero count");
+    }
+    
+    // Handles resolve once, including short aliases of long options, and index the result directly
+    const key_handle_t verbose = parser.key_handle(to_string<string_t>("--verbose"));
+    if (! verbose.valid() || ! parser.key_handle(to_string<string_t>("-v")).valid()) {
+        err("Parse result view: could not resolve handles for --verbose and -v");
+    } else if (result[parser.key_handle(to_string<string_t>("-v"))].count != 1 || result[verbose].count != 1) {
+        err("Parse result view: wrong count via handle");
+    }
+    if (result[parser.key_handle(to_string<string_t>("<file>"))].value_count != 2) {
+        err("Parse result view: wrong value count via handle");
+    }
+    if (parser.key_handle(to_string<string_t>("--bogus")).valid() || result.lookup(key_handle_t())) {
+        err("Parse result view: invalid handle resolved");
+    }
+    
+    // Reusing the result recycles it, and generating empty args applies the default
+    parser.parse_arguments_view(argv, flag_generate_empty_args, &result);
+    if (! result.lookup(to_string<string_t>("<num>"), &arg) || arg.value_count != 1 || arg.value().str() != to_string<string_t>("3")) {
+        err("Parse result view: default value not applied");
+    }
+}
+
+/* Verify that parsing into a reused map gives the same result as parsing into a fresh one, whatever the map held before */
+template<typename string_t>
+static void test_reused_argument_map()
+{
+    typedef typename argument_parser_t<string_t>::argument_map_t argument_map_t;
+    const char *joined_argvs[] = {
+        "prog --level 5 a.txt -v b.txt",
+        "prog a.txt",
+        "prog --bogus a.txt",
+        "prog",
+        "prog --level",
+        "prog -v -v c.txt d.txt e.txt",
+        "prog a.txt",
+    };
+    argument_parser_t<string_t> parser(to_string<string_t>("Usage: prog [-v | --verbose] [--level=<num>] <file>...\n"
+                                                           "Options: --level=<num>  Level [default: 3]"), NULL);
+    const parse_flags_t flag_sets[] = {flags_default, flag_generate_empty_args};
+    
+    // Alternate the flags too, so that the map gains and loses the empty args between parses
+    argument_map_t reused;
+    reused[to_string<string_t>("--stale")].count = 1;
+    for (size_t i=0; i < 2 * (sizeof joined_argvs / sizeof *joined_argvs); i++) {
+        const vector<string_t> argv = split_nonempty<string_t>(joined_argvs[i % (sizeof joined_argvs / sizeof *joined_argvs)], ' ');
+        const parse_flags_t flags = flag_sets[(i + i / 2) % 2];
+        vector<size_t> unused, expected_unused;
+        parser.parse_arguments_into(argv, flags, &reused, NULL, &unused);
+        const argument_map_t expected = parser.parse_arguments(argv, flags, NULL, &expected_unused);
+        if (! arg_maps_equal(reused, expected) || unused != expected_unused) {
+            err("Reused argument map: parse %lu differs from parse_arguments", (unsigned long)i);
+        }
+    }
+}
+
+/* Visitor that records what it was given, so it can be compared against parse_arguments() */
+template<typename string_t>
+struct recording_visitor_t : public base_argument_visitor_t<string_t> {
+    typedef typename base_argument_visitor_t<string_t>::string_view_t string_view_t;
+    std::map<string_t, base_argument_t<string_t> > args;
+    std::vector<string_t> names;
+    
+    void visit(const string_view_t &name, unsigned int count, const string_view_t *values, size_t value_count) {
+        base_argument_t<string_t> &arg = args[name.str()];
+        arg.count = count;
+        for (size_t i=0; i < value_count; i++) {
+            arg.values.push_back(values[i].str());
+        }
+        names.push_back(name.str());
+    }
+};
+
+template<typename string_t>
+static void test_argument_visitor()
+{
+    const string_t usage = to_string<string_t>("Usage: prog [-v | --verbose] [--level=<num>] <file>...\n"
+                                               "Options: --level=<num>  Level [default: 3]");
+    argument_parser_t<string_t> parser(usage, NULL);
+    vector<string_t> argv = split_nonempty<string_t>("prog --level 5 a.txt -v b.txt", ' ');
+    
+    const parse_flags_t flag_sets[] = {flags_default, flag_generate_empty_args};
+    for (size_t i=0; i < sizeof flag_sets / sizeof *flag_sets; i++) {
+        recording_visitor_t<string_t> visitor;
+        parser.parse_arguments_visit(argv, flag_sets[i], &visitor);
+        if (! arg_maps_equal(visitor.args, parser.parse_arguments(argv, flag_sets[i]))) {
+            err("Argument visitor: visited arguments differ from parse_arguments");
+        }
+        if (visitor.names.size() != visitor.args.size()) {
+            err("Argument visitor: a name was visited more than once");
+        }
+    }
+    
+    // Matched names are visited in argv order
+    recording_visitor_t<string_t> visitor;
+    parser.parse_arguments_visit(argv, flags_default, &visitor);
+    const char * const expected[] = {"--level", "<num>", "<file>", "--verbose"};
+    vector<string_t> expected_names;
+    for (size_t i=0; i < sizeof expected / sizeof *expected; i++) {
+        expected_names.push_back(to_string<string_t>(expected[i]));
+    }
+    if (visitor.names != expected_names) {
+        err("Argument visitor: names not visited in argv order");
+    }
+}
+
+/* Shared by the threads of test_shared_parser */
+template<typename string_t>
+struct shared_parser_job_t {
+    const argument_parser_t<string_t> *parser;
+    vector<string_t> argv;
+    typename argument_parser_t<string_t>::argument_map_t expected;
+    size_t failures;
+};
+
+template<typename string_t>
+static void *run_shared_parser_job(void *context)
+{
+    shared_parser_job_t<string_t> *job = static_cast<shared_parser_job_t<string_t> *>(context);
+    for (size_t i=0; i < 200; i++) {
+        // Copy and assign the shared parser, and parse with both the original and the copies
+        argument_parser_t<string_t> copy(*job->parser);
+        argument_parser_t<string_t> assigned;
+        assigned = copy;
+        if (! arg_maps_equal(assigned.parse_arguments(job->argv, flag_generate_empty_args), job->expected) ||
+            ! arg_maps_equal(job->parser->parse_arguments(job->argv, flag_generate_empty_args), job->expected)) {
+            job->failures++;
+        }
+    }
+    return NULL;
+}
+
+template<typename string_t>
+static void test_shared_parser()
+{
+    const string_t usage = to_string<string_t>("Usage: prog [-v | --verbose] [--level=<num>] <file>...\n"
+                                               "Options: --level=<num>  Level [default: 3]");
+    const vector<string_t> argv = split_nonempty<string_t>("prog --level 5 a.txt -v b.txt", ' ');
+    argument_parser_t<string_t> *parser = new argument_parser_t<string_t>(usage, NULL);
+    const typename argument_parser_t<string_t>::argument_map_t expected = parser->parse_arguments(argv, flag_generate_empty_args);
+    
+    // Setting the doc of a copy leaves the original alone
+    argument_parser_t<string_t> other(*parser);
+    other.set_doc(to_string<string_t>("Usage: prog <thing>"), NULL);
+    if (! arg_maps_equal(parser->parse_arguments(argv, flag_generate_empty_args), expected)) {
+        err("Shared parser: setting the doc of a copy affected the original");
+    }
+    
+    // Copy, assign and parse from several threads at once
+    const size_t thread_count = 4;
+    shared_parser_job_t<string_t> jobs[thread_count];
+    pthread_t threads[thread_count];
+    for (size_t i=0; i < thread_count; i++) {
+        jobs[i].parser = parser;
+        jobs[i].argv = argv;
+        jobs[i].expected = expected;
+        jobs[i].failures = 0;
+        pthread_create(&threads[i], NULL, run_shared_parser_job<string_t>, &jobs[i]);
+    }
+    for (size_t i=0; i < thread_count; i++) {
+        pthread_join(threads[i], NULL);
+        if (jobs[i].failures > 0) {
+            err("Shared parser: %lu concurrent parses gave the wrong result", (unsigned long)jobs[i].failures);
+        }
+    }
+    
+    // Copies outlive the parser they were copied from
+    argument_parser_t<string_t> survivor(*parser);
+    delete parser;
+    if (! arg_maps_equal(survivor.parse_arguments(argv, flag_generate_empty_args), expected)) {
+        err("Shared parser: copy does not outlive its original");
+    }
+}
+
+/* Everything a parser reports about one argv, for comparing concurrent runs against a single-threaded one */
+template<typename string_t>
+struct parse_outcome_t {
+    typename argument_parser_t<string_t>::argument_map_t args;
+    vector<int> error_codes;
+    vector<size_t> unused;
+    vector<string_t> suggestions;
+    vector<argument_status_t> statuses;
+    
+    bool operator==(const parse_outcome_t &rhs) const {
+        return arg_maps_equal(args, rhs.args) && error_codes == rhs.error_codes && unused == rhs.unused && suggestions == rhs.suggestions && statuses == rhs.statuses;
+    }
+};
+
+template<typename string_t>
+static parse_outcome_t<string_t> parse_outcome(const argument_parser_t<string_t> &parser, const vector<string_t> &argv)
+{
+    parse_outcome_t<string_t> outcome;
+    std::vector<docopt_fish::error_t> errors;
+    outcome.args = parser.parse_arguments(argv, flag_generate_empty_args | flag_resolve_unambiguous_prefixes, &errors, &outcome.unused);
+    for (size_t i=0; i < errors.size(); i++) {
+        outcome.error_codes.push_back(errors.at(i).code);
+    }
+    outcome.suggestions = parser.suggest_next_argument(argv, flag_match_allow_incomplete);
+    outcome.statuses = parser.validate_arguments(argv, flags_default);
+    
+    // The other result forms must agree with the map
+    typename argument_parser_t<string_t>::parse_result_t view;
+    parser.parse_arguments_view(argv, flag_generate_empty_args | flag_resolve_unambiguous_prefixes, &view);
+    if (! arg_maps_equal(view.to_map(), outcome.args)) {
+        outcome.args.clear();
+    }
+    return outcome;
+}
+
+/* Shared by the threads of test_concurrent_parsing */
+template<typename string_t>
+struct concurrent_parse_job_t {
+    const argument_parser_t<string_t> *parser;
+    const vector<vector<string_t> > *argvs;
+    const vector<parse_outcome_t<string_t> > *expected;
+    size_t offset;
+    size_t failures;
+};
+
+template<typename string_t>
+static void *run_concurrent_parse_job(void *context)
+{
+    concurrent_parse_job_t<string_t> *job = static_cast<concurrent_parse_job_t<string_t> *>(context);
+    const size_t count = job->argvs->size();
+    for (size_t iter=0; iter < 50; iter++) {
+        // Each thread starts at a different argv, so that different queries overlap
+        for (size_t i=0; i < count; i++) {
+            size_t idx = (i + job->offset) % count;
+            if (! (parse_outcome(*job->parser, job->argvs->at(idx)) == job->expected->at(idx))) {
+                job->failures++;
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Hammer a single parser from several threads, and compare against single-threaded results */
+template<typename string_t>
+static void test_concurrent_parsing()
+{
+    const char *usage =
+        "Usage:\n"
+        "    bind [-M <MODE> | --mode <MODE>] [-m <NEW_MODE> | --sets-mode <NEW_MODE>]\n"
+        "         [-k | --key] <SEQUENCE> <COMMAND>...\n"
+        "    bind (-f | --function-names)\n"
+        "    bind (-e | --erase) [-M <MODE> | --mode <MODE>]\n"
+        "         [-a | --all] [-k | --key] [<SEQUENCE>...]\n"
+        "    bind checkout [--level=<num>] <branch>\n"
+        "Options:\n"
+        "    -M <MODE>, --mode <MODE>  Bind mode [default: default]\n"
+        "    --level=<num>  Level [default: 3]\n";
+    const char *joined_argvs[] = {
+        "bind abc forward-word",
+        "bind -M insert -k left backward-char beginning-of-line",
+        "bind --mode=insert --sets-mode default abc",
+        "bind -f",
+        "bind -e -a",
+        "bind --erase -M insert abc def",
+        "bind checkout --level 5 master",
+        "bind checkout --lev=2",
+        "bind --bogus abc",
+        "bind -M",
+        "bind",
+        "bind -ka",
+    };
+    
+    std::vector<docopt_fish::error_t> errors;
+    argument_parser_t<string_t> parser(to_string<string_t>(usage), &errors);
+    if (! errors.empty()) {
+        err("Concurrent parsing: usage unexpectedly failed to parse");
+    }
+    vector<vector<string_t> > argvs;
+    vector<parse_outcome_t<string_t> > expected;
+    for (size_t i=0; i < sizeof joined_argvs / sizeof *joined_argvs; i++) {
+        argvs.push_back(split_nonempty<string_t>(joined_argvs[i], ' '));
+        expected.push_back(parse_outcome(parser, argvs.back()));
+    }
+    
+    const size_t thread_count = 8;
+    concurrent_parse_job_t<string_t> jobs[thread_count];
+    pthread_t threads[thread_count];
+    for (size_t i=0; i < thread_count; i++) {
+        jobs[i].parser = &parser;
+        jobs[i].argvs = &argvs;
+        jobs[i].expected = &expected;
+        jobs[i].offset = i;
+        jobs[i].failures = 0;
+        pthread_create(&threads[i], NULL, run_concurrent_parse_job<string_t>, &jobs[i]);
+    }
+    for (size_t i=0; i < thread_count; i++) {
+        pthread_join(threads[i], NULL);
+        if (jobs[i].failures > 0) {
+            err("Concurrent parsing: thread %lu saw %lu results that differ from a single-threaded run", (unsigned long)i, (unsigned long)jobs[i].failures);
+        }
+    }
+}
+
+template<typename string_t>
+static void test_parse_batch()
+{
+    typedef typename argument_parser_t<string_t>::argument_map_t argument_map_t;
+    typedef typename argument_parser_t<string_t>::error_list_t error_list_t;
+    const char *joined_argvs[] = {
+        "prog --level 5 a.txt -v b.txt",
+        "prog a.txt",
+        "prog --bogus a.txt",
+        "prog",
+        "prog --level",
+        "prog -v -v c.txt",
+    };
+    argument_parser_t<string_t> parser(to_string<string_t>("Usage: prog [-v | --verbose] [--level=<num>] <file>...\n"
+                                                           "Options: --level=<num>  Level [default: 3]"), NULL);
+    
+    // Repeat the argvs so that there is enough work to steal
+    vector<vector<string_t> > argvs;
+    for (size_t i=0; i < 200; i++) {
+        argvs.push_back(split_nonempty<string_t>(joined_argvs[i % (sizeof joined_argvs / sizeof *joined_argvs)], ' '));
+    }
+    
+    const size_t thread_counts[] = {1, 3, 0};
+    for (size_t t=0; t < sizeof thread_counts / sizeof *thread_counts; t++) {
+        vector<error_list_t> errors;
+        vector<vector<size_t> > unused;
+        const vector<argument_map_t> results = parser.parse_batch(argvs, flag_generate_empty_args, &errors, &unused, thread_counts[t]);
+        if (results.size() != argvs.size() || errors.size() != argvs.size() || unused.size() != argvs.size()) {
+            err("Parse batch: wrong number of results with %lu threads", (unsigned long)thread_counts[t]);
+            continue;
+        }
+        for (size_t i=0; i < argvs.size(); i++) {
+            error_list_t expected_errors;
+            vector<size_t> expected_unused;
+            const argument_map_t expected = parser.parse_arguments(argvs.at(i), flag_generate_empty_args, &expected_errors, &expected_unused);
+            if (! arg_maps_equal(results.at(i), expected) || errors.at(i).size() != expected_errors.size() || unused.at(i) != expected_unused) {
+                err("Parse batch: result %lu with %lu threads differs from parse_arguments", (unsigned long)i, (unsigned long)thread_counts[t]);
+            }
+        }
+    }
+    
+    if (! parser.parse_batch(vector<vector<string_t> >(), flags_default).empty()) {
+        err("Parse batch: empty batch gave results");
+    }
+}
+
+template<typename string_t>
+static void test_compile_all()
+{
+    typedef typename argument_parser_t<string_t>::error_list_t error_list_t;
+    const char *usages[] = {
+        "Usage: prog [-v | --verbose] [--level=<num>] <file>...\nOptions: --level=<num>  Level [default: 3]",
+        "Usage: prog checkout <branch>\n       prog push [--force]",
+        "Usage: prog (foo",
+        "Usage: prog [options]\nOptions: -a, --all  Everything",
+    };
+    const size_t usage_count = sizeof usages / sizeof *usages;
+    vector<string_t> docs;
+    for (size_t i=0; i < 50; i++) {
+        docs.push_back(to_string<string_t>(usages[i % usage_count]));
+    }
+    const vector<string_t> argv = split_nonempty<string_t>("prog checkout --all -v a.txt", ' ');
+    
+    const size_t thread_counts[] = {1, 3, 0};
+    for (size_t t=0; t < sizeof thread_counts / sizeof *thread_counts; t++) {
+        vector<error_list_t> errors;
+        const vector<argument_parser_t<string_t> > parsers = argument_parser_t<string_t>::compile_all(docs, &errors, thread_counts[t]);
+        if (parsers.size() != docs.size() || errors.size() != docs.size()) {
+            err("Compile all: wrong number of parsers with %lu threads", (unsigned long)thread_counts[t]);
+            continue;
+        }
+        for (size_t i=0; i < docs.size(); i++) {
+            error_list_t expected_errors;
+            const argument_parser_t<string_t> expected(docs.at(i), &expected_errors);
+            if (errors.at(i).size() != expected_errors.size() ||
+                ! arg_maps_equal(parsers.at(i).parse_arguments(argv, flag_generate_empty_args), expected.parse_arguments(argv, flag_generate_empty_args))) {
+                err("Compile all: parser %lu with %lu threads differs from one constructed directly", (unsigned long)i, (unsigned long)thread_counts[t]);
+            }
+        }
+    }
+}
+
+/* Rewrites the first string in a compiled file's words that is the range (old_start, old_length) of the source to be (new_start, new_length), and updates the hash of the words to match. The header is a 48 byte compiled_header_t, with the word count at 20 and the hash of the words at 40. Returns false if there is no such string. */
+static bool retarget_compiled_string(const char *path, uint32_t old_start, uint32_t old_length, uint32_t new_start, uint32_t new_length) {
+    std::string bytes;
+    if (FILE *file = fopen(path, "rb")) {
+        char buff[4096];
+        size_t amt;
+        while ((amt = fread(buff, 1, sizeof buff, file)) > 0) {
+            bytes.append(buff, amt);
+        }
+        fclose(file);
+    }
+    if (bytes.size() < 48) {
+        return false;
+    }
+    uint32_t word_count;
+    memcpy(&word_count, &bytes[20], sizeof word_count);
+    std::vector<uint32_t> words(word_count);
+    memcpy(&words[0], &bytes[48], word_count * sizeof(uint32_t));
+    size_t idx = 0;
+    while (idx + 1 < words.size() && ! (words.at(idx) == old_start && words.at(idx + 1) == old_length)) {
+        idx++;
+    }
+    if (idx + 1 >= words.size()) {
+        return false;
+    }
+    words.at(idx) = new_start;
+    words.at(idx + 1) = new_length;
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i=0; i < words.size(); i++) {
+        hash = (hash ^ words.at(i)) * 1099511628211ULL;
+    }
+    memcpy(&bytes[48], &words[0], word_count * sizeof(uint32_t));
+    memcpy(&bytes[40], &hash, sizeof hash);
+    FILE *file = fopen(path, "wb");
+    if (! file) {
+        return false;
+    }
+    fwrite(bytes.data(), 1, bytes.size(), file);
+    fclose(file);
+    return true;
+}
+
+template<typename string_t>
+static void test_compiled_form()
+{
+    const char *usages[] = {
+        "Usage: prog [-v | --verbose] [--level=<num>] <file>...\n"
+        "       prog checkout <branch> [options]\n"
+        "Options: --level=<num>  Level [default: 3]\n"
+        "         -a, --all  Everything\n"
+        "Arguments: <branch>  git branch --list",
+        "Options: -a, --all  Everything",
+        "Usage: prog (foo",
+    };
+    const char *joined_argvs[] = {
+        "prog --level 5 a.txt -v b.txt",
+        "prog checkout master -a",
+        "prog --all",
+        "prog foo",
+        "prog --bogus",
+    };
+    char path[] = "/tmp/docopt_fish_test_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        err("Compiled form: could not create a temporary file");
+        return;
+    }
+    close(fd);
+    
+    for (size_t i=0; i < sizeof usages / sizeof *usages; i++) {
+        const string_t doc = to_string<string_t>(usages[i]);
+        const argument_parser_t<string_t> original(doc, NULL);
+        if (! original.save_compiled(path)) {
+            err("Compiled form: could not save usage %lu", (unsigned long)i);
+            continue;
+        }
+        
+        argument_parser_t<string_t> loaded;
+        if (! loaded.load_compiled(path, &doc)) {
+            err("Compiled form: could not load usage %lu", (unsigned long)i);
+            continue;
+        }
+        
+        // The loaded parser must behave the same, even once the file is gone
+        unlink(path);
+        for (size_t j=0; j < sizeof joined_argvs / sizeof *joined_argvs; j++) {
+            const vector<string_t> argv = split_nonempty<string_t>(joined_argvs[j], ' ');
+            vector<size_t> original_unused, loaded_unused;
+            if (! arg_maps_equal(loaded.parse_arguments(argv, flag_generate_empty_args, NULL, &loaded_unused), original.parse_arguments(argv, flag_generate_empty_args, NULL, &original_unused)) ||
+                loaded_unused != original_unused ||
+                loaded.suggest_next_argument(argv, flag_match_allow_incomplete) != original.suggest_next_argument(argv, flag_match_allow_incomplete)) {
+                err("Compiled form: loaded usage %lu parses argv %lu differently", (unsigned long)i, (unsigned long)j);
+            }
+        }
+        if (loaded.get_command_names() != original.get_command_names() ||
+            loaded.get_variables() != original.get_variables() ||
+            loaded.commands_for_variable(to_string<string_t>("<branch>")) != original.commands_for_variable(to_string<string_t>("<branch>")) ||
+            loaded.description_for_option(to_string<string_t>("-a")) != original.description_for_option(to_string<string_t>("-a"))) {
+            err("Compiled form: loaded usage %lu differs in its metadata", (unsigned long)i);
+        }
+    }
+    
+    // Large files are mapped rather than read, and must load the same way
+    std::string large_usage = "Usage: prog [options] <file>...\nOptions:\n";
+    for (size_t i=0; i < 2000; i++) {
+        char line[128];
+        snprintf(line, sizeof line, "    --option-%lu <VALUE>    Describes option %lu\n", (unsigned long)i, (unsigned long)i);
+        large_usage.append(line);
+    }
+    const string_t large_doc = to_string<string_t>(large_usage.c_str());
+    const argument_parser_t<string_t> large_original(large_doc, NULL);
+    argument_parser_t<string_t> large_loaded;
+    if (! large_original.save_compiled(path) || ! large_loaded.load_compiled(path, &large_doc)) {
+        err("Compiled form: could not save and load a large usage");
+    } else {
+        const vector<string_t> argv = split_nonempty<string_t>("prog --option-1999 x a.txt", ' ');
+        if (! arg_maps_equal(large_loaded.parse_arguments(argv, flag_generate_empty_args), large_original.parse_arguments(argv, flag_generate_empty_args)) ||
+            large_loaded.description_for_option(to_string<string_t>("--option-1000")) != large_original.description_for_option(to_string<string_t>("--option-1000"))) {
+            err("Compiled form: loaded large usage differs");
+        }
+    }
+    
+    // Stale, missing and mismatched files are rejected, leaving the parser alone
+    const string_t doc = to_string<string_t>(usages[0]);
+    const string_t other_doc = to_string<string_t>(usages[1]);
+    argument_parser_t<string_t> parser(doc, NULL);
+    parser.save_compiled(path);
+    if (parser.load_compiled(path, &other_doc)) {
+        err("Compiled form: stale file was accepted");
+    }
+    if (sizeof(typename string_t::value_type) == sizeof(char)) {
+        argument_parser_t<wstring> wide_parser;
+        if (wide_parser.load_compiled(path)) {
+            err("Compiled form: file was accepted for the wrong string type");
+        }
+    }
+    
+    // Corrupting any byte before the source, in the header, the encoded words or the padding, is detected
+    std::string compiled_bytes;
+    if (FILE *file = fopen(path, "rb")) {
+        char buff[4096];
+        size_t amt;
+        while ((amt = fread(buff, 1, sizeof buff, file)) > 0) {
+            compiled_bytes.append(buff, amt);
+        }
+        fclose(file);
+    }
+    const size_t words_end = compiled_bytes.size() - doc.size() * sizeof(typename string_t::value_type);
+    for (size_t i=0; i < words_end; i++) {
+        std::string corrupted = compiled_bytes;
+        corrupted.at(i) ^= 0x10;
+        if (FILE *file = fopen(path, "wb")) {
+            fwrite(corrupted.data(), 1, corrupted.size(), file);
+            fclose(file);
+        }
+        if (parser.load_compiled(path)) {
+            err("Compiled form: file corrupted at byte %lu was accepted", (unsigned long)i);
+            break;
+        }
+    }
+    
+    // So is corrupting the source
+    if (FILE *file = fopen(path, "wb")) {
+        fwrite(compiled_bytes.data(), 1, compiled_bytes.size(), file);
+        fclose(file);
+    }
+    if (FILE *file = fopen(path, "r+b")) {
+        fseek(file, -1, SEEK_END);
+        fputc('!', file);
+        fclose(file);
+    }
+    if (parser.load_compiled(path) || parser.load_compiled(path, &doc)) {
+        err("Compiled form: corrupted file was accepted");
+    }
+    
+    // A file whose words are intact, but whose usages or [options] name something that is not a result key, is rejected. The names are retargeted at text in a description.
+    const char *crafted_docs[] = {
+        "Usage: prog <file>\nArguments: <file>  Not <other>\n",
+        "Usage: prog [options]\nOptions: -a, --all  Not --none\n",
+    };
+    const char *retargeted_names[][2] = {
+        {"<file>", "<other>"},
+        {"--all", "--none"},
+    };
+    for (size_t i=0; i < sizeof crafted_docs / sizeof *crafted_docs; i++) {
+        const std::string crafted(crafted_docs[i]);
+        const string_t crafted_doc = to_string<string_t>(crafted_docs[i]);
+        const std::string from = retargeted_names[i][0], to = retargeted_names[i][1];
+        if (! argument_parser_t<string_t>(crafted_doc, NULL).save_compiled(path) ||
+            ! retarget_compiled_string(path, crafted.find(from), from.size(), crafted.find(to), to.size())) {
+            err("Compiled form: could not craft file %lu", (unsigned long)i);
+        } else if (parser.load_compiled(path, &crafted_doc)) {
+            err("Compiled form: file %lu naming something that is not a result key was accepted", (unsigned long)i);
+        }
+    }
+    unlink(path);
+    if (parser.load_compiled(path)) {
+        err("Compiled form: missing file was accepted");
+    }
+    if (parser.get_variables() != argument_parser_t<string_t>(doc, NULL).get_variables()) {
+        err("Compiled form: failed load modified the parser");
+    }
+}
+
+/* Shared by the threads of test_registry */
+template<typename string_t>
+struct registry_job_t {
+    argument_parser_registry_t<string_t> *registry;
+    const vector<string_t> *names;
+    size_t failures;
+};
+
+template<typename string_t>
+static void *run_registry_job(void *context)
+{
+    registry_job_t<string_t> *job = static_cast<registry_job_t<string_t> *>(context);
+    const vector<string_t> argv = split_nonempty<string_t>("prog a.txt", ' ');
+    for (size_t i=0; i < 500; i++) {
+        argument_parser_t<string_t> parser;
+        const string_t &name = job->names->at(i % job->names->size());
+        if (! job->registry->get(name, &parser) || parser.parse_arguments(argv, flags_default).size() != 1) {
+            job->failures++;
+        }
+    }
+    return NULL;
+}
+
+template<typename string_t>
+static void test_registry()
+{
+    const vector<string_t> argv = split_nonempty<string_t>("prog a.txt", ' ');
+    vector<string_t> names;
+    std::vector<docopt_fish::error_t> compile_errors;
+    const size_t parser_memory = argument_parser_t<string_t>(to_string<string_t>("Usage: prog <file>"), &compile_errors).memory_estimate();
+    argument_parser_registry_t<string_t> registry(parser_memory * 3);
+    for (size_t i=0; i < 40; i++) {
+        char name[32];
+        snprintf(name, sizeof name, "cmd%lu", (unsigned long)i);
+        names.push_back(to_string<string_t>(name));
+        registry.add(names.back(), to_string<string_t>("Usage: prog <file>"));
+    }
+    
+    argument_parser_t<string_t> parser;
+    if (registry.get(to_string<string_t>("bogus"), &parser)) {
+        err("Registry: unknown name was found");
+    }
+    if (registry.compiled_count() != 0) {
+        err("Registry: docs were compiled before use");
+    }
+    
+    // Parsers are compiled on use, evicted past the budget, and stay usable once evicted
+    vector<argument_parser_t<string_t> > parsers(names.size());
+    for (size_t i=0; i < names.size(); i++) {
+        if (! registry.get(names.at(i), &parsers.at(i))) {
+            err("Registry: name %lu was not found", (unsigned long)i);
+        }
+    }
+    if (registry.compiled_count() == 0 || registry.compiled_count() > 3 || registry.compiled_memory() == 0 || registry.compiled_memory() > parser_memory * 3) {
+        err("Registry: unexpected compiled count %lu", (unsigned long)registry.compiled_count());
+    }
+    for (size_t i=0; i < parsers.size(); i++) {
+        if (parsers.at(i).parse_arguments(argv, flags_default).size() != 1) {
+            err("Registry: evicted parser %lu no longer parses", (unsigned long)i);
+        }
+    }
+    
+    // Replacing a doc takes effect on the next lookup, and reports its errors
+    std::vector<docopt_fish::error_t> errors;
+    registry.add(names.at(0), to_string<string_t>("Usage: prog (<file>"));
+    if (! registry.get(names.at(0), &parser, &errors) || errors.empty()) {
+        err("Registry: replaced doc did not report its errors");
+    }
+    if (! registry.remove(names.at(0)) || registry.remove(names.at(0)) || registry.get(names.at(0), &parser)) {
+        err("Registry: remove did not remove");
+    }
+    names.erase(names.begin());
+    
+    // Look up names from several threads at once
+    const size_t thread_count = 4;
+    registry_job_t<string_t> jobs[thread_count];
+    pthread_t threads[thread_count];
+    for (size_t i=0; i < thread_count; i++) {
+        jobs[i].registry = &registry;
+        jobs[i].names = &names;
+        jobs[i].failures = 0;
+        pthread_create(&threads[i], NULL, run_registry_job<string_t>, &jobs[i]);
+    }
+    for (size_t i=0; i < thread_count; i++) {
+        pthread_join(threads[i], NULL);
+        if (jobs[i].failures > 0) {
+            err("Registry: %lu concurrent lookups failed", (unsigned long)jobs[i].failures);
+        }
+    }
+    
+    // A parser larger than the whole budget is returned but not kept
+    argument_parser_registry_t<string_t> cramped(0);
+    cramped.add(names.at(0), to_string<string_t>("Usage: prog <file>"));
+    if (! cramped.get(names.at(0), &parser) || parser.parse_arguments(argv, flags_default).size() != 1 || cramped.compiled_count() != 0 || cramped.compiled_memory() != 0) {
+        err("Registry: parser over the whole budget was kept");
+    }
+    
+    // With a generous budget, nothing is evicted
+    argument_parser_registry_t<string_t> roomy(1 << 30);
+    for (size_t i=0; i < names.size(); i++) {
+        roomy.add(names.at(i), to_string<string_t>("Usage: prog <file>"));
+        roomy.get(names.at(i), &parser);
+    }
+    if (roomy.compiled_count() != names.size()) {
+        err("Registry: parsers were evicted within budget");
+    }
+}
+
+/* Runs the first queries of a lazily compiled parser from several threads */
+template<typename string_t>
+struct lazy_parser_job_t {
+    const argument_parser_t<string_t> *parser;
+    typename argument_parser_t<string_t>::argument_map_t expected;
+    vector<string_t> argv;
+    bool failed;
+};
+
+template<typename string_t>
+static void *run_lazy_parser_job(void *context)
+{
+    lazy_parser_job_t<string_t> *job = static_cast<lazy_parser_job_t<string_t> *>(context);
+    job->failed = ! arg_maps_equal(job->parser->parse_arguments(job->argv, flag_generate_empty_args), job->expected);
+    return NULL;
+}
+
+template<typename string_t>
+static void test_lazy_compilation()
+{
+    const char *usages[] = {
+        "Usage: prog [-v | --verbose] [--level=<num>] <file>...\n"
+        "       other checkout <branch> [options]\n"
+        "       prog push\n"
+        "Options: --level=<num>  Level [default: 3]\n"
+        "         -a, --all  Everything\n"
+        "Arguments: <branch>  git branch --list",
+        "Options: -a, --all  Everything",
+        "Usage: prog (foo\n"
+        "   ; what",
+    };
+    const vector<string_t> argv = split_nonempty<string_t>("prog --level 5 a.txt -v b.txt", ' ');
+    for (size_t i=0; i < sizeof usages / sizeof *usages; i++) {
+        const string_t doc = to_string<string_t>(usages[i]);
+        std::vector<docopt_fish::error_t> errors;
+        const argument_parser_t<string_t> eager(doc, &errors);
+        
+        // Command names come from classifying lines alone
+        const argument_parser_t<string_t> lazy(doc, NULL);
+        const size_t classified_memory = lazy.memory_estimate();
+        if (lazy.get_command_names() != eager.get_command_names()) {
+            err("Lazy compilation: usage %lu has different command names", (unsigned long)i);
+        }
+        if (i == 0 && lazy.memory_estimate() != classified_memory) {
+            err("Lazy compilation: usage %lu compiled usages for command names", (unsigned long)i);
+        }
+        if (lazy.commands_for_variable(to_string<string_t>("<branch>")) != eager.commands_for_variable(to_string<string_t>("<branch>"))) {
+            err("Lazy compilation: usage %lu has different variable commands", (unsigned long)i);
+        }
+        
+        // The first parse compiles the rest
+        if (! arg_maps_equal(lazy.parse_arguments(argv, flag_generate_empty_args), eager.parse_arguments(argv, flag_generate_empty_args)) ||
+            lazy.get_variables() != eager.get_variables() ||
+            lazy.description_for_option(to_string<string_t>("--all")) != eager.description_for_option(to_string<string_t>("--all"))) {
+            err("Lazy compilation: usage %lu behaves differently once compiled", (unsigned long)i);
+        }
+        if (lazy.memory_estimate() <= classified_memory) {
+            err("Lazy compilation: usage %lu did not grow when compiled", (unsigned long)i);
+        }
+        
+        // Several threads may race to be the first to compile
+        const argument_parser_t<string_t> racy(doc, NULL);
+        const size_t thread_count = 4;
+        lazy_parser_job_t<string_t> jobs[thread_count];
+        pthread_t threads[thread_count];
+        for (size_t j=0; j < thread_count; j++) {
+            jobs[j].parser = &racy;
+            jobs[j].expected = eager.parse_arguments(argv, flag_generate_empty_args);
+            jobs[j].argv = argv;
+            pthread_create(&threads[j], NULL, run_lazy_parser_job<string_t>, &jobs[j]);
+        }
+        for (size_t j=0; j < thread_count; j++) {
+            pthread_join(threads[j], NULL);
+            if (jobs[j].failed) {
+                err("Lazy compilation: usage %lu compiled differently when raced", (unsigned long)i);
+            }
+        }
+    }
+}
+
+template<typename string_t>
+static bool errors_equal(const std::vector<docopt_fish::error_t> &lhs, const std::vector<docopt_fish::error_t> &rhs) {
+    if (lhs.size() != rhs.size()) {
+        return false;
+    }
+    for (size_t i=0; i < lhs.size(); i++) {
+        if (lhs.at(i).code != rhs.at(i).code || lhs.at(i).location != rhs.at(i).location) {
+            return false;
+        }
+    }
+    return true;
+}
+
+template<typename string_t>
+static void test_apply_edit()
+{
+    const char *usage =
+        "Usage: prog [-v | --verbose] [--level=<num>] <file>...\n"
+        "       other checkout <branch> [options]\n"
+        "       prog (broken\n"
+        "       prog push\n"
+        "Options: --level=<num>  Level [default: 3]\n"
+        "         -a, --all  Everything\n"
+        "         --all  Again\n"
+        "Arguments: <branch>  git branch --list\n";
+    
+    /* Each edit is applied to the result of the previous ones. The edit is at the anchor, or at the end if it is NULL. */
+    const struct {
+        const char *anchor;
+        size_t removed_length;
+        const char *inserted;
+    } edits[] = {
+        {"Everything", 10, "All of them"},
+        {"       prog push", 0, "       prog pull -a\n"},
+        {"       prog push\n", 17, ""},
+        {"Usage:", 0, "Exposition\n\n"},
+        {"<branch>  git", 0, "<file>  ls\n           "},
+        {"Arguments:", 0, "Options: -x  Extra\n"},
+        {"[-v", 1, "("},
+        {"(-v", 1, "["},
+        {NULL, 0, "         --new  Added\n"},
+        {"Usage:", 0, "  "},
+        {"Exposition", 10, "Usage: prog new"},
+        {"         --all  Again\n", 22, ""},
+        {"Level", 5, "Detail level"},
+        {"default: 3", 10, "default: 42"},
+        {"--list", 6, "--all"},
+        {"--new  Added", 5, "--newer"},
+        {NULL, 0, "Notes: some prose\n"},
+        {"prose", 5, "text"},
+    };
+    const char *argvs[] = {
+        "prog --level 5 a.txt -v b.txt",
+        "other checkout main -a",
+        "prog pull --all",
+        "prog new",
+    };
+    
+    string_t doc = to_string<string_t>(usage);
+    argument_parser_t<string_t> edited(doc, NULL);
+    const argument_parser_t<string_t> original = edited;
+    for (size_t i=0; i < sizeof edits / sizeof *edits; i++) {
+        const size_t offset = edits[i].anchor ? doc.find(to_string<string_t>(edits[i].anchor)) : doc.size();
+        const string_t inserted = to_string<string_t>(edits[i].inserted);
+        if (offset == string_t::npos) {
+            err("Edit %lu: anchor not found", (unsigned long)i);
+            continue;
+        }
+        doc.replace(offset, edits[i].removed_length, inserted);
+        
+        std::vector<docopt_fish::error_t> edited_errors, expected_errors;
+        if (! edited.apply_edit(offset, edits[i].removed_length, inserted, &edited_errors)) {
+            err("Edit %lu: failed to apply", (unsigned long)i);
+        }
+        const argument_parser_t<string_t> expected(doc, &expected_errors);
+        if (! errors_equal<string_t>(edited_errors, expected_errors)) {
+            err("Edit %lu: errors differ from compiling the edited doc", (unsigned long)i);
+        }
+        for (size_t j=0; j < sizeof argvs / sizeof *argvs; j++) {
+            const vector<string_t> argv = split_nonempty<string_t>(argvs[j], ' ');
+            if (! arg_maps_equal(edited.parse_arguments(argv, flag_generate_empty_args), expected.parse_arguments(argv, flag_generate_empty_args))) {
+                err("Edit %lu: argv %lu parses differently from compiling the edited doc", (unsigned long)i, (unsigned long)j);
+            }
+        }
+        if (edited.get_command_names() != expected.get_command_names() ||
+            edited.get_variables() != expected.get_variables() ||
+            edited.description_for_option(to_string<string_t>("--all")) != expected.description_for_option(to_string<string_t>("--all")) ||
+            edited.description_for_option(to_string<string_t>("--level")) != expected.description_for_option(to_string<string_t>("--level")) ||
+            edited.commands_for_variable(to_string<string_t>("<file>")) != expected.commands_for_variable(to_string<string_t>("<file>"))) {
+            err("Edit %lu: queries differ from compiling the edited doc", (unsigned long)i);
+        }
+    }
+    
+    // Copies keep the doc as it was
+    if (original.description_for_option(to_string<string_t>("--all")) != to_string<string_t>("Everything")) {
+        err("Edit changed a copy of the parser");
+    }
+    
+    // Ranges out of bounds are rejected
+    argument_parser_t<string_t> empty;
+    if (empty.apply_edit(0, 0, doc, NULL) || edited.apply_edit(doc.size() + 1, 0, doc, NULL) || edited.apply_edit(doc.size(), 1, doc, NULL)) {
+        err("Edit out of bounds was applied");
+    }
+}
+
+template<typename string_t>
+static void test_complexity_analysis()
+{
+    const struct {
+        const char *usage;
+        size_t optional_depth;
+        size_t ellipsis_depth;
+        size_t degree;
+        bool exponential;
+        double max_live_states;
+        const char *hotspot; // text at the start of the only hotspot, if any
+    } tests[] = {
+        {"Usage: prog <file>", 0, 0, 0, false, 1, NULL},
+        {"Usage: prog [-a] [-b] <file>...", 1, 1, 1, false, 64, NULL},
+        {"Usage: prog <src>... <dst>...\n       prog checkout", 0, 1, 2, false, 257, NULL},
+        {"Usage: prog [[[-a] -b] -c]", 3, 0, 0, false, 4, NULL},
+        {"Usage: prog [(<a> | <b>)...]", 1, 1, 0, true, 131071, "(<a>"},
+        {"Usage: prog [-a] [-b] [-c] [-d] [-e] [-f] [-g] [-h] [-i] [-j] [-k] [-l] [-m]", 1, 0, 0, false, 8192, "prog"},
+        {"Options: -a", 0, 0, 0, false, 1, NULL},
+    };
+    for (size_t i=0; i < sizeof tests / sizeof *tests; i++) {
+        const string_t doc = to_string<string_t>(tests[i].usage);
+        const argument_parser_t<string_t> parser(doc, NULL);
+        const complexity_report_t report = parser.analyze_complexity(16);
+        if (report.max_optional_depth != tests[i].optional_depth || report.max_ellipsis_depth != tests[i].ellipsis_depth) {
+            err("Complexity analysis: usage %lu has depths %lu and %lu", (unsigned long)i, (unsigned long)report.max_optional_depth, (unsigned long)report.max_ellipsis_depth);
+        }
+        if (report.degree != tests[i].degree || report.exponential != tests[i].exponential) {
+            err("Complexity analysis: usage %lu has degree %lu, exponential %d", (unsigned long)i, (unsigned long)report.degree, (int)report.exponential);
+        }
+        if (report.argv_length != 16 || report.max_live_states != tests[i].max_live_states) {
+            err("Complexity analysis: usage %lu has bound %f", (unsigned long)i, report.max_live_states);
+        }
+        if (report.likely_to_explode != (tests[i].hotspot != NULL)) {
+            err("Complexity analysis: usage %lu is wrongly flagged", (unsigned long)i);
+        }
+        const size_t expected_hotspots = tests[i].hotspot ? 1 : 0;
+        if (report.hotspots.size() != expected_hotspots) {
+            err("Complexity analysis: usage %lu has %lu hotspots", (unsigned long)i, (unsigned long)report.hotspots.size());
+        } else if (expected_hotspots && report.hotspots.at(0).location != doc.find(to_string<string_t>(tests[i].hotspot))) {
+            err("Complexity analysis: usage %lu has a hotspot in the wrong place", (unsigned long)i);
+        }
+    }
+    
+    // Bounds grow with the argv length
+    const argument_parser_t<string_t> parser(to_string<string_t>("Usage: prog <src>... <dst>"), NULL);
+    if (parser.analyze_complexity(4).max_live_states != 4 || parser.analyze_complexity(100).max_live_states != 100) {
+        err("Complexity analysis: bound does not follow the argv length");
+    }
+    if (argument_parser_t<string_t>().analyze_complexity().max_live_states != 0) {
+        err("Complexity analysis: parser without a doc has a bound");
+    }
+}
+
+template<typename string_t>
+static void test_match_budget()
+{
+    // Every optional clause doubles the states
+    const string_t doc = to_string<string_t>("Usage: prog [-a] [-b] [-c] [-d] [-e] [-f] [-g] [-h] [-i] [-j] [-k] [-l] <file>\n"
+                                             "       prog checkout <branch>");
+    const argument_parser_t<string_t> parser(doc, NULL);
+    const vector<string_t> argv = split_nonempty<string_t>("prog -a -b -c -d -e -f -g -h -i -j -k -l file.txt", ' ');
+    
+    // Unlimited budgets still count
+    match_budget_t unlimited;
+    const typename argument_parser_t<string_t>::argument_map_t expected = parser.parse_arguments(argv, flags_default, NULL, NULL, &unlimited);
+    if (unlimited.truncated || unlimited.states_created < 4096) {
+        err("Match budget: unlimited budget counted %lu states", (unsigned long)unlimited.states_created);
+    }
+    
+    // A generous budget changes nothing
+    match_budget_t generous(unlimited.states_created);
+    if (! arg_maps_equal(parser.parse_arguments(argv, flags_default, NULL, NULL, &generous), expected) || generous.truncated) {
+        err("Match budget: generous budget changed the result");
+    }
+    
+    // A small budget stops early, with a best effort result
+    match_budget_t small(100);
+    std::vector<size_t> unused;
+    const typename argument_parser_t<string_t>::argument_map_t truncated = parser.parse_arguments(argv, flags_default, NULL, &unused, &small);
+    if (! small.truncated || small.states_created > 200) {
+        err("Match budget: small budget created %lu states", (unsigned long)small.states_created);
+    }
+    if (truncated.empty() || unused.size() == argv.size()) {
+        err("Match budget: truncated result is empty");
+    }
+    
+    // Other queries take budgets too, and each query resets the counts
+    small.truncated = false;
+    const std::vector<argument_status_t> statuses = parser.validate_arguments(argv, flags_default, &small);
+    if (! small.truncated || small.states_created > 200 || statuses.at(0) != status_valid) {
+        err("Match budget: validation was not limited");
+    }
+    small.states_created = 0;
+    parser.suggest_next_argument(argv, flags_default, &small);
+    if (! small.truncated || small.states_created > 200) {
+        err("Match budget: suggestion was not limited");
+    }
+    
+    // Small docs fit easily
+    match_budget_t tiny(20);
+    const argument_parser_t<string_t> simple(to_string<string_t>("Usage: prog checkout <branch>"), NULL);
+    if (simple.validate_arguments(split_nonempty<string_t>("prog checkout main", ' '), flags_default, &tiny) != std::vector<argument_status_t>(3, status_valid) || tiny.truncated) {
+        err("Match budget: simple doc was truncated");
+    }
+}
+
+/* A query cut short by the budget finishes its states as incomplete matches, so it claims no more than an incomplete match of the whole doc */
+template<typename string_t>
+static void test_truncated_incomplete_match()
+{
+    typedef argument_parser_t<string_t> parser_t;
+    const parser_t parser(to_string<string_t>("Usage: prog [-a] [-b] [-c] [-d] [-e] [-f] [-g] [-h] [-i] [-j] [-k] [-l] <file> <other>\n"), NULL);
+    const vector<string_t> argv = split_nonempty<string_t>("prog -a -b -c -d -e -f -g -h -i -j -k -l", ' ');
+    
+    // Without the positionals, nothing matches
+    std::vector<size_t> unused;
+    if (! parser.parse_arguments(argv, flags_default, NULL, &unused).empty() || unused.size() != argv.size()) {
+        err("Truncated match: required positionals were not required");
+    }
+    const std::vector<argument_status_t> incomplete_statuses = parser.validate_arguments(argv, flag_match_allow_incomplete);
+    const typename parser_t::argument_map_t incomplete = parser.parse_arguments(argv, flag_match_allow_incomplete, NULL, NULL);
+    
+    // A small budget gives what an incomplete match gives, with or without flag_match_allow_incomplete
+    const parse_flags_t flag_sets[] = {flags_default, flag_match_allow_incomplete};
+    for (size_t i=0; i < sizeof flag_sets / sizeof *flag_sets; i++) {
+        match_budget_t small(100);
+        const typename parser_t::argument_map_t truncated = parser.parse_arguments(argv, flag_sets[i], NULL, NULL, &small);
+        if (! small.truncated) {
+            err("Truncated match: small budget was not truncated");
+        }
+        if (! arg_maps_equal(truncated, incomplete)) {
+            err("Truncated match: truncated result differs from the incomplete match, with flags %u", (unsigned)flag_sets[i]);
+        }
+        const std::vector<argument_status_t> statuses = parser.validate_arguments(argv, flag_sets[i], &small);
+        if (! small.truncated || statuses != incomplete_statuses) {
+            err("Truncated match: truncated validation differs from the incomplete match, with flags %u", (unsigned)flag_sets[i]);
+        }
+    }
+    
+    // A match found before the budget ran out beats the states that were cut short, even if they used more arguments
+    const parser_t commands(to_string<string_t>("Usage: prog <file> <other>\n"
+                                                 "       prog [-a] [-b] [-c] [-d] [-e] [-f] [-g] [-h] [-i] [-j] [-k] [-l] <file> <other>\n"), NULL);
+    const vector<string_t> files = split_nonempty<string_t>("prog x y -a -b -c -d -e -f -g -h -i -j -k -l", ' ');
+    match_budget_t budget(30);
+    std::vector<argument_status_t> expected(files.size(), status_invalid);
+    expected.at(0) = expected.at(1) = expected.at(2) = status_valid;
+    if (commands.validate_arguments(files, flags_default, &budget) != expected || ! budget.truncated) {
+        err("Truncated match: a complete match did not win over truncated states");
+    }
+}
+
+template<typename string_t>
+static void test_async_queries()
+{
+    typedef argument_parser_t<string_t> parser_t;
+    const parser_t simple(to_string<string_t>("Usage: prog checkout <branch>\n       prog push [--force]"), NULL);
+    const vector<string_t> simple_argv = split_nonempty<string_t>("prog push", ' ');
+    
+    // Results match the synchronous queries
+    typename parser_t::async_validation_t validation;
+    typename parser_t::async_suggestion_t suggestion;
+    if (validation.is_ready() || ! validation.wait().empty()) {
+        err("Async queries: handle that was never started has a result");
+    }
+    simple.validate_arguments_async(simple_argv, flags_default, match_budget_t(), &validation);
+    simple.suggest_next_argument_async(simple_argv, flags_default, match_budget_t(), &suggestion);
+    if (validation.wait() != simple.validate_arguments(simple_argv, flags_default) || ! validation.is_ready() || validation.budget().truncated) {
+        err("Async queries: validation differs from synchronous validation");
+    }
+    if (suggestion.wait() != simple.suggest_next_argument(simple_argv, flags_default)) {
+        err("Async queries: suggestion differs from synchronous suggestion");
+    }
+    
+    // A doc whose matching is slow: every optional clause doubles the states
+    const parser_t slow(to_string<string_t>("Usage: prog [-a] [-b] [-c] [-d] [-e] [-f] [-g] [-h] [-i] [-j] [-k] [-l] [-m] [-n] [-o] [-p] <file>"), NULL);
+    const vector<string_t> slow_argv = split_nonempty<string_t>("prog -a -b -c -d -e -f -g -h -i -j -k -l -m -n -o -p file", ' ');
+    
+    // A cancelled budget stops at once, and so does a past deadline
+    match_budget_t cancelled;
+    cancelled.cancel();
+    slow.validate_arguments_async(slow_argv, flags_default, cancelled, &validation);
+    if (validation.wait().size() != slow_argv.size() || ! validation.budget().truncated || validation.budget().timed_out) {
+        err("Async queries: cancelled query was not truncated");
+    }
+    match_budget_t expired;
+    expired.set_timeout(0);
+    slow.suggest_next_argument(slow_argv, flags_default, &expired);
+    if (! expired.truncated || ! expired.timed_out || expired.states_created > 100) {
+        err("Async queries: query past its deadline was not truncated");
+    }
+    
+    // Cancelling through the handle stops a running query
+    slow.validate_arguments_async(slow_argv, flags_default, match_budget_t(), &validation);
+    validation.cancel();
+    validation.wait();
+    if (! validation.budget().is_cancelled()) {
+        err("Async queries: handle did not cancel its query");
+    }
+    
+    // Restarting a handle, or destroying it, cancels what it was running
+    {
+        typename parser_t::async_suggestion_t abandoned;
+        slow.suggest_next_argument_async(slow_argv, flags_default, match_budget_t(), &suggestion);
+        slow.suggest_next_argument_async(slow_argv, flags_default, match_budget_t(), &abandoned);
+    }
+    simple.suggest_next_argument_async(simple_argv, flags_default, match_budget_t(), &suggestion);
+    if (suggestion.wait() != simple.suggest_next_argument(simple_argv, flags_default)) {
+        err("Async queries: restarted handle has the wrong result");
+    }
+}
+
+/* Checks that a session (using flag_match_allow_incomplete) agrees with the parser's queries on the session's argv */
+template<typename string_t>
+static void check_argv_session(const argument_parser_t<string_t> &parser, base_argv_session_t<string_t> *session, const char *step) {
+    vector<string_t> argv;
+    for (size_t i=0; i < session->size(); i++) {
+        argv.push_back(session->at(i));
+    }
+    if (session->validate() != parser.validate_arguments(argv, flag_match_allow_incomplete)) {
+        err("Argv session: validation differs after %s, argv '%ls'", step, wide(join(argv, " ")));
+    }
+    if (session->suggest() != parser.suggest_next_argument(argv, flag_match_allow_incomplete)) {
+        err("Argv session: suggestion differs after %s, argv '%ls'", step, wide(join(argv, " ")));
+    }
+}
+
+template<typename string_t>
+static void test_argv_session()
+{
+    typedef argument_parser_t<string_t> parser_t;
+    const char *doc =
+        "Usage: prog checkout [-v] [--force] <branch>\n"
+        "       prog push [options] [--] <remote> <file>...\n"
+        "Options: -v, --verbose  Be loud\n"
+        "         -o, --out <path>  Output file\n"
+        "         -f, --force  Force\n"
+        "         -std=<level>  Standard\n";
+    parser_t parser(to_string<string_t>(doc), NULL);
+    const vector<string_t> tokens = split_nonempty<string_t>("prog push -vo out --out=x -std c99 --out -- -f origin a b", ' ');
+    
+    typename parser_t::argv_session_t session(parser, flag_match_allow_incomplete);
+    check_argv_session(parser, &session, "construction");
+    
+    // Type the whole line, one argument at a time, then delete it again
+    for (size_t i=0; i < tokens.size(); i++) {
+        session.push(tokens.at(i));
+        check_argv_session(parser, &session, "push");
+        
+        // Querying again uses the cached results
+        check_argv_session(parser, &session, "push and query again");
+    }
+    while (session.size() > 0) {
+        session.pop();
+        check_argv_session(parser, &session, "pop");
+    }
+    session.pop();
+    check_argv_session(parser, &session, "popping nothing");
+    
+    // Retype a different ending after an option that wanted a value
+    const vector<string_t> prefix = split_nonempty<string_t>("prog push --out", ' ');
+    for (size_t i=0; i < prefix.size(); i++) {
+        session.push(prefix.at(i));
+    }
+    check_argv_session(parser, &session, "retyping");
+    session.pop();
+    session.push(to_string<string_t>("-o"));
+    check_argv_session(parser, &session, "replacing the option");
+    session.push(to_string<string_t>("path"));
+    session.push(to_string<string_t>("origin"));
+    check_argv_session(parser, &session, "giving the value");
+    
+    // The session keeps the parser it was made with
+    parser.set_doc(to_string<string_t>("Usage: prog other"), NULL);
+    session.clear();
+    if (session.size() != 0) {
+        err("Argv session: clear left %lu arguments", (unsigned long)session.size());
+    }
+    session.push(to_string<string_t>("prog"));
+    session.push(to_string<string_t>("checkout"));
+    vector<string_t> suggestions = session.suggest();
+    if (std::find(suggestions.begin(), suggestions.end(), to_string<string_t>("<branch>")) == suggestions.end()) {
+        err("Argv session: session did not keep its parser");
+    }
+    
+    // A truncated result is not cached
+    match_budget_t tight;
+    tight.max_states = 1;
+    session.push(to_string<string_t>("-v"));
+    session.validate(&tight);
+    if (! tight.truncated) {
+        err("Argv session: tight budget was not truncated");
+    }
+    const parser_t original(to_string<string_t>(doc), NULL);
+    check_argv_session(original, &session, "a truncated query");
+    
+    // A session without a doc has nothing valid to say
+    typename parser_t::argv_session_t empty(parser_t(), flag_match_allow_incomplete);
+    empty.push(to_string<string_t>("prog"));
+    if (empty.validate().size() != 1 || empty.validate().at(0) != status_invalid || ! empty.suggest().empty()) {
+        err("Argv session: session without a doc gave results");
+    }
+}
+
+/* Sessions only match again the usages that looked at what changed */
+template<typename string_t>
+static void test_argv_session_reuse()
+{
+    typedef argument_parser_t<string_t> parser_t;
+    std::string doc = "Usage:\n";
+    for (size_t i=0; i < 20; i++) {
+        char line[64];
+        snprintf(line, sizeof line, "    prog [options] cmd%lu <a> [<b>]\n", (unsigned long)i);
+        doc.append(line);
+    }
+    doc.append("Options: -v, --verbose  Be loud\n"
+               "         -q, --quiet  Be quiet\n"
+               "         -o <path>  Output file\n");
+    const parser_t parser(to_string<string_t>(doc.c_str()), NULL);
+    typename parser_t::argv_session_t session(parser, flag_match_allow_incomplete);
+    
+    const vector<string_t> tokens = split_nonempty<string_t>("prog cmd17 x -v y", ' ');
+    vector<string_t> argv;
+    for (size_t i=0; i < tokens.size(); i++) {
+        session.push(tokens.at(i));
+        argv.push_back(tokens.at(i));
+        check_argv_session(parser, &session, "push");
+        if (i < 2) {
+            continue;
+        }
+        
+        // Once the command is typed, the other usages are not matched again
+        session.pop();
+        session.validate();
+        session.suggest();
+        session.push(tokens.at(i));
+        match_budget_t fresh, reused;
+        parser.validate_arguments(argv, flag_match_allow_incomplete, &fresh);
+        session.validate(&reused);
+        bool option_changed = (tokens.at(i) == to_string<string_t>("-v"));
+        if (! option_changed && reused.states_created * 2 > fresh.states_created) {
+            err("Argv session reuse: validating after a push created %lu states, against %lu fresh", (unsigned long)reused.states_created, (unsigned long)fresh.states_created);
+        }
+        parser.suggest_next_argument(argv, flag_match_allow_incomplete, &fresh);
+        session.suggest(&reused);
+        if (! option_changed && reused.states_created * 2 > fresh.states_created) {
+            err("Argv session reuse: suggesting after a push created %lu states, against %lu fresh", (unsigned long)reused.states_created, (unsigned long)fresh.states_created);
+        }
+        check_argv_session(parser, &session, "push after querying");
+    }
+    
+    // Changing the command matches every usage again
+    session.assign(split_nonempty<string_t>("prog cmd3 x", ' '), 1);
+    check_argv_session(parser, &session, "changing the command");
+    session.assign(split_nonempty<string_t>("prog cmd3 -v x", ' '), 2);
+    check_argv_session(parser, &session, "inserting an option");
+    session.assign(split_nonempty<string_t>("prog cmd3 --verbose x y", ' '), 2);
+    check_argv_session(parser, &session, "replacing an option");
+}
+
+template<typename string_t>
+static void test_edited_revalidation()
+{
+    typedef argument_parser_t<string_t> parser_t;
+    const parser_t parser(to_string<string_t>(
+        "Usage: prog [options] <file>...\n"
+        "Options: -v, --verbose  Be loud\n"
+        "         -o, --out <path>  Output file\n"
+        "         -j <jobs>  Jobs\n"), NULL);
+    typename parser_t::argv_session_t previous(parser, flags_default);
+    
+    // Each edit gives the first changed index and the argv after the edit
+    const struct {
+        size_t first_changed;
+        const char *argv;
+    } edits[] = {
+        {0, "prog -v a.c -o out b.c -j 4 c.c"},
+        {3, "prog -v a.c --out out b.c -j 4 c.c"},
+        {4, "prog -v a.c --out -j 4 c.c"},
+        {2, "prog -v -- a.c --out -j 4 c.c"},
+        {2, "prog -v a.c --out -j 4 c.c"},
+        {6, "prog -v a.c --out -j 4 c.c"},
+        {5, "prog -v a.c --out -j"},
+        {1, "prog --bogus -v a.c --out -j"},
+        {1, "prog"},
+        {1, "prog -vj 8 a.c"},
+    };
+    for (size_t i=0; i < sizeof edits / sizeof *edits; i++) {
+        const vector<string_t> argv = split_nonempty<string_t>(edits[i].argv, ' ');
+        if (parser.validate_arguments(argv, &previous, edits[i].first_changed) != parser.validate_arguments(argv, flags_default)) {
+            err("Edited revalidation: wrong result for edit %lu, '%s'", (unsigned long)i, edits[i].argv);
+        }
+        if (previous.size() != argv.size() || previous.at(argv.size() - 1) != argv.back()) {
+            err("Edited revalidation: session does not hold the edited argv for edit %lu", (unsigned long)i);
+        }
+    }
+    
+    // A session from another parser, or no session, is rejected, and the session is left alone
+    const parser_t other(to_string<string_t>("Usage: prog <file>"), NULL);
+    typename parser_t::argv_session_t foreign(other, flags_default);
+    const vector<string_t> foreign_argv = split_nonempty<string_t>("prog a.c", ' ');
+    foreign.assign(foreign_argv);
+    const std::vector<argument_status_t> all_invalid(foreign_argv.size(), status_invalid);
+    if (parser.validate_arguments(foreign_argv, &foreign, foreign_argv.size()) != all_invalid) {
+        err("Edited revalidation: session from another parser was not rejected");
+    }
+    if (foreign.size() != foreign_argv.size() || foreign.validate() != other.validate_arguments(foreign_argv, flags_default)) {
+        err("Edited revalidation: rejected session was changed");
+    }
+    typename parser_t::argv_session_t *missing = NULL;
+    if (parser.validate_arguments(foreign_argv, missing, 0) != all_invalid) {
+        err("Edited revalidation: missing session was not rejected");
+    }
+    
+    // Typing a positional only matches again the usages that looked at it
+    const parser_t commands(to_string<string_t>(
+        "Usage: prog [options] clean <dir>...\n"
+        "       prog [options] build <target>\n"
+        "Options: -v, --verbose  Be loud\n"
+        "         -j <jobs>  Jobs\n"), NULL);
+    typename parser_t::argv_session_t typing(commands, flags_default);
+    const vector<string_t> typed = split_nonempty<string_t>("prog -v build all", ' ');
+    commands.validate_arguments(vector<string_t>(typed.begin(), typed.end() - 1), &typing, 0);
+    match_budget_t fresh, reused;
+    commands.validate_arguments(typed, flags_default, &fresh);
+    if (commands.validate_arguments(typed, &typing, typed.size() - 1, &reused) != commands.validate_arguments(typed, flags_default)) {
+        err("Edited revalidation: wrong result after typing a positional");
+    }
+    if (reused.states_created >= fresh.states_created) {
+        err("Edited revalidation: typing a positional created %lu states, against %lu fresh", (unsigned long)reused.states_created, (unsigned long)fresh.states_created);
+    }
+}
+
+template<typename string_t>
+static void test_prefix_suggestions()
+{
+    typedef argument_parser_t<string_t> parser_t;
+    const parser_t parser(to_string<string_t>(
+        "Usage: prog checkout [options] <branch>\n"
+        "       prog cherry-pick [--edit] <commit>\n"
+        "       prog push [--force] <remote>\n"
+        "Options: -v, --verbose  Be loud\n"
+        "         -q, --quiet  Be quiet\n"
+        "         --version  Show the version\n"
+        "         -o, --out <path>  Output file\n"), NULL);
+    const char *const argvs[] = {"prog", "prog checkout", "prog checkout -v", "prog checkout --out", "prog cherry-pick"};
+    const char *const partials[] = {"", "-", "--", "--ver", "-v", "ch", "che", "push", "x", "<"};
+    for (size_t i=0; i < sizeof argvs / sizeof *argvs; i++) {
+        const vector<string_t> argv = split_nonempty<string_t>(argvs[i], ' ');
+        const vector<string_t> all = parser.suggest_next_argument(argv, flag_match_allow_incomplete);
+        for (size_t j=0; j < sizeof partials / sizeof *partials; j++) {
+            // Expect what filtering all suggestions would give, keeping variables
+            const string_t partial = to_string<string_t>(partials[j]);
+            vector<string_t> expected;
+            for (size_t k=0; k < all.size(); k++) {
+                const string_t &sugg = all.at(k);
+                if (sugg.compare(0, partial.size(), partial) == 0 || sugg.at(0) == '<') {
+                    expected.push_back(sugg);
+                }
+            }
+            const vector<string_t> filtered = parser.suggest_next_argument(argv, partial, flag_match_allow_incomplete);
+            if (filtered != expected) {
+                err("Prefix suggestions: wrong suggestions for '%s' with partial '%s': got '%ls', expected '%ls'", argvs[i], partials[j], wide(join(filtered, ", ")), wide(join(expected, ", ")));
+            }
+        }
+    }
+}
+
+template<typename string_t>
+static void test_described_suggestions()
+{
+    typedef argument_parser_t<string_t> parser_t;
+    const parser_t parser(to_string<string_t>(
+        "Usage: prog checkout [options] <branch>\n"
+        "       prog push [-f] [--out=<path>] <remote>\n"
+        "Options: -v, --verbose  Be loud\n"
+        "         -q, --quiet\n"
+        "         -f, --force  Force it\n"
+        "Arguments: <branch>  git branch --list\n"), NULL);
+    const char *const argvs[] = {"prog", "prog checkout", "prog push", "prog push --out", "prog push -f"};
+    const char *const partials[] = {"", "-", "--v", "ch"};
+    for (size_t i=0; i < sizeof argvs / sizeof *argvs; i++) {
+        const vector<string_t> argv = split_nonempty<string_t>(argvs[i], ' ');
+        for (size_t j=0; j < sizeof partials / sizeof *partials; j++) {
+            // The texts are the plain suggestions, and the rest is what the individual lookups give
+            const string_t partial = to_string<string_t>(partials[j]);
+            const vector<string_t> plain = parser.suggest_next_argument(argv, partial, flag_match_allow_incomplete);
+            const vector<typename parser_t::suggestion_t> described = parser.describe_next_argument(argv, partial, flag_match_allow_incomplete);
+            if (described.size() != plain.size()) {
+                err("Described suggestions: got %lu suggestions for '%s', expected %lu", (unsigned long)described.size(), argvs[i], (unsigned long)plain.size());
+                continue;
+            }
+            for (size_t k=0; k < described.size(); k++) {
+                const typename parser_t::suggestion_t &sugg = described.at(k);
+                const string_t &text = plain.at(k);
+                suggestion_kind_t expected_kind = suggestion_fixed;
+                if (text.at(0) == '<') {
+                    expected_kind = suggestion_variable;
+                } else if (text.at(0) == '-') {
+                    expected_kind = suggestion_option;
+                }
+                const string_t expected_description = expected_kind == suggestion_option ? parser.description_for_option(text) : string_t();
+                const string_t expected_command = expected_kind == suggestion_variable ? parser.commands_for_variable(text) : string_t();
+                if (sugg.text != text || sugg.kind != expected_kind || sugg.description != expected_description || sugg.command != expected_command) {
+                    err("Described suggestions: wrong details for '%ls' after '%s'", wide(text), argvs[i]);
+                }
+            }
+        }
+    }
+    
+    // Spot check the details themselves
+    const vector<typename parser_t::suggestion_t> described = parser.describe_next_argument(split_nonempty<string_t>("prog checkout", ' '), string_t(), flag_match_allow_incomplete);
+    size_t seen = 0;
+    for (size_t i=0; i < described.size(); i++) {
+        const typename parser_t::suggestion_t &sugg = described.at(i);
+        if (sugg.text == to_string<string_t>("-v") && sugg.description == to_string<string_t>("Be loud")) {
+            seen |= 1;
+        } else if (sugg.text == to_string<string_t>("--quiet") && sugg.description.empty()) {
+            seen |= 2;
+        } else if (sugg.text == to_string<string_t>("<branch>") && sugg.command == to_string<string_t>("git branch --list")) {
+            seen |= 4;
+        }
+    }
+    if (seen != 7) {
+        err("Described suggestions: missing details, got mask %lu", (unsigned long)seen);
+    }
+}
+
+template<typename string_t>
+static void test_name_lookups()
+{
+    // Enough options and variables that lookups cannot get lucky
+    const size_t count = 300;
+    std::string doc = "Usage: prog [options] <var0>\nOptions:\n";
+    for (size_t i=0; i < count; i++) {
+        char line[128];
+        snprintf(line, sizeof line, "  -opt%lu, --option-%lu  Option number %lu\n", (unsigned long)i, (unsigned long)i, (unsigned long)i);
+        doc.append(line);
+    }
+    doc.append("  --undescribed\nArguments:\n");
+    for (size_t i=0; i < count; i++) {
+        char line[128];
+        snprintf(line, sizeof line, "  <var%lu>  command %lu\n", (unsigned long)i, (unsigned long)i);
+        doc.append(line);
+    }
+    const argument_parser_t<string_t> parser(to_string<string_t>(doc.c_str()), NULL);
+    
+    for (size_t i=0; i < count; i++) {
+        char single[64], dashed[64], description[64], var[64], command[64];
+        snprintf(single, sizeof single, "-opt%lu", (unsigned long)i);
+        snprintf(dashed, sizeof dashed, "--option-%lu", (unsigned long)i);
+        snprintf(description, sizeof description, "Option number %lu", (unsigned long)i);
+        snprintf(var, sizeof var, "<var%lu>", (unsigned long)i);
+        snprintf(command, sizeof command, "command %lu", (unsigned long)i);
+        if (parser.description_for_option(to_string<string_t>(single)) != to_string<string_t>(description) ||
+            parser.description_for_option(to_string<string_t>(dashed)) != to_string<string_t>(description)) {
+            err("Name lookups: wrong description for option %lu", (unsigned long)i);
+        }
+        if (parser.commands_for_variable(to_string<string_t>(var)) != to_string<string_t>(command)) {
+            err("Name lookups: wrong command for variable %lu", (unsigned long)i);
+        }
+    }
+    
+    // Names that are missing, or only partly present
+    const char *const missing_options[] = {"--undescribed", "--option-", "-opt", "--opt0", "-option-0", "--option-3000", "-"};
+    for (size_t i=0; i < sizeof missing_options / sizeof *missing_options; i++) {
+        if (! parser.description_for_option(to_string<string_t>(missing_options[i])).empty()) {
+            err("Name lookups: unexpected description for '%s'", missing_options[i]);
+        }
+    }
+    const char *const missing_variables[] = {"<var>", "var0", "<var3000>", ""};
+    for (size_t i=0; i < sizeof missing_variables / sizeof *missing_variables; i++) {
+        if (! parser.commands_for_variable(to_string<string_t>(missing_variables[i])).empty()) {
+            err("Name lookups: unexpected command for '%s'", missing_variables[i]);
+        }
+    }
+}
+
+template<typename string_t>
+static void test_cached_name_lists()
+{
+    typedef argument_parser_t<string_t> parser_t;
+    const parser_t parser(to_string<string_t>(
+        "Usage: git checkout <branch> [--track=<remote>]\n"
+        "       git push <remote> [<branch>]\n"
+        "       tig [<file>]\n"), NULL);
+    const vector<string_t> expected_commands = split_nonempty<string_t>("git tig", ' ');
+    const vector<string_t> expected_variables = split_nonempty<string_t>("<branch> <file> <remote>", ' ');
+    
+    // The lists are computed once, and shared by copies of the parser
+    const parser_t copy(parser);
+    const vector<string_t> &commands = parser.get_command_names();
+    const vector<string_t> &variables = parser.get_variables();
+    if (commands != expected_commands || variables != expected_variables) {
+        err("Cached name lists: wrong names, got '%ls' and '%ls'", wide(join(commands, " ")), wide(join(variables, " ")));
+    }
+    if (&parser.get_command_names() != &commands || &copy.get_command_names() != &commands ||
+        &parser.get_variables() != &variables || &copy.get_variables() != &variables) {
+        err("Cached name lists: lists were computed again");
+    }
+    
+    // Without a usage, the names come from the default usage, which needs compiling first
+    const parser_t usageless(to_string<string_t>("Options: -o, --out=<path>  Output"), NULL);
+    const vector<string_t> &default_commands = usageless.get_command_names();
+    if (default_commands.size() != 1 || &usageless.get_command_names() != &default_commands ||
+        usageless.get_variables() != vector<string_t>(1, to_string<string_t>("<path>"))) {
+        err("Cached name lists: wrong names for the default usage");
+    }
+}
+
+template<typename string_t>
+static void test_option_deduplication()
+{
+    typedef argument_parser_t<string_t> parser_t;
+    
+    // Many options, with every fiftieth repeated at the end. Each repeat is an error at the repeat, and the longest description wins.
+    const size_t count = 400;
+    std::string doc = "Usage: prog [options] [-o7]\nOptions:\n";
+    for (size_t i=0; i < count; i++) {
+        char line[128];
+        snprintf(line, sizeof line, "  -o%lu, --opt-%lu  Option %lu\n", (unsigned long)i, (unsigned long)i, (unsigned long)i);
+        doc.append(line);
+    }
+    const size_t first_repeat = doc.size();
+    for (size_t i=0; i < count; i += 50) {
+        char line[128];
+        snprintf(line, sizeof line, "  --opt-%lu  The repeated option %lu\n", (unsigned long)i, (unsigned long)i);
+        doc.append(line);
+    }
+    typename parser_t::error_list_t errors;
+    const parser_t parser(to_string<string_t>(doc.c_str()), &errors);
+    size_t repeat_errors = 0;
+    for (size_t i=0; i < errors.size(); i++) {
+        if (errors.at(i).code == error_option_duplicated_in_options_section && errors.at(i).location >= first_repeat) {
+            repeat_errors++;
+        }
+    }
+    if (repeat_errors != count / 50 || errors.size() != repeat_errors) {
+        err("Option deduplication: expected %lu errors at the repeats, got %lu of %lu", (unsigned long)(count / 50), (unsigned long)repeat_errors, (unsigned long)errors.size());
+    }
+    if (parser.description_for_option(to_string<string_t>("-o50")) != to_string<string_t>("The repeated option 50") ||
+        parser.description_for_option(to_string<string_t>("-o51")) != to_string<string_t>("Option 51")) {
+        err("Option deduplication: wrong descriptions after merging");
+    }
+    
+    // [options] does not match an option that the usage names itself, by any of its names
+    const char *const argvs[] = {"prog -o7 -o8", "prog -o8 -o9 -o7", "prog -o7 -o7", "prog -o7 --opt-7"};
+    const bool valid[] = {true, true, false, false};
+    for (size_t i=0; i < sizeof argvs / sizeof *argvs; i++) {
+        const vector<argument_status_t> statuses = parser.validate_arguments(split_nonempty<string_t>(argvs[i], ' '), flags_default);
+        const bool all_valid = std::find(statuses.begin(), statuses.end(), status_invalid) == statuses.end();
+        if (all_valid != valid[i]) {
+            err("Option deduplication: '%s' should be %s", argvs[i], valid[i] ? "valid" : "invalid");
+        }
+    }
+}
+
+template<typename string_t>
+static void test_line_scanning()
+{
+    typedef argument_parser_t<string_t> parser_t;
+    
+    // Tabs, CRLF endings, a continuation line, a blank line, and no trailing newline
+    const parser_t parser(to_string<string_t>(
+        "Usage:\tprog build <target> [options]\r\n"
+        "\t\t  [--jobs=<n>]\r\n"
+        "       prog clean [options]\n"
+        "\n"
+        "Options:\n"
+        "  -j <n>, --jobs=<n>  Number of jobs\n"
+        "  -v, --verbose  Be chatty"), NULL);
+    const char *const argvs[] = {"prog build x --jobs=3 -v", "prog clean -v", "prog build --jobs=3", "prog clean x"};
+    const bool valid[] = {true, true, false, false};
+    for (size_t i=0; i < sizeof argvs / sizeof *argvs; i++) {
+        const vector<argument_status_t> statuses = parser.validate_arguments(split_nonempty<string_t>(argvs[i], ' '), flags_default);
+        const bool all_valid = std::find(statuses.begin(), statuses.end(), status_invalid) == statuses.end();
+        if (all_valid != valid[i]) {
+            err("Line scanning: '%s' should be %s", argvs[i], valid[i] ? "valid" : "invalid");
+        }
+    }
+    if (parser.description_for_option(to_string<string_t>("-v")) != to_string<string_t>("Be chatty") ||
+        parser.description_for_option(to_string<string_t>("--jobs")) != to_string<string_t>("Number of jobs")) {
+        err("Line scanning: wrong option descriptions");
+    }
+    
+    // Put newlines at every offset within a block of sixteen characters
+    for (size_t pad=0; pad < 17; pad++) {
+        std::string doc = "Usage: prog [options]\nOptions:\n";
+        const size_t count = 8;
+        for (size_t i=0; i < count; i++) {
+            char line[128];
+            snprintf(line, sizeof line, "  --opt%lu%s  Option %lu\n", (unsigned long)i, std::string(pad + i, ' ').c_str(), (unsigned long)i);
+            doc.append(line);
+        }
+        const parser_t padded(to_string<string_t>(doc.c_str()), NULL);
+        for (size_t i=0; i < count; i++) {
+            char name[32], description[32];
+            snprintf(name, sizeof name, "--opt%lu", (unsigned long)i);
+            snprintf(description, sizeof description, "Option %lu", (unsigned long)i);
+            if (padded.description_for_option(to_string<string_t>(name)) != to_string<string_t>(description)) {
+                err("Line scanning: wrong description for '%s' with padding %lu", name, (unsigned long)pad);
+            }
+        }
+    }
+}
+
 template<typename string_t>
 void test_fuzzing() {
     const char *tokens[] =
@@ -2358,7 +4048,7 @@ void test_fuzzing() {
         "="
     };
     string_t storage;
-    std::vector<error_t> errors;
+    std::vector<docopt_fish::error_t> errors;
     const uint32_t token_count = sizeof tokens / sizeof *tokens;
     const uint32_t max_fuzz = 4; //could be raised up to 6 at the cost of some slowdown
     unsigned max_permutation = 1;
@@ -2401,6 +4091,31 @@ void do_all_tests() {
     test_errors_in_argv<string_t>();
     test_command_names<string_t>();
     test_get_variables<string_t>();
+    test_borrowed_argv<string_t>();
+    test_parse_result_view<string_t>();
+    test_reused_argument_map<string_t>();
+    test_argument_visitor<string_t>();
+    test_shared_parser<string_t>();
+    test_concurrent_parsing<string_t>();
+    test_parse_batch<string_t>();
+    test_compile_all<string_t>();
+    test_compiled_form<string_t>();
+    test_registry<string_t>();
+    test_lazy_compilation<string_t>();
+    test_apply_edit<string_t>();
+    test_complexity_analysis<string_t>();
+    test_match_budget<string_t>();
+    test_truncated_incomplete_match<string_t>();
+    test_async_queries<string_t>();
+    test_argv_session<string_t>();
+    test_argv_session_reuse<string_t>();
+    test_edited_revalidation<string_t>();
+    test_prefix_suggestions<string_t>();
+    test_described_suggestions<string_t>();
+    test_name_lookups<string_t>();
+    test_cached_name_lists<string_t>();
+    test_option_deduplication<string_t>();
+    test_line_scanning<string_t>();
     test_fuzzing<string_t>();
 }
 
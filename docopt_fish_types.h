@@ -6,6 +6,9 @@
 #include <cstring>
 #include <stdio.h>
 #include <stdint.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 /* Hide open and close brackets to avoid an annoying leading indent inside our class */
 #define OPEN_DOCOPT_IMPL {
@@ -141,6 +144,18 @@ private:
         return 0;
     }
     
+    template<typename T>
+    size_t hash_internal() const {
+        // FNV-1a over the character values, so that equal strings of either width hash alike
+        const T *p = this->ptr_begin<T>();
+        uint32_t hash = 2166136261U;
+        for (size_t i=0; i < this->length_; i++) {
+            char_t c = p[i];
+            hash = (hash ^ c) * 16777619U;
+        }
+        return hash;
+    }
+    
     template<typename T1>
     int compare_internal1(const rstring_t &rhs) const {
         switch (rhs.width()) {
@@ -163,6 +178,49 @@ private:
         return npos;
     }
     
+    template<typename T>
+    size_t find_newline_internal(size_t start) const {
+        const T *haystack = this->ptr_begin<T>();
+        for (size_t i=start; i < this->length_; i++) {
+            if (haystack[i] == '\n') {
+                return i;
+            }
+        }
+        return npos;
+    }
+    
+    size_t find_newline_narrow(size_t start) const {
+        size_t i = start;
+#if defined(__SSE2__)
+        // Compare sixteen characters at once. SSE2 is baseline on x86-64, so this needs no runtime dispatch.
+        const narrow_char_t *haystack = this->ptr_begin<narrow_char_t>();
+        const __m128i newlines = _mm_set1_epi8('\n');
+        for (; i + 16 <= this->length_; i += 16) {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(haystack + i));
+            unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, newlines));
+            if (mask != 0) {
+                return i + __builtin_ctz(mask);
+            }
+        }
+#endif
+        // Scalar tail, or the whole string without SSE2
+        return this->find_newline_internal<narrow_char_t>(i);
+    }
+    
+    template<typename T>
+    rstring_t trim_whitespace_internal() const {
+        const T *chars = this->ptr_begin<T>();
+        size_t left = 0, right = this->length_;
+        while (left < right && char_is_whitespace(chars[left])) {
+            left++;
+        }
+        while (right > left && char_is_whitespace(chars[right - 1])) {
+            right--;
+        }
+        assert(left <= right);
+        return this->substr(left, right - left);
+    }
+    
     typedef bool (*scan_predicate_t)(char_t);
     
     template<typename T, scan_predicate_t F>
@@ -253,6 +311,19 @@ public:
                 return this->find_1_internal<wide_char_t>(needle);
         }
     }
+    
+    // Returns the location of the first newline at or after start, or npos
+    size_t find_newline(size_t start) const {
+        assert(start <= this->length());
+        switch (this->width()) {
+            case width_narrow:
+                return this->find_newline_narrow(start);
+            case width_wide:
+                return this->find_newline_internal<wide_char_t>(start);
+        }
+        assert(0 && "Invalid width");
+        return npos;
+    }
 
     rstring_t substr_from(size_t offset) const {
         assert(offset <= this->length());
@@ -263,6 +334,16 @@ public:
         return this->base_;
     }
     
+    // Returns a pointer to our first character. The character type must match our width.
+    template<typename stdchar_t>
+    const stdchar_t *chars() const {
+        if (this->base_ == NULL) {
+            return NULL;
+        }
+        assert(this->width() == resolve_width<stdchar_t>());
+        return this->ptr_begin<stdchar_t>();
+    }
+    
     /* Merges another string into this string. If both strings are nonempty, they must have the same base pointer and width. */
     rstring_t merge(const rstring_t &rhs) const {
         if (this->empty()) {
@@ -299,6 +380,18 @@ public:
         }
     }
     
+    // Returns a hash of our characters. Equal strings have equal hashes, whatever their widths.
+    size_t hash() const {
+        switch (this->width()) {
+            case width_narrow:
+                return this->hash_internal<narrow_char_t>();
+            case width_wide:
+                return this->hash_internal<wide_char_t>();
+        }
+        assert(0 && "Invalid width");
+        return 0;
+    }
+    
     bool operator==(const rstring_t &rhs) const {
         return this->length() == rhs.length() && this->compare(rhs) == 0;
     }
@@ -331,6 +424,10 @@ public:
         return true;
     }
     
+    bool has_prefix(const rstring_t &s) const {
+        return s.length() <= this->length() && this->substr(0, s.length()) == s;
+    }
+    
     bool is_double_dash() const {
         return this->length() == 2 && this->at(0) == '-' && this->at(1) == '-';
     }
@@ -346,7 +443,7 @@ public:
     }
     
     template<typename stdstring_t>
-    const stdstring_t std_string() const {
+    stdstring_t std_string() const {
         stdstring_t result;
         this->copy_to(&result);
         return result;
@@ -418,15 +515,14 @@ public:
     
     // Returns a new string with leading and trailing whitespace trimmed
     rstring_t trim_whitespace() const {
-        size_t left = 0, right = this->length();
-        while (left < right && char_is_whitespace(this->at(left))) {
-            left++;
-        }
-        while (right > left && char_is_whitespace(this->at(right - 1))) {
-            right--;
+        switch (this->width()) {
+            case width_narrow:
+                return this->trim_whitespace_internal<narrow_char_t>();
+            case width_wide:
+                return this->trim_whitespace_internal<wide_char_t>();
         }
-        assert(left <= right);
-        return this->substr(left, right - left);
+        assert(0 && "Invalid width");
+        return rstring_t();
     }
 
     explicit rstring_t() : start_(0), length_(0), base_(NULL), width_(width_narrow) {}
@@ -435,10 +531,63 @@ public:
     template<typename stdchar_t>
     explicit rstring_t(const std::basic_string<stdchar_t> &b) : start_(0), length_(b.length()), base_(b.c_str()), width_(resolve_width<stdchar_t>()) {}
     
-    explicit rstring_t(const char *s, size_t len) : start_(0), length_(len), base_(s), width_(width_narrow) {}
+    // Constructor from a pointer and length, of either width. Like the above, this borrows the storage.
+    template<typename stdchar_t>
+    explicit rstring_t(const stdchar_t *s, size_t len) : start_(0), length_(len), base_(s), width_(resolve_width<stdchar_t>()) {}
 };
 
 
+/* A list that stores its first few elements inline, and only allocates once it grows past them. The element type must be cheap to default construct. Only the parts of the vector interface that we use are provided. */
+template<typename T, size_t INLINE_COUNT>
+class inline_list_t {
+    T inline_[INLINE_COUNT];
+    size_t size_;
+    std::vector<T> overflow_;
+    
+    public:
+    inline_list_t() : size_(0) {}
+    
+    size_t size() const {
+        return this->size_;
+    }
+    
+    bool empty() const {
+        return this->size_ == 0;
+    }
+    
+    void push_back(const T &val) {
+        if (this->size_ < INLINE_COUNT) {
+            this->inline_[this->size_] = val;
+        } else {
+            this->overflow_.push_back(val);
+        }
+        this->size_++;
+    }
+    
+    void clear() {
+        this->size_ = 0;
+        this->overflow_.clear();
+    }
+    
+    const T &operator[](size_t idx) const {
+        return idx < INLINE_COUNT ? this->inline_[idx] : this->overflow_[idx - INLINE_COUNT];
+    }
+    
+    T &operator[](size_t idx) {
+        return idx < INLINE_COUNT ? this->inline_[idx] : this->overflow_[idx - INLINE_COUNT];
+    }
+    
+    const T &at(size_t idx) const {
+        assert(idx < this->size_);
+        return (*this)[idx];
+    }
+    
+    T &at(size_t idx) {
+        assert(idx < this->size_);
+        return (*this)[idx];
+    }
+};
+
 /* An option represents something like '--foo=bar' */
 struct option_t {
     